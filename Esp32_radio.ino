@@ -181,17 +181,21 @@
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
 #include <SPI.h>
 #include <ArduinoOTA.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
 #include <esp_task_wdt.h>
 #include <esp_partition.h>
+#include <soc/gpio_struct.h>
 #include <driver/adc.h>
 #include <Update.h>
 #include <base64.h>
-// Number of entries in the queue
-#define QSIZ 400
+#include <lwip/sockets.h>
+#include <lwip/dns.h>
+// Size of the ring buffer for mp3 data.  Must be a power of 2
+#define RINGSIZ 16384
 // Debug buffer size
 #define DEBUG_BUFFER_SIZE 150
 #define NVSBUFSIZE 150
@@ -207,8 +211,14 @@
 #define NVSBUFSIZE 150
 // Position (column) of time in topline relative to end
 #define TIMEPOS -52
-// SPI speed for SD card
+// Default SPI speed for SD card, see "sd_speed"
 #define SDSPEED 1000000
+// Max. time [usec] to hold the SPI bus for one burst of data to the VS1053
+#define SPIHOLDMAX 2000
+// Bytes read from SD card or USB drive while holding the SPI bus
+#define FSSLICE 512
+// Max. time [msec] the ingest task sleeps if there is nothing to read
+#define INGESTWAIT 20
 // Size of metaline buffer
 #define METASIZ 1024
 // Max. number of NVS keys in table
@@ -229,6 +239,7 @@
 void        displaytime ( const char* str, uint16_t color = 0xFFFF ) ;
 void        showstreamtitle ( const char* ml, bool full = false ) ;
 void        handlebyte_ch ( uint8_t b ) ;
+void        handledata_ch ( uint8_t* p, int len ) ;
 void        handleFSf ( const String& pagename ) ;
 void        handleCmd()  ;
 char*       dbgprint( const char* format, ... ) ;
@@ -243,11 +254,15 @@ void        tftlog ( const char *str ) ;
 void        tftset ( uint16_t inx, const char *str ) ;
 void        tftset ( uint16_t inx, String& str ) ;
 void        playtask ( void * parameter ) ;       // Task to play the stream
+void        ingesttask ( void * parameter ) ;     // Task to read the stream
 void        spftask ( void * parameter ) ;        // Task for special functions
 void        gettime() ;
 void        reservepin ( int8_t rpinnr ) ;
 void        claimSPI ( const char* p ) ;          // Claim SPI bus for exclusive access
 void        releaseSPI() ;                        // Release the claim
+void        ctllock() ;                           // Lock player state against ingest task
+void        ctlstop() ;                           // Request to stop playing, with the lock
+void        ctlunlock() ;                         // Release the lock
 char        utf8ascii ( char ascii ) ;            // Convert UTF8 char to normal char
 void        utf8ascii_ip ( char* s ) ;            // In place conversion full string
 String      utf8ascii ( const char* s ) ;
@@ -270,11 +285,18 @@ struct scrseg_struct                                  // For screen segments
   String   str ;                                      // String to be displayed
 } ;
 
-enum qdata_type { QDATA, QSTARTSONG, QSTOPSONG } ;    // datatyp in qdata_struct
-struct qdata_struct
+enum qdata_type { QSTARTSONG, QSTOPSONG,             // Control functions for playtask
+                  QENDSONG } ;                       // End of data: play the rest, then stop
+
+#define QEDGES 16                                    // Frame boundaries passed with a stop
+
+struct qdata_struct                                  // Request in the control queue
 {
-  int datatyp ;                                       // Identifier
-  __attribute__((aligned(4))) uint8_t buf[32] ;       // Buffer for chunk
+  int            func ;                               // Control function
+  uint32_t       mark ;                               // Write position of mp3ring at request
+  uint32_t       tq ;                                 // Time of request in usec
+  uint8_t        nedge ;                              // Number of entries in edge[]
+  uint32_t       edge[QEDGES] ;                       // Next frame boundaries in mp3ring
 } ;
 
 struct ini_struct
@@ -309,10 +331,26 @@ struct ini_struct
   int8_t         spi_sck_pin ;                        // GPIO connected to SPI SCK pin
   int8_t         spi_miso_pin ;                       // GPIO connected to SPI MISO pin
   int8_t         spi_mosi_pin ;                       // GPIO connected to SPI MOSI pin
+  int8_t         hspi_sck_pin ;                       // GPIO for HSPI SCK, VS1053 on own bus
+  int8_t         hspi_miso_pin ;                      // GPIO for HSPI MISO
+  int8_t         hspi_mosi_pin ;                      // GPIO for HSPI MOSI
+  uint32_t       sd_speed ;                           // SPI clock for SD card in Hz
   int8_t         ch376_cs_pin ;                       // GPIO connected to CH376 SS
   int8_t         ch376_int_pin ;                      // GPIO connected to CH376 INT
   uint16_t       bat0 ;                               // ADC value for 0 percent battery charge
   uint16_t       bat100 ;                             // ADC value for 100 percent battery charge
+  uint16_t       prebuf_ms ;                          // High watermark prebuffer in msec
+  uint16_t       lowbuf_ms ;                          // Low watermark prebuffer in msec
+  bool           dnssave ;                            // Save DNS cache for presets in NVS
+  uint8_t        standby ;                            // Number of standby connections, 0 is off
+  uint8_t        rcretries ;                          // Reconnects before a station is skipped
+  bool           ratectl ;                            // Automatic rate control on/off
+  bool           fastzap ;                            // Fast cancel on station switch
+  int8_t         ingestcore ;                         // Core for ingest task, -1 is in loop()
+  uint8_t        ingestprio ;                         // Priority of ingest task
+  int8_t         playcore ;                           // Core for playtask
+  uint8_t        playprio ;                           // Priority of playtask
+  uint16_t       perfpub ;                            // Seconds between reports to MQTT, 0 is off
 } ;
 
 struct WifiInfo_t                                     // For list with WiFi info
@@ -367,6 +405,8 @@ enum datamode_t { INIT = 0x1, HEADER = 0x2, DATA = 0x4,      // State for datast
                   STOPREQD = 0x80, STOPPED = 0x100
                 } ;
 
+enum audio_t { AU_UNKNOWN, AU_MP3, AU_OGG } ;                // Type of audio in stream or file
+
 // Global variables
 int               DEBUG = 1 ;                            // Debug on/off
 int               numSsid ;                              // Number of available WiFi networks
@@ -381,18 +421,18 @@ HardwareSerial*   nxtserial = NULL ;                     // Serial port for NEXT
 TaskHandle_t      maintask ;                             // Taskhandle for main task
 TaskHandle_t      xplaytask ;                            // Task handle for playtask
 TaskHandle_t      xspftask ;                             // Task handle for special functions
+TaskHandle_t      xingesttask = NULL ;                   // Task handle for ingest task, if any
 SemaphoreHandle_t SPIsem = NULL ;                        // For exclusive SPI usage
+SPIClass*         vsspi = &SPI ;                         // SPI bus of the VS1053
+SemaphoreHandle_t ctlsem = NULL ;                        // Player state, if ingest task is used
 hw_timer_t*       timer = NULL ;                         // For timer
 char              timetxt[9] ;                           // Converted timeinfo
-char              cmd[130] ;                             // Command from MQTT or Serial
 uint8_t           tmpbuff[6000] ;                        // Input buffer for mp3 or data stream 
-QueueHandle_t     dataqueue ;                            // Queue for mp3 datastream
+QueueHandle_t     ctrlqueue ;                            // Queue for start/stop to playtask
 QueueHandle_t     spfqueue ;                             // Queue for special functions
-qdata_struct      outchunk ;                             // Data to queue
-qdata_struct      inchunk ;                              // Data from queue
-uint8_t*          outqp = outchunk.buf ;                 // Pointer to buffer in outchunk
 uint32_t          totalcount = 0 ;                       // Counter mp3 data
 datamode_t        datamode ;                             // State of datastream
+bool              stopdrain = false ;                    // Next stop is end of data, play the rest
 int               metacount ;                            // Number of bytes in metadata
 int               datacount ;                            // Counter databytes before metadata
 char              metalinebf[METASIZ + 1] ;              // Buffer for metaline/ID3 tags
@@ -400,7 +440,9 @@ int16_t           metalinebfx ;                          // Index for metalinebf
 String            icystreamtitle ;                       // Streamtitle from metadata
 String            icyname ;                              // Icecast station name
 String            ipaddress ;                            // Own IP-address
+String            perfsummary ;                          // Short performance report for MQTT
 int               bitrate ;                              // Bitrate in kb/sec
+audio_t           audiotype = AU_UNKNOWN ;               // Type of audio, from content-type or file
 int               mbitrate ;                             // Measured bitrate
 int               metaint = 0 ;                          // Number of databytes between metadata
 int16_t           currentpreset = -1 ;                   // Preset station playing
@@ -432,7 +474,16 @@ struct tm         timeinfo ;                             // Will be filled by NT
 bool              time_req = false ;                     // Set time requested
 uint16_t          adcval ;                               // ADC value (battery voltage)
 uint32_t          clength ;                              // Content length found in http header
+uint8_t           redirectcount = 0 ;                    // Number of successive redirects
+uint32_t          connectstart ;                         // Time of connect, for first audio time
 uint32_t          max_mp3loop_time = 0 ;                 // To check max handling time in mp3loop (msec)
+uint64_t          parsecycles = 0 ;                      // CPU cycles spent in handledata_ch()
+uint64_t          parsebytes = 0 ;                       // Bytes handled by handledata_ch()
+uint32_t          sdibytes = 0 ;                         // Bytes sent to VS1053 in bursts
+uint32_t          sditime = 0 ;                          // Time [usec] spent in these bursts
+uint32_t          spiholdcount = 0 ;                     // Number of bursts
+uint32_t          spiholdmax = 0 ;                       // Max. time [usec] SPI bus held for burst
+uint32_t          rebuffercount = 0 ;                    // Number of rebuffer events
 int16_t           scanios ;                              // TEST*TEST*TEST
 int16_t           scaniocount ;                          // TEST*TEST*TEST
 uint16_t          bltimer = 0 ;                          // Backlight time-out counter
@@ -562,7 +613,8 @@ touchpin_struct   touchpin[] =                           // Touch pins and progr
 //**************************************************************************************************
 // ID's for the items to publish to MQTT.  Is index in amqttpub[]
 enum { MQTT_IP,     MQTT_ICYNAME, MQTT_STREAMTITLE, MQTT_NOWPLAYING,
-       MQTT_PRESET, MQTT_VOLUME, MQTT_PLAYING, MQTT_PLAYLISTPOS
+       MQTT_PRESET, MQTT_VOLUME, MQTT_PLAYING, MQTT_PLAYLISTPOS,
+       MQTT_PERF
      } ;
 enum { MQSTRING, MQINT8, MQINT16 } ;                     // Type of variable to publish
 
@@ -578,7 +630,7 @@ class mqttpubc                                           // For MQTT publishing
     // Publication topics for MQTT.  The topic will be pefixed by "PREFIX/", where PREFIX is replaced
     // by the the mqttprefix in the preferences.
   protected:
-    mqttpub_struct amqttpub[9] =                   // Definitions of various MQTT topic to publish
+    mqttpub_struct amqttpub[10] =                  // Definitions of various MQTT topic to publish
     { // Index is equal to enum above
       { "ip",              MQSTRING, &ipaddress,        false }, // Definition for MQTT_IP
       { "icy/name",        MQSTRING, &icyname,          false }, // Definition for MQTT_ICYNAME
@@ -588,6 +640,7 @@ class mqttpubc                                           // For MQTT publishing
       { "volume" ,         MQINT8,   &ini_block.reqvol, false }, // Definition for MQTT_VOLUME
       { "playing",         MQINT8,   &playingstat,      false }, // Definition for MQTT_PLAYING
       { "playlist/pos",    MQINT16,  &playlist_num,     false }, // Definition for MQTT_PLAYLISTPOS
+      { "perf",            MQSTRING, &perfsummary,      false }, // Definition for MQTT_PERF
       { NULL,              0,        NULL,              false }  // End of definitions
     } ;
   public:
@@ -662,251 +715,3895 @@ void mqttpubc::publishtopic()
 mqttpubc         mqttpub ;                                    // Instance for mqttpubc
 
 
-//
 //**************************************************************************************************
-// VS1053 stuff.  Based on maniacbug library.                                                      *
+//                                     R I N G B U F _ C L A S S                                   *
 //**************************************************************************************************
-// VS1053 class definition.                                                                        *
+// Byte ring buffer for the mp3 data from mp3loop() to playtask.                                   *
+// There is one producer (mp3loop) and one consumer (playtask), so no locking is needed.  Head is  *
+// only changed by the producer, tail only by the consumer.  Both are free running counters, the   *
+// difference is the number of bytes in the buffer.                                                *
 //**************************************************************************************************
-class VS1053
+class ringbuf
 {
   private:
-    int8_t        cs_pin ;                         // Pin where CS line is connected
-    int8_t        dcs_pin ;                        // Pin where DCS line is connected
-    int8_t        dreq_pin ;                       // Pin where DREQ line is connected
-    int8_t        shutdown_pin ;                   // Pin where the shutdown line is connected
-    int8_t        shutdownx_pin ;                  // Pin where the shutdown (inversed) line is connected
-    uint8_t       curvol ;                         // Current volume setting 0..100%
-    const uint8_t vs1053_chunk_size = 32 ;
-    // SCI Register
-    const uint8_t SCI_MODE          = 0x0 ;
-    const uint8_t SCI_STATUS        = 0x1 ;
-    const uint8_t SCI_BASS          = 0x2 ;
-    const uint8_t SCI_CLOCKF        = 0x3 ;
-    const uint8_t SCI_AUDATA        = 0x5 ;
-    const uint8_t SCI_WRAM          = 0x6 ;
-    const uint8_t SCI_WRAMADDR      = 0x7 ;
-    const uint8_t SCI_AIADDR        = 0xA ;
-    const uint8_t SCI_VOL           = 0xB ;
-    const uint8_t SCI_AICTRL0       = 0xC ;
-    const uint8_t SCI_AICTRL1       = 0xD ;
-    const uint8_t SCI_num_registers = 0xF ;
-    // SCI_MODE bits
-    const uint8_t SM_SDINEW         = 11 ;        // Bitnumber in SCI_MODE always on
-    const uint8_t SM_RESET          = 2 ;         // Bitnumber in SCI_MODE soft reset
-    const uint8_t SM_CANCEL         = 3 ;         // Bitnumber in SCI_MODE cancel song
-    const uint8_t SM_TESTS          = 5 ;         // Bitnumber in SCI_MODE for tests
-    const uint8_t SM_LINE1          = 14 ;        // Bitnumber in SCI_MODE for Line input
-    SPISettings   VS1053_SPI ;                    // SPI settings for this slave
-    uint8_t       endFillByte ;                   // Byte to send when stopping song
-    bool          okay              = true ;      // VS1053 is working
-  protected:
-    inline void await_data_request() const
+    uint8_t                buf[RINGSIZ] ;                     // The data
+    std::atomic<uint32_t>  head ;                             // Total number of bytes written
+    std::atomic<uint32_t>  tail ;                             // Total number of bytes read
+  public:
+    ringbuf() : head ( 0 ), tail ( 0 ) {}
+    uint32_t      fill() const                                // Number of bytes in the buffer
     {
-      while ( ( dreq_pin >= 0 ) &&
-              ( !digitalRead ( dreq_pin ) ) )
-      {
-        NOP() ;                                   // Very short delay
-      }
+      return head.load ( std::memory_order_acquire ) -
+             tail.load ( std::memory_order_acquire ) ;
     }
-
-    inline void control_mode_on() const
+    uint32_t      space() const                               // Free space in the buffer
     {
-      SPI.beginTransaction ( VS1053_SPI ) ;       // Prevent other SPI users
-      digitalWrite ( cs_pin, LOW ) ;
+      return RINGSIZ - fill() ;
     }
-
-    inline void control_mode_off() const
+    uint32_t      write ( const uint8_t* p, uint32_t len ) ;  // Add data, producer only
+    uint32_t      peek ( uint8_t** p ) ;                      // Get contiguous data, consumer only
+    void          consume ( uint32_t len ) ;                  // Remove data, consumer only
+    void          reset_to ( uint32_t pos ) ;                 // Discard up to pos, consumer only
+    uint32_t      wrpos() const                               // Position of next byte to write
     {
-      digitalWrite ( cs_pin, HIGH ) ;             // End control mode
-      SPI.endTransaction() ;                      // Allow other SPI users
+      return head.load ( std::memory_order_acquire ) ;
     }
-
-    inline void data_mode_on() const
+    uint32_t      rdpos() const                               // Position of next byte to read
     {
-      SPI.beginTransaction ( VS1053_SPI ) ;       // Prevent other SPI users
-      //digitalWrite ( cs_pin, HIGH ) ;           // Bring slave in data mode
-      digitalWrite ( dcs_pin, LOW ) ;
+      return tail.load ( std::memory_order_acquire ) ;
     }
+} ;
 
-    inline void data_mode_off() const
-    {
-      digitalWrite ( dcs_pin, HIGH ) ;            // End data mode
-      SPI.endTransaction() ;                      // Allow other SPI users
-    }
 
-    uint16_t    read_register ( uint8_t _reg ) const ;
-    void        write_register ( uint8_t _reg, uint16_t _value ) const ;
-    inline bool sdi_send_buffer ( uint8_t* data, size_t len ) ;
-    void        sdi_send_fillers ( size_t length ) ;
-    void        wram_write ( uint16_t address, uint16_t data ) ;
-    uint16_t    wram_read ( uint16_t address ) ;
-    void        output_enable ( bool ena ) ;             // Enable amplifier through shutdown pin(s)
+//**************************************************************************************************
+// RINGBUF class implementation.                                                                   *
+//**************************************************************************************************
 
-  public:
-    // Constructor.  Only sets pin values.  Doesn't touch the chip.  Be sure to call begin()!
-    VS1053 ( int8_t _cs_pin, int8_t _dcs_pin, int8_t _dreq_pin,
-             int8_t _shutdown_pin, int8_t _shutdownx_pin ) ;
-    void     begin() ;                                   // Begin operation.  Sets pins correctly,
-    // and prepares SPI bus.
-    void     startSong() ;                               // Prepare to start playing. Call this each
-    // time a new song starts.
-    inline bool playChunk ( uint8_t* data,               // Play a chunk of data.  Copies the data to
-                            size_t len ) ;               // the chip.  Blocks until complete.
-    // Returns true if more data can be added
-    // to fifo
-    void     stopSong() ;                                // Finish playing a song. Call this after
-    // the last playChunk call.
-    void     setVolume ( uint8_t vol ) ;                 // Set the player volume.Level from 0-100,
-    // higher is louder.
-    void     setTone ( uint8_t* rtone ) ;                // Set the player baas/treble, 4 nibbles for
-    // treble gain/freq and bass gain/freq
-    inline uint8_t  getVolume() const                    // Get the current volume setting.
-    { // higher is louder.
-      return curvol ;
-    }
-    void     printDetails ( const char *header ) ;       // Print config details to serial output
-    void     softReset() ;                               // Do a soft reset
-    bool     testComm ( const char *header ) ;           // Test communication with module
-    inline bool data_request() const
-    {
-      return ( digitalRead ( dreq_pin ) == HIGH ) ;
-    }
-    void     AdjustRate ( long ppm2 ) ;                  // Fine tune the datarate
+//**************************************************************************************************
+//                                            W R I T E                                            *
+//**************************************************************************************************
+// Copy a span of data into the ring.  Returns the number of bytes that could be stored.           *
+//**************************************************************************************************
+uint32_t ringbuf::write ( const uint8_t* p, uint32_t len )
+{
+  uint32_t h = head.load ( std::memory_order_relaxed ) ;      // Own index
+  uint32_t x = h & ( RINGSIZ - 1 ) ;                          // Position in buffer
+  uint32_t n ;                                                // Bytes up to end of buffer
+
+  if ( len > space() )                                        // Limit to free space
+  {
+    len = space() ;
+  }
+  n = RINGSIZ - x ;                                           // Room before wrap
+  if ( n > len )
+  {
+    n = len ;
+  }
+  memcpy ( buf + x, p, n ) ;                                  // First part
+  memcpy ( buf, p + n, len - n ) ;                            // Part after wrap (may be empty)
+  head.store ( h + len, std::memory_order_release ) ;         // Publish to consumer
+  return len ;
+}
 
-} ;
 
 //**************************************************************************************************
-// VS1053 class implementation.                                                                    *
+//                                             P E E K                                             *
 //**************************************************************************************************
+// Get a pointer to the oldest data.  Returns the number of contiguous bytes at that pointer.      *
+//**************************************************************************************************
+uint32_t ringbuf::peek ( uint8_t** p )
+{
+  uint32_t t = tail.load ( std::memory_order_relaxed ) ;      // Own index
+  uint32_t x = t & ( RINGSIZ - 1 ) ;                          // Position in buffer
+  uint32_t n = head.load ( std::memory_order_acquire ) - t ;  // Bytes available
 
-VS1053::VS1053 ( int8_t _cs_pin, int8_t _dcs_pin, int8_t _dreq_pin,
-                 int8_t _shutdown_pin, int8_t _shutdownx_pin ) :
-  cs_pin(_cs_pin), dcs_pin(_dcs_pin), dreq_pin(_dreq_pin), shutdown_pin(_shutdown_pin),
-  shutdownx_pin(_shutdownx_pin)
+  *p = buf + x ;
+  if ( n > ( RINGSIZ - x ) )                                  // Limit to end of buffer
+  {
+    n = RINGSIZ - x ;
+  }
+  return n ;
+}
+
+
+//**************************************************************************************************
+//                                          C O N S U M E                                          *
+//**************************************************************************************************
+// Remove data from the ring after it has been handled.                                            *
+//**************************************************************************************************
+void ringbuf::consume ( uint32_t len )
 {
+  tail.store ( tail.load ( std::memory_order_relaxed ) + len,
+               std::memory_order_release ) ;                  // Free space for producer
 }
 
-uint16_t VS1053::read_register ( uint8_t _reg ) const
+
+//**************************************************************************************************
+//                                         R E S E T _ T O                                         *
+//**************************************************************************************************
+// Discard the data up to position pos.  The producer takes pos from wrpos() when it requests a    *
+// stop, so data of the next song that is written after the request is kept.                       *
+//**************************************************************************************************
+void ringbuf::reset_to ( uint32_t pos )
 {
-  uint16_t result ;
+  uint32_t t = tail.load ( std::memory_order_relaxed ) ;      // Own index
 
-  control_mode_on() ;
-  SPI.write ( 3 ) ;                                // Read operation
-  SPI.write ( _reg ) ;                             // Register to write (0..0xF)
-  // Note: transfer16 does not seem to work
-  result = ( SPI.transfer ( 0xFF ) << 8 ) |        // Read 16 bits data
-           ( SPI.transfer ( 0xFF ) ) ;
-  await_data_request() ;                           // Wait for DREQ to be HIGH again
-  control_mode_off() ;
-  return result ;
+  if ( (int32_t)( pos - t ) > 0 )                             // Mark ahead of read position?
+  {
+    tail.store ( pos, std::memory_order_release ) ;           // Yes, skip to it
+  }
 }
 
-void VS1053::write_register ( uint8_t _reg, uint16_t _value ) const
+ringbuf          mp3ring ;                                    // Ring buffer for mp3 data
+
+
+//**************************************************************************************************
+// HTTP response header parser.                                                                    *
+//**************************************************************************************************
+// Incremental parser for the headers of a HTTP (or ICY) response.  The response is fed byte by    *
+// byte, no String objects are created.  Only the values of the headers in hdrnames[] are kept,    *
+// all other headers are skipped.  Header names are compared case-insensitive.                     *
+//**************************************************************************************************
+#define HDRNAMESIZ 32                                         // Max. length of a header name
+#define HDRVALSIZ  256                                        // Max. length of a header value
+#define MAXREDIRECT 5                                         // Max. number of redirects
+
+enum hdrres_t { HDR_MORE, HDR_END, HDR_ERROR } ;              // Results of hdrparser::feed()
+
+enum hdrname_t { HN_LOCATION, HN_CONTENTTYPE, HN_CONTENTLENGTH, // Index in hdrnames[]
+                 HN_TRANSFERENC, HN_LASTMODIFIED, HN_ICYBR,
+                 HN_ICYMETAINT, HN_ICYNAME, HN_NONE } ;
+
+const char* const hdrnames[] =                                // Header names to look for
 {
-  control_mode_on( );
-  SPI.write ( 2 ) ;                                // Write operation
-  SPI.write ( _reg ) ;                             // Register to write (0..0xF)
-  SPI.write16 ( _value ) ;                         // Send 16 bits data
-  await_data_request() ;
-  control_mode_off() ;
+  "location", "content-type", "content-length",
+  "transfer-encoding", "last-modified", "icy-br",
+  "icy-metaint", "icy-name"
+} ;
+
+class hdrparser
+{
+  private:
+    enum { HS_STATUS, HS_NAME, HS_VALUE, HS_SKIP } ;          // States of the parser
+    uint8_t   state ;                                         // Current state
+    char      name[HDRNAMESIZ] ;                              // Name of current header
+    uint8_t   namex ;                                         // Index in name
+    uint8_t   hdrid ;                                         // Index in hdrnames[] or HN_NONE
+    char      value[HDRVALSIZ] ;                              // Value of current header
+    uint16_t  valuex ;                                        // Index in value
+    void      endline() ;                                     // Handle a complete header line
+    uint8_t   findname() ;                                    // Look up name in hdrnames[]
+  public:
+    int16_t   status ;                                        // HTTP status code, 0 if unknown
+    int       metaint ;                                       // From icy-metaint
+    int       bitrate ;                                       // From icy-br
+    uint32_t  clength ;                                       // From content-length
+    bool      chunked ;                                       // Transfer-encoding is chunked
+    bool      ctseen ;                                        // Content-type seen
+    audio_t   ctype ;                                         // Type of audio from content-type
+    char      location[HDRVALSIZ] ;                           // Location for redirect
+    char      icyname[64] ;                                   // From icy-name
+    char      lastmod[40] ;                                   // From last-modified
+    void      reset() ;                                       // Prepare for a new response
+    hdrres_t  feed ( uint8_t b ) ;                            // Handle next byte of response
+    bool      redirected()                                    // Redirect requested?
+              {
+                return ( location[0] &&
+                         ( ( status == 0 ) || ( status / 100 == 3 ) ) ) ;
+              }
+} ;
+
+
+//**************************************************************************************************
+//                                  H D R P A R S E R : : R E S E T                                *
+//**************************************************************************************************
+// Clear all results and expect a status line.                                                     *
+//**************************************************************************************************
+void hdrparser::reset()
+{
+  state = HS_STATUS ;
+  namex = 0 ;
+  valuex = 0 ;
+  status = 0 ;
+  metaint = 0 ;
+  bitrate = 0 ;
+  clength = 0xFFFFFFFF ;                                      // Content-length unknown
+  chunked = false ;
+  ctseen = false ;
+  ctype = AU_UNKNOWN ;
+  location[0] = '\0' ;
+  icyname[0] = '\0' ;
+  lastmod[0] = '\0' ;
 }
 
-bool VS1053::sdi_send_buffer ( uint8_t* data, size_t len )
+
+//**************************************************************************************************
+//                               H D R P A R S E R : : F I N D N A M E                             *
+//**************************************************************************************************
+// Look up the header name in hdrnames[].  Returns the index or HN_NONE if not interesting.        *
+//**************************************************************************************************
+uint8_t hdrparser::findname()
 {
-  size_t chunk_length ;                            // Length of chunk 32 byte or shorter
+  uint8_t i ;                                                 // Index in hdrnames[]
 
-  data_mode_on() ;
-  while ( len )                                    // More to do?
+  name[namex] = ' ' ;                                        // Delimit the name
+  for ( i = 0 ; i < HN_NONE ; i++ )
   {
-    chunk_length = len ;
-    if ( len > vs1053_chunk_size )
+    if ( strcasecmp ( name, hdrnames[i] ) == 0 )              // Known header?
     {
-      chunk_length = vs1053_chunk_size ;
+      break ;                                                 // Yes, this one
     }
-    len -= chunk_length ;
-    await_data_request() ;                         // Wait for space available
-    SPI.writeBytes ( data, chunk_length ) ;
-    data += chunk_length ;
   }
-  data_mode_off() ;
-  return data_request() ;                          // True if more data can de stored in fifo
+  return i ;
 }
 
-void VS1053::sdi_send_fillers ( size_t len )
+
+//**************************************************************************************************
+//                                H D R P A R S E R : : E N D L I N E                              *
+//**************************************************************************************************
+// A complete line has been received.  Store the value of a known header.                          *
+//**************************************************************************************************
+void hdrparser::endline()
 {
-  size_t chunk_length ;                            // Length of chunk 32 byte or shorter
+  char* p ;                                                   // Points into value
 
-  data_mode_on() ;
-  while ( len )                                    // More to do?
+  while ( valuex && ( value[valuex - 1] == ' ' ) )            // Remove trailing spaces
   {
-    await_data_request() ;                         // Wait for space available
-    chunk_length = len ;
-    if ( len > vs1053_chunk_size )
+    valuex-- ;
+  }
+  value[valuex] = '\0' ;                                      // Delimit the value
+  if ( state == HS_STATUS )                                   // Status line?
+  {
+    // Like "HTTP/1.1 200 OK" or "ICY 200 OK".  A header line here means there is no status line.
+    p = strchr ( value, ' ' ) ;                               // Search for status code
+    if ( p && ( ( strncmp ( value, "HTTP/", 5 ) == 0 ) ||
+                ( strncmp ( value, "ICY ", 4 ) == 0 ) ) )
     {
-      chunk_length = vs1053_chunk_size ;
+      status = atoi ( p + 1 ) ;                               // Get the status code
+      return ;
     }
-    len -= chunk_length ;
-    while ( chunk_length-- )
+    p = strchr ( value, ':' ) ;                               // Split "name: value"
+    if ( ( p == NULL ) || ( ( p - value ) >= HDRNAMESIZ ) )   // Looks like a header?
     {
-      SPI.write ( endFillByte ) ;
+      return ;                                                // No, ignore the line
     }
+    namex = p - value ;                                       // Length of the name
+    memcpy ( name, value, namex ) ;
+    hdrid = findname() ;                                      // Known header?
+    if ( hdrid == HN_NONE )
+    {
+      return ;                                                // No, nothing to store
+    }
+    do
+    {
+      p++ ;                                                   // Skip colon and leading spaces
+    } while ( *p == ' ' ) ;
+    memmove ( value, p, strlen ( p ) + 1 ) ;                  // Keep only the value
+  }
+  else if ( state != HS_VALUE )                               // Header to keep?
+  {
+    return ;                                                  // No, nothing to store
+  }
+  switch ( hdrid )
+  {
+    case HN_LOCATION :
+      strcpy ( location, value ) ;
+      break ;
+    case HN_CONTENTTYPE :
+      ctseen = true ;                                         // Remember seeing this
+      for ( p = value ; *p ; p++ )                            // Use lower case for compare
+      {
+        *p = tolower ( *p ) ;
+      }
+      if ( strstr ( value, "mpeg" ) ||                        // Like "audio/mpeg"
+           strstr ( value, "mp3" ) )                          // or "audio/mp3"
+      {
+        ctype = AU_MP3 ;
+      }
+      else if ( strstr ( value, "ogg" ) ||                    // Like "application/ogg"
+                strstr ( value, "opus" ) )                    // or "audio/opus"
+      {
+        ctype = AU_OGG ;
+      }
+      break ;
+    case HN_CONTENTLENGTH :
+      clength = atoi ( value ) ;
+      break ;
+    case HN_TRANSFERENC :
+      chunked = ( strcasecmp ( value, "chunked" ) == 0 ) ;
+      break ;
+    case HN_LASTMODIFIED :
+      strncpy ( lastmod, value, sizeof(lastmod) - 1 ) ;
+      lastmod[sizeof(lastmod) - 1] = '\0' ;                   // Be sure it is delimited
+      break ;
+    case HN_ICYBR :
+      bitrate = atoi ( value ) ;                              // Found bitrate tag, read the bitrate
+      if ( bitrate == 0 )                                     // For Ogg br is like "Quality 2"
+      {
+        bitrate = 87 ;                                        // Dummy bitrate
+      }
+      break ;
+    case HN_ICYMETAINT :
+      metaint = atoi ( value ) ;
+      break ;
+    case HN_ICYNAME :
+      strncpy ( icyname, value, sizeof(icyname) - 1 ) ;
+      icyname[sizeof(icyname) - 1] = '\0' ;                   // Be sure it is delimited
+      break ;
   }
-  data_mode_off();
-}
-
-void VS1053::wram_write ( uint16_t address, uint16_t data )
-{
-  write_register ( SCI_WRAMADDR, address ) ;
-  write_register ( SCI_WRAM, data ) ;
 }
 
-uint16_t VS1053::wram_read ( uint16_t address )
-{
-  write_register ( SCI_WRAMADDR, address ) ;            // Start reading from WRAM
-  return read_register ( SCI_WRAM ) ;                   // Read back result
-}
 
-bool VS1053::testComm ( const char *header )
+//**************************************************************************************************
+//                                  H D R P A R S E R : : F E E D                                  *
+//**************************************************************************************************
+// Handle the next byte of the response.  Returns HDR_END if an empty line (end of the headers) is *
+// seen, HDR_ERROR if the status line shows an error (4xx or 5xx) and HDR_MORE otherwise.          *
+// After HDR_END the parser continues with the next header line.                                   *
+//**************************************************************************************************
+hdrres_t hdrparser::feed ( uint8_t b )
 {
-  // Test the communication with the VS1053 module.  The result wille be returned.
-  // If DREQ is low, there is problably no VS1053 connected.  Pull the line HIGH
-  // in order to prevent an endless loop waiting for this signal.  The rest of the
-  // software will still work, but readbacks from VS1053 will fail.
-  int            i ;                                    // Loop control
-  uint16_t       r1, r2, cnt = 0 ;
-  uint16_t       delta = 300 ;                          // 3 for fast SPI
-  const uint16_t vstype[] = { 1001, 1011, 1002, 1003,   // Possible chip versions
-                              1053, 1033, 0000, 1103 } ;
-  
-  dbgprint ( header ) ;                                 // Show a header
-  if ( !digitalRead ( dreq_pin ) )
-  {
-    dbgprint ( "VS1053 not properly installed!" ) ;
-    // Allow testing without the VS1053 module
-    pinMode ( dreq_pin,  INPUT_PULLUP ) ;               // DREQ is now input with pull-up
-    return false ;                                      // Return bad result
-  }
-  // Further TESTING.  Check if SCI bus can write and read without errors.
-  // We will use the volume setting for this.
-  // Will give warnings on serial output if DEBUG is active.
-  // A maximum of 20 errors will be reported.
-  if ( strstr ( header, "Fast" ) )
+  if ( ( b > 0x7F ) ||                                        // Ignore unprintable characters
+       ( b == '\r' ) ||                                       // Ignore CR
+       ( b == '\0' ) )                                        // Ignore NULL
   {
-    delta = 3 ;                                         // Fast SPI, more loops
+    return HDR_MORE ;
   }
-  for ( i = 0 ; ( i < 0xFFFF ) && ( cnt < 20 ) ; i += delta )
+  if ( b == '\n' )                                            // End of line?
   {
-    write_register ( SCI_VOL, i ) ;                     // Write data to SCI_VOL
-    r1 = read_register ( SCI_VOL ) ;                    // Read back for the first time
-    r2 = read_register ( SCI_VOL ) ;                    // Read back a second time
-    if  ( r1 != r2 || i != r1 || i != r2 )              // Check for 2 equal reads
+    if ( ( state == HS_NAME ) && ( namex == 0 ) )             // Empty line?
     {
-      dbgprint ( "VS1053 SPI error. SB:%04X R1:%04X R2:%04X", i, r1, r2 ) ;
-      cnt++ ;
-      delay ( 10 ) ;
+      return HDR_END ;                                        // Yes, end of headers
     }
-  }
+    endline() ;                                               // Handle the line
+    if ( status >= 400 )                                      // Error reply?
+    {
+      return HDR_ERROR ;                                      // Yes, fail fast
+    }
+    state = HS_NAME ;                                         // Next is a header name
+    namex = 0 ;
+    valuex = 0 ;
+    return HDR_MORE ;
+  }
+  switch ( state )
+  {
+    case HS_STATUS :                                          // Status line is kept in value
+    case HS_VALUE :
+      if ( ( valuex == 0 ) && ( b == ' ' ) )                  // Skip leading spaces
+      {
+        break ;
+      }
+      if ( valuex < ( HDRVALSIZ - 1 ) )                       // Prevent overflow
+      {
+        value[valuex++] = b ;
+      }
+      break ;
+    case HS_NAME :
+      if ( b == ':' )                                         // End of name?
+      {
+        hdrid = findname() ;                                  // Yes, search in table
+        state = ( hdrid == HN_NONE ) ? HS_SKIP : HS_VALUE ;   // Skip value if not interesting
+      }
+      else if ( ( isalnum ( b ) || ( b == '-' ) ) &&          // Legal character in name?
+                ( namex < ( HDRNAMESIZ - 1 ) ) )
+      {
+        name[namex++] = b ;                                   // Yes, store
+      }
+      else
+      {
+        state = HS_SKIP ;                                     // No, ignore this line
+      }
+      break ;
+    default :                                                 // HS_SKIP
+      break ;
+  }
+  return HDR_MORE ;
+}
+
+hdrparser        hdrp ;                                       // Parser for HTTP response headers
+
+
+//**************************************************************************************************
+// DNS cache.                                                                                      *
+//**************************************************************************************************
+// Small cache for the IP addresses of stream hosts.  lwIP does not give the TTL of a DNS reply to *
+// the caller, so every entry is valid for DNSTTL seconds.  Entries that are still in use are      *
+// refreshed in the background by spftask before they expire.  The entries for the current and the *
+// adjacent presets can be saved in NVS, so the first connect after a restart is fast too.         *
+//**************************************************************************************************
+#define DNSCACHESIZ 8                                         // Number of entries in cache
+#define DNSNAMESIZ  48                                        // Max. length of a hostname
+#define DNSTTL      600                                       // Validity of an entry in seconds
+#define DNSNVSTTL   60                                        // Validity of an entry from NVS
+#define DNSNVSNUM   3                                         // Number of entries saved in NVS
+
+struct dnsentry_struct                                        // An entry in the DNS cache
+{
+  char            name[DNSNAMESIZ] ;                          // Hostname
+  uint32_t        ip ;                                        // IP address, 0 if entry is free
+  uint32_t        expires ;                                   // Time of expiry in millis()
+  uint32_t        used ;                                      // Time of last use in millis()
+} ;
+
+class dnscachec
+{
+  private:
+    dnsentry_struct   entry[DNSCACHESIZ] ;                    // The cached entries
+    portMUX_TYPE      mux = portMUX_INITIALIZER_UNLOCKED ;    // Protects entry[]
+    int8_t            refx = -1 ;                             // Entry being refreshed or -1
+    char              refname[DNSNAMESIZ] ;                   // Hostname being refreshed
+    volatile bool     refdone ;                               // Set by DNS callback
+    volatile uint32_t refip ;                                 // Result of refresh
+    uint32_t          reftime = 0 ;                           // Start of last refresh
+    dnsentry_struct   saved[DNSNVSNUM] ;                      // Contents of NVS
+    nvs_handle        handle = 0 ;                            // Handle for NVS namespace
+    int               find ( const char* name ) ;             // Find entry for hostname
+    static void       refreshed ( const char* name,           // Callback for refresh
+                                  const ip_addr_t* ipaddr,
+                                  void* arg ) ;
+  public:
+    uint32_t          hits = 0 ;                              // Number of cache hits
+    uint32_t          misses = 0 ;                            // Number of cache misses
+    uint32_t          missms = 0 ;                            // Total lookup time for misses
+    uint32_t          get ( const char* name ) ;              // Get IP address from cache
+    void              put ( const char* name, uint32_t ip,    // Add or update an entry
+                            uint32_t ttl ) ;
+    void              drop ( const char* name ) ;             // Remove an entry
+    void              missed ( uint32_t ms ) ;                // Count a miss
+    uint32_t          savedms() ;                             // Estimated time saved by cache
+    void              refresh() ;                             // Background refresh
+    void              load() ;                                // Load entries from NVS
+    void              save() ;                                // Save entries for presets to NVS
+} ;
+
+
+//**************************************************************************************************
+//                                D N S C A C H E C : : F I N D                                    *
+//**************************************************************************************************
+// Find the entry for a hostname.  Returns the index or -1 if not found.  Call with mux taken.     *
+//**************************************************************************************************
+int dnscachec::find ( const char* name )
+{
+  int i ;                                                     // Index in entry[]
+
+  for ( i = 0 ; i < DNSCACHESIZ ; i++ )
+  {
+    if ( entry[i].ip && ( strcmp ( entry[i].name, name ) == 0 ) )
+    {
+      return i ;                                              // Found
+    }
+  }
+  return -1 ;                                                 // Not found
+}
+
+
+//**************************************************************************************************
+//                                 D N S C A C H E C : : G E T                                     *
+//**************************************************************************************************
+// Get the IP address of a host from the cache.  Returns 0 if not in cache or expired.             *
+//**************************************************************************************************
+uint32_t dnscachec::get ( const char* name )
+{
+  uint32_t ip = 0 ;                                           // Result, assume not found
+  int      i ;                                                // Index in entry[]
+
+  portENTER_CRITICAL ( &mux ) ;
+  i = find ( name ) ;
+  if ( ( i >= 0 ) &&                                          // Found and not expired?
+       ( (int32_t)( entry[i].expires - millis() ) > 0 ) )
+  {
+    ip = entry[i].ip ;                                        // Yes, get address
+    entry[i].used = millis() ;                                // Keep it fresh
+  }
+  portEXIT_CRITICAL ( &mux ) ;
+  if ( ip )
+  {
+    hits++ ;                                                  // Count hits
+  }
+  return ip ;
+}
+
+
+//**************************************************************************************************
+//                                 D N S C A C H E C : : P U T                                     *
+//**************************************************************************************************
+// Add or update the entry for a hostname.  If the cache is full, the least recently used entry    *
+// is replaced.  ttl is in seconds.                                                                *
+//**************************************************************************************************
+void dnscachec::put ( const char* name, uint32_t ip, uint32_t ttl )
+{
+  int i ;                                                     // Index in entry[]
+  int j ;                                                     // Index of oldest entry
+
+  if ( ( ip == 0 ) || ( strlen ( name ) >= DNSNAMESIZ ) )     // Something to store?
+  {
+    return ;                                                  // No
+  }
+  portENTER_CRITICAL ( &mux ) ;
+  i = find ( name ) ;                                         // Already in cache?
+  if ( i < 0 )
+  {
+    i = 0 ;                                                   // No, find free or oldest entry
+    for ( j = 1 ; j < DNSCACHESIZ ; j++ )
+    {
+      if ( ( entry[i].ip != 0 ) &&
+           ( ( entry[j].ip == 0 ) ||
+             ( (int32_t)( entry[j].used - entry[i].used ) < 0 ) ) )
+      {
+        i = j ;
+      }
+    }
+    strncpy ( entry[i].name, name, DNSNAMESIZ ) ;             // Set name, pad with zeroes
+    entry[i].used = millis() ;
+  }
+  entry[i].ip = ip ;                                          // Set (new) address
+  entry[i].expires = millis() + ttl * 1000 ;                  // and expiry time
+  portEXIT_CRITICAL ( &mux ) ;
+}
+
+
+//**************************************************************************************************
+//                                D N S C A C H E C : : D R O P                                    *
+//**************************************************************************************************
+// Remove an entry, for example because the address did not work.                                  *
+//**************************************************************************************************
+void dnscachec::drop ( const char* name )
+{
+  int i ;                                                     // Index in entry[]
+
+  portENTER_CRITICAL ( &mux ) ;
+  i = find ( name ) ;
+  if ( i >= 0 )
+  {
+    entry[i].ip = 0 ;                                         // Free the entry
+  }
+  portEXIT_CRITICAL ( &mux ) ;
+}
+
+
+//**************************************************************************************************
+//                              D N S C A C H E C : : M I S S E D                                  *
+//**************************************************************************************************
+// Count a cache miss and the time the real lookup took.                                           *
+//**************************************************************************************************
+void dnscachec::missed ( uint32_t ms )
+{
+  misses++ ;
+  missms += ms ;
+}
+
+
+//**************************************************************************************************
+//                             D N S C A C H E C : : S A V E D M S                                 *
+//**************************************************************************************************
+// Estimate the time saved by the cache: each hit saves the average lookup time of the misses.     *
+//**************************************************************************************************
+uint32_t dnscachec::savedms()
+{
+  if ( misses == 0 )                                          // Any lookup time known?
+  {
+    return 0 ;                                                // No, cannot estimate
+  }
+  return hits * ( missms / misses ) ;
+}
+
+
+//**************************************************************************************************
+//                            D N S C A C H E C : : R E F R E S H E D                              *
+//**************************************************************************************************
+// Callback for the DNS lookup of refresh().  Runs in the context of the TCP/IP task.  A late      *
+// reply for an older refresh is ignored.                                                          *
+//**************************************************************************************************
+void dnscachec::refreshed ( const char* name, const ip_addr_t* ipaddr, void* arg )
+{
+  dnscachec* dc = (dnscachec*)arg ;                           // The cache
+
+  portENTER_CRITICAL ( &dc->mux ) ;
+  if ( ( dc->refx >= 0 ) && name &&                           // Reply for current refresh?
+       ( strcmp ( name, dc->refname ) == 0 ) )
+  {
+    dc->refip = ipaddr ? ip4_addr_get_u32 ( ip_2_ip4 ( ipaddr ) ) : 0 ;
+    dc->refdone = true ;                                      // Signal result is available
+  }
+  portEXIT_CRITICAL ( &dc->mux ) ;
+}
+
+
+//**************************************************************************************************
+//                              D N S C A C H E C : : R E F R E S H                                *
+//**************************************************************************************************
+// Refresh an entry that will expire within a minute, but was used in the last 30 minutes.         *
+// Called from spftask.  Only one lookup is done at the same time, and at most once per 10 secs.   *
+//**************************************************************************************************
+void dnscachec::refresh()
+{
+  ip_addr_t addr ;                                            // Result if available at once
+  char      name[DNSNAMESIZ] ;                                // Hostname to refresh
+  int       i ;                                               // Index in entry[]
+
+  if ( refx >= 0 )                                            // Refresh in progress?
+  {
+    if ( refdone )                                            // Yes, result available?
+    {
+      portENTER_CRITICAL ( &mux ) ;
+      i = find ( refname ) ;                                  // Entry may be replaced meanwhile
+      if ( ( i >= 0 ) && refip )                              // Still there and lookup okay?
+      {
+        entry[i].ip = refip ;                                 // Yes, update entry
+        entry[i].expires = millis() + DNSTTL * 1000 ;
+      }
+      refx = -1 ;
+      portEXIT_CRITICAL ( &mux ) ;
+    }
+    else if ( ( millis() - reftime ) > 5000 )                 // Time-out?
+    {
+      portENTER_CRITICAL ( &mux ) ;
+      refx = -1 ;                                             // Yes, a late reply is ignored
+      portEXIT_CRITICAL ( &mux ) ;
+    }
+    return ;
+  }
+  if ( ( millis() - reftime ) < 10000 )                       // Limit refresh rate
+  {
+    return ;
+  }
+  reftime = millis() ;
+  portENTER_CRITICAL ( &mux ) ;
+  for ( i = 0 ; i < DNSCACHESIZ ; i++ )                       // Search for an entry to refresh
+  {
+    if ( entry[i].ip &&
+         ( (int32_t)( entry[i].expires - millis() ) < 60000 ) &&
+         ( ( millis() - entry[i].used ) < 1800000 ) )
+    {
+      refx = i ;                                              // Found one
+      strcpy ( refname, entry[i].name ) ;
+      strcpy ( name, refname ) ;
+      refdone = false ;
+      break ;
+    }
+  }
+  portEXIT_CRITICAL ( &mux ) ;
+  if ( refx < 0 )                                             // Anything to refresh?
+  {
+    return ;                                                  // No
+  }
+  if ( dns_gethostbyname ( name, &addr, refreshed, this ) == ERR_OK )
+  {
+    refip = ip4_addr_get_u32 ( ip_2_ip4 ( &addr ) ) ;         // Result is available now
+    refdone = true ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                 D N S C A C H E C : : L O A D                                   *
+//**************************************************************************************************
+// Load the entries saved in NVS.  They are valid for a short time only, and will be refreshed.    *
+//**************************************************************************************************
+void dnscachec::load()
+{
+  size_t len = sizeof(saved) ;                                // Length of blob
+  int    i ;                                                  // Index in saved[]
+
+  if ( nvs_open ( "dnscache", NVS_READWRITE, &handle ) )      // Open own namespace
+  {
+    handle = 0 ;                                              // Failed
+    return ;
+  }
+  if ( nvs_get_blob ( handle, "hosts", saved, &len ) ||       // Read the entries
+       ( len != sizeof(saved) ) )
+  {
+    memset ( saved, 0, sizeof(saved) ) ;                      // Nothing saved
+    return ;
+  }
+  for ( i = 0 ; i < DNSNVSNUM ; i++ )
+  {
+    saved[i].name[DNSNAMESIZ - 1] = '\0' ;                    // Be sure it is delimited
+    put ( saved[i].name, saved[i].ip, DNSNVSTTL ) ;           // Add to cache
+  }
+}
+
+
+//**************************************************************************************************
+//                                 D N S C A C H E C : : S A V E                                   *
+//**************************************************************************************************
+// Save the cached addresses of the hosts of the current and adjacent presets in NVS.  Writing     *
+// only takes place if the contents has changed.                                                   *
+//**************************************************************************************************
+void dnscachec::save()
+{
+  dnsentry_struct nv[DNSNVSNUM] ;                             // New contents
+  String          url ;                                       // URL of a preset
+  int             inx ;                                       // Position in URL
+  int             d ;                                         // Offset to current preset
+  int             i ;                                         // Index in entry[]
+
+  if ( handle == 0 )                                          // Namespace opened?
+  {
+    return ;                                                  // No, cannot save
+  }
+  memset ( nv, 0, sizeof(nv) ) ;
+  for ( d = -1 ; d <= 1 ; d++ )                               // Previous, current and next preset
+  {
+    url = readhostfrompref ( currentpreset + d ) ;            // Get URL of preset
+    chomp ( url ) ;                                           // Get rid of part after "#"
+    if ( url.startsWith ( "ihr/" ) )                          // iHeartRadio station?
+    {
+      url = "playerservices.streamtheworld.com" ;             // Yes, use XML host
+    }
+    inx = url.indexOf ( "/" ) ;                               // Remove extension
+    if ( inx >= 0 )
+    {
+      url = url.substring ( 0, inx ) ;
+    }
+    inx = url.indexOf ( ":" ) ;                               // Remove port number
+    if ( inx >= 0 )
+    {
+      url = url.substring ( 0, inx ) ;
+    }
+    portENTER_CRITICAL ( &mux ) ;
+    i = find ( url.c_str() ) ;                                // Address known?
+    if ( i >= 0 )
+    {
+      nv[d + 1] = entry[i] ;                                  // Yes, copy entry
+      nv[d + 1].expires = 0 ;                                 // Times are not saved
+      nv[d + 1].used = 0 ;
+    }
+    portEXIT_CRITICAL ( &mux ) ;
+  }
+  if ( memcmp ( nv, saved, sizeof(nv) ) == 0 )                // Any change?
+  {
+    return ;                                                  // No, do not write
+  }
+  memcpy ( saved, nv, sizeof(saved) ) ;                       // Remember new contents
+  if ( nvs_set_blob ( handle, "hosts", saved, sizeof(saved) ) == ESP_OK )
+  {
+    nvs_commit ( handle ) ;
+  }
+}
+
+dnscachec        dnscache ;                                   // Cache for IP addresses of hosts
+
+
+//**************************************************************************************************
+// Non-blocking connection to a stream host.                                                       *
+//**************************************************************************************************
+// The connection is set up in steps: resolve the hostname, connect the TCP socket and send the    *
+// request.  Each step has its own time-out.  The steps are driven by poll(), that will never     *
+// block.  After the request has been sent, the socket is handed over to a WiFiClient and the      *
+// connection waits for the end of the response headers.                                          *
+//**************************************************************************************************
+#define CONNTIMEOUT 5000                                      // Time-out for each step in msec
+
+enum connstate_t { CS_IDLE, CS_RESOLVE, CS_CONNECT,           // States of the connection
+                   CS_HEADERS, CS_FAILED } ;
+
+class netconn
+{
+  private:
+    uint16_t          port ;                                  // Port number of host
+    String            request ;                               // Request to send after connect
+    int               fd ;                                    // Socket during connect
+    uint32_t          t0 ;                                    // Start time of current step
+    volatile bool     dnsdone ;                               // Set by DNS callback
+    volatile uint32_t dnsip ;                                 // Result of DNS lookup, 0 is failure
+    bool              cached ;                                // Address came from dnscache
+    static void       dnsfound ( const char* name,            // Callback for DNS lookup
+                                 const ip_addr_t* ipaddr,
+                                 void* arg ) ;
+    void              fail ( const char* reason ) ;           // Handle a failed step
+  public:
+    connstate_t       state ;                                 // Current state
+    char              hostname[64] ;                          // Host to connect to
+    uint32_t          dnsms ;                                 // Duration of DNS lookup
+    uint32_t          connms ;                                // Duration of TCP connect
+                      netconn() : fd ( -1 ), state ( CS_IDLE ) {}
+    void              start ( const char* name, uint16_t prt, // Start a new connection
+                              const String& req ) ;
+    void              abort() ;                               // Cancel connection in progress
+    connstate_t       poll ( WiFiClient& client,              // Advance to next step if possible
+                             bool hdrdone ) ;
+} ;
+
+
+//**************************************************************************************************
+//                                 N E T C O N N : : D N S F O U N D                               *
+//**************************************************************************************************
+// Callback for dns_gethostbyname().  Runs in the context of the TCP/IP task.  Results for an old  *
+// request are ignored.                                                                            *
+//**************************************************************************************************
+void netconn::dnsfound ( const char* name, const ip_addr_t* ipaddr, void* arg )
+{
+  netconn* nc = (netconn*)arg ;                               // The connection that asked
+
+  if ( ( nc->state != CS_RESOLVE ) ||                         // Still waiting for this one?
+       strcmp ( name, nc->hostname ) )
+  {
+    return ;                                                  // No, ignore
+  }
+  nc->dnsip = ipaddr ? ip4_addr_get_u32 ( ip_2_ip4 ( ipaddr ) ) : 0 ;
+  nc->dnsdone = true ;                                        // Signal result is available
+}
+
+
+//**************************************************************************************************
+//                                     N E T C O N N : : F A I L                                   *
+//**************************************************************************************************
+// A step of the connection failed.  Close the socket if any.                                      *
+//**************************************************************************************************
+void netconn::fail ( const char* reason )
+{
+  dbgprint ( "Connect to %s failed: %s", hostname, reason ) ;
+  if ( cached && ( state == CS_CONNECT ) )                    // Cached address did not work?
+  {
+    dnscache.drop ( hostname ) ;                              // Yes, remove from cache
+  }
+  abort() ;                                                   // Close socket
+  state = CS_FAILED ;
+}
+
+
+//**************************************************************************************************
+//                                    N E T C O N N : : S T A R T                                  *
+//**************************************************************************************************
+// Start a new connection.  A connection in progress is cancelled.  The hostname may also be an IP *
+// address.                                                                                        *
+//**************************************************************************************************
+void netconn::start ( const char* name, uint16_t prt, const String& req )
+{
+  ip_addr_t addr ;                                            // IP address if known
+  err_t     err ;                                             // Result of DNS request
+
+  abort() ;                                                   // Cancel old connection
+  strncpy ( hostname, name, sizeof(hostname) - 1 ) ;          // Remember host
+  hostname[sizeof(hostname) - 1] = '\0' ;                     // Be sure it is delimited
+  port = prt ;
+  request = req ;
+  t0 = millis() ;                                             // Start time of this step
+  dnsms = 0 ;
+  connms = 0 ;
+  dnsdone = false ;
+  state = CS_RESOLVE ;                                        // Start with DNS lookup
+  dnsip = dnscache.get ( hostname ) ;                         // Try the cache first
+  cached = ( dnsip != 0 ) ;
+  if ( cached )                                               // Found in cache?
+  {
+    dnsdone = true ;                                          // Yes, result is available now
+    return ;
+  }
+  err = dns_gethostbyname ( hostname, &addr, dnsfound, this ) ;
+  if ( err == ERR_OK )                                        // IP address or in DNS cache?
+  {
+    dnsip = ip4_addr_get_u32 ( ip_2_ip4 ( &addr ) ) ;         // Yes, result is available now
+    dnsdone = true ;
+  }
+  else if ( err != ERR_INPROGRESS )                           // Lookup started?
+  {
+    fail ( "DNS request error" ) ;                            // No, error
+  }
+}
+
+
+//**************************************************************************************************
+//                                    N E T C O N N : : A B O R T                                  *
+//**************************************************************************************************
+// Cancel a connection in progress.  If the socket is already handed over to the WiFiClient, that  *
+// one has to be stopped by the caller.                                                            *
+//**************************************************************************************************
+void netconn::abort()
+{
+  if ( fd >= 0 )                                              // Socket open?
+  {
+    close ( fd ) ;                                            // Yes, close it
+    fd = -1 ;
+  }
+  state = CS_IDLE ;
+}
+
+
+//**************************************************************************************************
+//                                     N E T C O N N : : P O L L                                   *
+//**************************************************************************************************
+// Advance the connection to the next step if possible.  Will never block.  The client will be     *
+// connected to the socket after the TCP connection is made.  The caller tells if the response     *
+// headers are handled.  Returns the new state.                                                    *
+//**************************************************************************************************
+connstate_t netconn::poll ( WiFiClient& client, bool hdrdone )
+{
+  struct sockaddr_in sa ;                                     // Address of host
+  struct timeval     tv = { 0, 0 } ;                          // Zero time-out for select()
+  fd_set             wfds ;                                   // Set for select()
+  int                err = 0 ;                                // Error from socket
+  socklen_t          errlen = sizeof(err) ;                   // Length of err
+
+  switch ( state )
+  {
+    case CS_RESOLVE :                                         // Waiting for DNS?
+      if ( !dnsdone )                                         // Result available?
+      {
+        if ( ( millis() - t0 ) > CONNTIMEOUT )                // No, time-out?
+        {
+          fail ( "DNS time-out" ) ;
+        }
+        break ;
+      }
+      if ( dnsip == 0 )                                       // Host found?
+      {
+        fail ( "host not found" ) ;                           // No, error
+        break ;
+      }
+      dnsms = millis() - t0 ;                                 // Time needed for DNS
+      if ( !cached )                                          // Real lookup?
+      {
+        dnscache.missed ( dnsms ) ;                           // Yes, count the miss
+        dnscache.put ( hostname, dnsip, DNSTTL ) ;            // and remember address
+      }
+      fd = socket ( AF_INET, SOCK_STREAM, IPPROTO_TCP ) ;     // Create a socket
+      if ( fd < 0 )
+      {
+        fail ( "no socket" ) ;
+        break ;
+      }
+      fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL, 0 ) | O_NONBLOCK ) ;
+      memset ( &sa, 0, sizeof(sa) ) ;
+      sa.sin_family = AF_INET ;
+      sa.sin_port = htons ( port ) ;
+      sa.sin_addr.s_addr = dnsip ;
+      if ( ( connect ( fd, (struct sockaddr*)&sa, sizeof(sa) ) < 0 ) &&
+           ( errno != EINPROGRESS ) )                         // Connect started?
+      {
+        fail ( "connect error" ) ;                            // No, error
+        break ;
+      }
+      t0 = millis() ;                                         // Start time of connect
+      state = CS_CONNECT ;
+      break ;
+    case CS_CONNECT :                                         // Waiting for TCP connect?
+      FD_ZERO ( &wfds ) ;
+      FD_SET ( fd, &wfds ) ;
+      if ( select ( fd + 1, NULL, &wfds, NULL, &tv ) <= 0 )   // Connected?
+      {
+        if ( ( millis() - t0 ) > CONNTIMEOUT )                // No, time-out?
+        {
+          fail ( "connect time-out" ) ;
+        }
+        break ;
+      }
+      getsockopt ( fd, SOL_SOCKET, SO_ERROR, &err, &errlen ) ;
+      if ( err )                                              // Connected without error?
+      {
+        fail ( "connection refused" ) ;                       // No, error
+        break ;
+      }
+      connms = millis() - t0 ;                                // Time needed for connect
+      fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL, 0 ) & ~O_NONBLOCK ) ;
+      client = WiFiClient ( fd ) ;                            // Hand over to the client
+      fd = -1 ;                                               // Not ours anymore
+      client.print ( request ) ;                              // Send the request
+      dbgprint ( "Connected to %s, DNS %d msec%s, connect %d msec",
+                 hostname, dnsms, cached ? " (cached)" : "", connms ) ;
+      t0 = millis() ;                                         // Start time of response
+      state = CS_HEADERS ;
+      break ;
+    case CS_HEADERS :                                         // Waiting for response headers?
+      if ( hdrdone )                                          // Response headers handled?
+      {
+        state = CS_IDLE ;                                     // Yes, connection complete
+      }
+      else if ( ( millis() - t0 ) > CONNTIMEOUT )             // No, time-out?
+      {
+        client.stop() ;                                       // Yes, give up
+        fail ( "no response" ) ;
+      }
+      break ;
+    default :
+      break ;
+  }
+  return state ;
+}
+
+netconn          mp3conn ;                                    // Connection to the stream host
+
+
+//**************************************************************************************************
+// Standby connections.                                                                            *
+//**************************************************************************************************
+// While a station is playing, a warm connection to the next (and optionally the previous) preset  *
+// is kept in a standby slot.  The response headers are parsed and the first part of the audio is  *
+// kept in a side buffer.  A zap to that preset swaps the connection in instead of starting cold.   *
+// Reading stops when the side buffer is full, so a standby uses little bandwidth.  A standby is   *
+// reopened after SBMAXAGE seconds to keep the buffered audio reasonably fresh.                    *
+//**************************************************************************************************
+#define SBSLOTS    2                                          // Max. number of standby connections
+#define SBBUFSIZ   8192                                       // Size of side buffer per slot
+#define SBMAXAGE   30                                         // Max. age of a standby in seconds
+#define SBMINHEAP  40000                                      // Min. free heap to open a standby
+#define SBRETRY    60                                         // Seconds before retry after a failure
+
+enum sbstate_t { SB_FREE, SB_CONNECT, SB_READY, SB_FAILED } ; // States of a standby slot
+
+class standbyc
+{
+  private:
+    netconn           conn ;                                  // Connection in progress
+    uint32_t          t0 ;                                    // Start time of current state
+  public:
+    sbstate_t         state = SB_FREE ;                       // Current state
+    String            url ;                                   // URL for this slot, "" if none
+    WiFiClient        client ;                                // The standby connection
+    hdrparser         hp ;                                    // Parser for its response headers
+    uint8_t*          buf = NULL ;                            // Side buffer for audio
+    uint16_t          len ;                                   // Number of bytes in buf
+    void              start() ;                               // Open the standby connection
+    void              close() ;                               // Close the standby connection
+    void              release() ;                             // Connection taken over by mp3client
+    void              poll() ;                                // Handle the standby connection
+} ;
+
+
+//**************************************************************************************************
+//                                   S T A N D B Y C : : S T A R T                                 *
+//**************************************************************************************************
+// Open the standby connection for url.  The side buffer is allocated on first use, but only if    *
+// a block of that size is available and enough heap is left for the rest of the radio.            *
+//**************************************************************************************************
+void standbyc::start()
+{
+  String   hostwoext ;                                        // Host without extension and port
+  uint16_t port ;                                             // Port number for host
+  String   request ;                                          // Request to send to host
+
+  if ( buf == NULL )                                          // Side buffer allocated?
+  {
+    if ( ( ESP.getMaxAllocHeap() >= SBBUFSIZ ) &&             // No, large enough block free
+         ( ESP.getFreeHeap() > ( SBMINHEAP + SBBUFSIZ ) ) )   // and heap left after allocation?
+    {
+      buf = (uint8_t*)malloc ( SBBUFSIZ ) ;                   // Yes, allocate side buffer
+    }
+    if ( buf == NULL )
+    {
+      dbgprint ( "No memory for standby buffer" ) ;
+      t0 = millis() ;                                         // No memory, try again later
+      state = SB_FAILED ;
+      return ;
+    }
+  }
+  dbgprint ( "Open standby connection to %s", url.c_str() ) ;
+  request = hostrequest ( url, hostwoext, port ) ;            // Build the request
+  hp.reset() ;                                                // Prepare header parser
+  len = 0 ;                                                   // Side buffer is empty
+  conn.start ( hostwoext.c_str(), port, request ) ;           // Start connecting
+  t0 = millis() ;
+  state = SB_CONNECT ;
+}
+
+
+//**************************************************************************************************
+//                                   S T A N D B Y C : : C L O S E                                 *
+//**************************************************************************************************
+// Close the standby connection.                                                                   *
+//**************************************************************************************************
+void standbyc::close()
+{
+  conn.abort() ;                                              // Cancel connect in progress
+  client.stop() ;                                             // Close the connection
+  state = SB_FREE ;
+}
+
+
+//**************************************************************************************************
+//                                 S T A N D B Y C : : R E L E A S E                               *
+//**************************************************************************************************
+// The connection has been taken over by mp3client.  Forget it without closing the socket.         *
+//**************************************************************************************************
+void standbyc::release()
+{
+  client = WiFiClient() ;                                     // Drop our reference to the socket
+  url = "" ;                                                  // Slot has to be set up again
+  state = SB_FREE ;
+}
+
+
+//**************************************************************************************************
+//                                    S T A N D B Y C : : P O L L                                  *
+//**************************************************************************************************
+// Handle the standby connection: complete the connect, parse the headers and fill the side        *
+// buffer.  Will never block.                                                                      *
+//**************************************************************************************************
+void standbyc::poll()
+{
+  uint8_t  b ;                                                // Byte from header
+  hdrres_t hres = HDR_MORE ;                                  // Result of header parser
+  int      n ;                                                // Number of bytes to read
+
+  switch ( state )
+  {
+    case SB_CONNECT :                                         // Connecting or reading headers?
+      if ( conn.poll ( client, false ) == CS_FAILED )         // Yes, next step
+      {
+        state = SB_FAILED ;                                   // Failed, try again later
+        t0 = millis() ;
+        break ;
+      }
+      if ( conn.state != CS_HEADERS )                         // Request sent?
+      {
+        break ;                                               // No, wait
+      }
+      while ( ( hres == HDR_MORE ) && client.available() )    // Handle response headers
+      {
+        b = client.read() ;
+        hres = hp.feed ( b ) ;
+      }
+      if ( hres == HDR_MORE )                                 // End of headers seen?
+      {
+        break ;                                               // No, wait for more
+      }
+      conn.poll ( client, true ) ;                            // Connection is complete
+      if ( ( hres == HDR_ERROR ) ||                           // Usable reply?
+           hp.redirected() || !hp.ctseen )
+      {
+        dbgprint ( "Standby for %s not usable", url.c_str() ) ;
+        close() ;                                             // No, redirects etc. are done cold
+        state = SB_FAILED ;
+        t0 = millis() ;
+        break ;
+      }
+      t0 = millis() ;                                         // Start of standby
+      state = SB_READY ;
+      // Fall through to fill the side buffer
+    case SB_READY :                                           // Connection ready?
+      n = client.available() ;                                // Yes, see what is available
+      if ( n > ( SBBUFSIZ - len ) )                           // Limit to free space
+      {
+        n = SBBUFSIZ - len ;
+      }
+      if ( n > 0 )
+      {
+        n = client.read ( buf + len, n ) ;                    // Fill side buffer
+        if ( n > 0 )
+        {
+          len += n ;
+        }
+      }
+      if ( ( ( n <= 0 ) && !client.connected() &&             // Closed by server
+             ( len < hp.clength ) ) ||                        // before all data is buffered?
+           ( ( millis() - t0 ) > ( SBMAXAGE * 1000 ) ) )      // or too old?
+      {
+        close() ;                                             // Yes, will be reopened
+      }
+      break ;
+    case SB_FAILED :                                          // Failed before?
+      if ( ( millis() - t0 ) > ( SBRETRY * 1000 ) )           // Yes, time for a retry?
+      {
+        state = SB_FREE ;
+      }
+      break ;
+    default :
+      break ;
+  }
+}
+
+standbyc         standby[SBSLOTS] ;                           // Standby connections, next and previous
+
+
+//**************************************************************************************************
+// Playlist index.                                                                                 *
+//**************************************************************************************************
+// A playlist is read only once.  The URLs and the #EXTINF titles of the entries are kept in a     *
+// string pool, so the next, previous or any other entry can be played without reading the         *
+// playlist again.  The pool is allocated on first use.                                            *
+//**************************************************************************************************
+#define PLMAXENTRY 256                                        // Max. number of entries in index
+#define PLPOOLSIZ  12288                                      // Size of string pool
+#define PLNONE     0xFFFF                                     // No title for this entry
+
+class plindexc
+{
+  private:
+    char*             pool = NULL ;                           // String pool for URLs and titles
+    uint16_t          poolx ;                                 // Next free position in pool
+    uint16_t          urloff[PLMAXENTRY] ;                    // Offset of URL in pool
+    uint16_t          titleoff[PLMAXENTRY] ;                  // Offset of title in pool or PLNONE
+    uint16_t          pendtitle ;                             // Title for the next entry
+    bool              pls ;                                   // Playlist is in PLS format
+    uint16_t          store ( const char* str ) ;             // Store a string in the pool
+  public:
+    String            url ;                                   // URL of the indexed playlist
+    bool              complete = false ;                      // Index is complete
+    uint16_t          count = 0 ;                             // Number of entries
+    void              reset ( const String& plurl ) ;         // Start a new index
+    void              addline ( const char* line ) ;          // Handle a line of the playlist
+    const char*       entryurl ( int16_t n ) ;                // URL of entry n (1..count)
+    const char*       entrytitle ( int16_t n ) ;              // Title of entry n or NULL
+    bool              valid ( const String& plurl )           // Index available for plurl?
+                      {
+                        return complete && ( url == plurl ) ;
+                      }
+} ;
+
+
+//**************************************************************************************************
+//                                   P L I N D E X C : : S T O R E                                 *
+//**************************************************************************************************
+// Store a string in the pool.  Returns the offset or PLNONE if the pool is full.                  *
+//**************************************************************************************************
+uint16_t plindexc::store ( const char* str )
+{
+  uint16_t len = strlen ( str ) + 1 ;                         // Length including delimiter
+  uint16_t res = poolx ;                                      // Result is current position
+
+  if ( ( pool == NULL ) || ( ( poolx + len ) > PLPOOLSIZ ) )  // Room in pool?
+  {
+    return PLNONE ;                                           // No
+  }
+  memcpy ( pool + poolx, str, len ) ;                         // Yes, copy string
+  poolx += len ;
+  return res ;
+}
+
+
+//**************************************************************************************************
+//                                   P L I N D E X C : : R E S E T                                 *
+//**************************************************************************************************
+// Start a new index for the playlist plurl.                                                       *
+//**************************************************************************************************
+void plindexc::reset ( const String& plurl )
+{
+  if ( pool == NULL )                                         // Pool allocated?
+  {
+    pool = (char*)malloc ( PLPOOLSIZ ) ;                      // No, do it now
+  }
+  url = plurl ;
+  pls = plurl.endsWith ( ".pls" ) ;                           // Format from extension
+  complete = false ;
+  count = 0 ;
+  poolx = 0 ;
+  pendtitle = PLNONE ;
+}
+
+
+//**************************************************************************************************
+//                                 P L I N D E X C : : A D D L I N E                               *
+//**************************************************************************************************
+// Handle a line of the playlist.  Comment lines are skipped, except #EXTINF.  The title of        *
+// #EXTINF belongs to the next entry.  For PLS only the "FileN=" and "TitleN=" lines are used.      *
+//**************************************************************************************************
+void plindexc::addline ( const char* line )
+{
+  const char* p ;                                             // Points into line
+  uint16_t    off ;                                           // Offset in pool
+  int         n ;                                             // Entry number in PLS
+
+  if ( strlen ( line ) < 5 )                                  // Skip short lines
+  {
+    return ;
+  }
+  if ( pls )                                                  // PLS format?
+  {
+    p = strchr ( line, '=' ) ;                                // Yes, find value
+    if ( p == NULL )
+    {
+      return ;                                                // Not a key=value line
+    }
+    if ( strncasecmp ( line, "Title", 5 ) == 0 )              // Title of an entry?
+    {
+      n = atoi ( line + 5 ) ;                                 // Yes, get entry number
+      if ( ( n >= 1 ) && ( n <= count ) )                     // Entry already seen?
+      {
+        titleoff[n - 1] = store ( p + 1 ) ;                   // Yes, set its title
+      }
+      else
+      {
+        pendtitle = store ( p + 1 ) ;                         // No, title for next entry
+      }
+      return ;
+    }
+    if ( strncasecmp ( line, "File", 4 ) )                    // URL of an entry?
+    {
+      return ;                                                // No, ignore other keys
+    }
+    line = p + 1 ;                                            // Yes, handle the URL
+  }
+  else if ( strncmp ( line, "#EXTINF:", 8 ) == 0 )            // Info?
+  {
+    p = strchr ( line, ',' ) ;                                // Comma in this line?
+    if ( p )
+    {
+      pendtitle = store ( p + 1 ) ;                           // Title for next entry
+    }
+    return ;
+  }
+  else if ( *line == '#' )                                    // Commentline?
+  {
+    return ;                                                  // Yes, ignore
+  }
+  if ( count >= PLMAXENTRY )                                  // Room for an entry?
+  {
+    return ;                                                  // No, ignore
+  }
+  off = store ( line ) ;                                      // Store URL
+  if ( off == PLNONE )                                        // Pool full?
+  {
+    return ;                                                  // Yes, ignore
+  }
+  urloff[count] = off ;                                       // Add entry
+  titleoff[count++] = pendtitle ;
+  pendtitle = PLNONE ;                                        // Title is used
+}
+
+
+//**************************************************************************************************
+//                                P L I N D E X C : : E N T R Y U R L                              *
+//**************************************************************************************************
+// Give the URL of entry n.  Entries are numbered from 1.                                          *
+//**************************************************************************************************
+const char* plindexc::entryurl ( int16_t n )
+{
+  if ( ( n < 1 ) || ( n > count ) )                           // Legal entry?
+  {
+    return NULL ;                                             // No
+  }
+  return pool + urloff[n - 1] ;
+}
+
+
+//**************************************************************************************************
+//                              P L I N D E X C : : E N T R Y T I T L E                            *
+//**************************************************************************************************
+// Give the #EXTINF title of entry n or NULL if there is none.  Entries are numbered from 1.       *
+//**************************************************************************************************
+const char* plindexc::entrytitle ( int16_t n )
+{
+  if ( ( n < 1 ) || ( n > count ) || ( titleoff[n - 1] == PLNONE ) )
+  {
+    return NULL ;
+  }
+  return pool + titleoff[n - 1] ;
+}
+
+plindexc         plindex ;                                    // Index of the current playlist
+
+
+//**************************************************************************************************
+// MPEG transport stream demultiplexer.                                                            *
+//**************************************************************************************************
+// HLS segments are often MPEG-TS.  Only the payload of the first audio elementary stream is sent  *
+// to the ring buffer, the PES headers and all other streams (PAT, PMT, video) are dropped.        *
+// Segments that do not start with a sync byte (packed audio like ADTS) are passed unchanged.      *
+//**************************************************************************************************
+#define TSPKTSIZ   188                                        // Size of a transport stream packet
+#define TSSYNC     0x47                                       // Sync byte of a packet
+
+class tsdemux
+{
+  private:
+    uint8_t           pkt[TSPKTSIZ] ;                         // Packet being collected
+    uint8_t           pktx ;                                  // Number of bytes in pkt
+    int16_t           pid ;                                   // PID of audio stream, -1 if unknown
+    bool              started ;                               // First byte of stream seen
+    bool              passthru ;                              // Not a transport stream
+    void              packet() ;                              // Handle a complete packet
+  public:
+    uint32_t          syncerr ;                               // Number of bytes skipped for sync
+    void              reset()                                 // Prepare for a new stream
+                      {
+                        pktx = 0 ;
+                        pid = -1 ;
+                        started = false ;
+                        syncerr = 0 ;
+                      }
+    void              newsegment()                            // Next segment of the same stream
+                      {
+                        pktx = 0 ;
+                      }
+    void              feed ( const uint8_t* p, int len ) ;    // Handle data from the stream
+} ;
+
+
+//**************************************************************************************************
+//                                   T S D E M U X : : P A C K E T                                 *
+//**************************************************************************************************
+// Handle a complete transport stream packet.  The first PES packet with an audio stream id        *
+// (0xC0..0xDF) selects the PID to play.                                                           *
+//**************************************************************************************************
+void tsdemux::packet()
+{
+  int16_t ppid ;                                              // PID of this packet
+  int     x = 4 ;                                             // Start of payload
+
+  ppid = ( ( pkt[1] & 0x1F ) << 8 ) | pkt[2] ;                // Get PID
+  if ( ( pkt[3] & 0x10 ) == 0 )                               // Payload present?
+  {
+    return ;                                                  // No, skip
+  }
+  if ( pkt[3] & 0x20 )                                        // Adaptation field present?
+  {
+    x += 1 + pkt[4] ;                                         // Yes, skip it
+  }
+  if ( ( pkt[1] & 0x40 ) &&                                   // Start of a PES packet?
+       ( x <= ( TSPKTSIZ - 9 ) ) &&
+       ( pkt[x] == 0 ) && ( pkt[x + 1] == 0 ) && ( pkt[x + 2] == 1 ) )
+  {
+    if ( ( pid < 0 ) &&                                       // Yes, audio stream still unknown?
+         ( pkt[x + 3] >= 0xC0 ) && ( pkt[x + 3] <= 0xDF ) )   // and this is audio?
+    {
+      pid = ppid ;                                            // Yes, play this stream
+      dbgprint ( "Transport stream, audio on PID %d", pid ) ;
+    }
+    x += 9 + pkt[x + 8] ;                                     // Skip PES header
+  }
+  if ( ( ppid != pid ) || ( x >= TSPKTSIZ ) )                 // Audio data in this packet?
+  {
+    return ;                                                  // No, skip
+  }
+  queuedata ( pkt + x, TSPKTSIZ - x ) ;                       // Send audio to the ring buffer
+}
+
+
+//**************************************************************************************************
+//                                     T S D E M U X : : F E E D                                   *
+//**************************************************************************************************
+// Handle data from the stream.  Packets are collected in pkt[].                                   *
+//**************************************************************************************************
+void tsdemux::feed ( const uint8_t* p, int len )
+{
+  int n ;                                                     // Number of bytes to copy
+
+  if ( ( len > 0 ) && !started )                              // First data of stream?
+  {
+    started = true ;                                          // Yes, check type
+    passthru = ( *p != TSSYNC ) ;
+    if ( passthru )
+    {
+      dbgprint ( "No transport stream, play unchanged" ) ;
+    }
+  }
+  if ( passthru )                                             // Transport stream?
+  {
+    queuedata ( p, len ) ;                                    // No, send it unchanged
+    return ;
+  }
+  while ( len > 0 )
+  {
+    if ( ( pktx == 0 ) && ( *p != TSSYNC ) )                  // Sync byte where expected?
+    {
+      syncerr++ ;                                             // No, skip byte
+      p++ ;
+      len-- ;
+      continue ;
+    }
+    n = TSPKTSIZ - pktx ;                                     // Room in packet
+    if ( n > len )                                            // Limit to available data
+    {
+      n = len ;
+    }
+    memcpy ( pkt + pktx, p, n ) ;                             // Collect packet
+    pktx += n ;
+    p += n ;
+    len -= n ;
+    if ( pktx == TSPKTSIZ )                                   // Packet complete?
+    {
+      packet() ;                                              // Yes, handle it
+      pktx = 0 ;
+    }
+  }
+}
+
+
+//**************************************************************************************************
+// HTTP Live Streaming.                                                                            *
+//**************************************************************************************************
+// A ".m3u8" URL is a HLS playlist.  A master playlist selects the variant with the lowest         *
+// bandwidth, a media playlist gives the segments.  The segments are queued and played back to     *
+// back: the next segment is opened in a standby slot while the current one plays, so it can be   *
+// swapped in without a gap.  Live playlists are reloaded after the target duration, or after      *
+// half of it if the playlist did not change.  A live stream starts HLSLIVEQ segments from the end *
+//**************************************************************************************************
+#include "hlsparse.h"                                         // Parser for the playlist lines
+
+#define HLSSEGQ    8                                          // Max. number of queued segments
+#define HLSLIVEQ   3                                          // Start live stream this far from end
+#define HLSLINESIZ 256                                        // Max. length of a playlist line
+
+class hlsc
+{
+  private:
+    String            url ;                                   // URL of the (media) playlist
+    String            segurl[HLSSEGQ] ;                       // Queue of segments to play
+    uint8_t           segx ;                                  // Index of first segment in queue
+    uint8_t           segn ;                                  // Number of segments in queue
+    m3u8parser        m3u ;                                   // Parser for the playlist lines
+    uint32_t          lastseq ;                               // Sequence number of last queued
+    bool              haveseq ;                               // lastseq is valid
+    bool              first ;                                 // First load of the playlist
+    bool              changed ;                               // New segments in this load
+    bool              playing ;                               // First segment started
+    bool              fetching ;                              // Loading the playlist
+    bool              hdrdone ;                               // Headers of playlist handled
+    uint32_t          left ;                                  // Bytes left in playlist body
+    uint32_t          tnext ;                                 // Time for next reload
+    uint8_t           redirs ;                                // Number of redirects of playlist
+    String            variant ;                               // Selected variant or ""
+    netconn           pconn ;                                 // Connection for the playlist
+    WiFiClient        pclient ;                               // Client for the playlist
+    hdrparser         php ;                                   // Parser for the playlist headers
+    char              line[HLSLINESIZ] ;                      // Line of the playlist
+    uint16_t          linex ;                                 // Index in line
+    standbyc          seg ;                                   // Connection for the next segment
+    void              fetchstart() ;                          // Start loading the playlist
+    void              fetchpoll() ;                           // Continue loading the playlist
+    void              fetchdone() ;                           // Playlist is loaded
+    void              parseline() ;                           // Handle a line of the playlist
+    void              addseg ( const String& surl ) ;         // Add a segment to the queue
+    void              take() ;                                // Play the next segment
+  public:
+    bool              active = false ;                        // HLS session running
+    bool              failed = false ;                        // Segment or playlist failed
+    uint32_t          tseg = 0 ;                              // Time the current segment started
+    tsdemux           ts ;                                    // Demultiplexer for the segments
+    void              start ( const String& plurl ) ;         // Start playing a HLS playlist
+    void              stop() ;                                // Stop the session
+    void              loop() ;                                // Handle the session
+} ;
+
+
+//**************************************************************************************************
+//                                        H L S C : : S T A R T                                    *
+//**************************************************************************************************
+// Start playing the HLS playlist plurl.  The playlist is loaded in loop().                        *
+//**************************************************************************************************
+void hlsc::start ( const String& plurl )
+{
+  stop() ;                                                    // Stop old session
+  dbgprint ( "HLS request %s", plurl.c_str() ) ;
+  url = plurl ;
+  segx = 0 ;                                                  // Queue is empty
+  segn = 0 ;
+  haveseq = false ;
+  m3u.start() ;                                               // Target duration until known
+  first = true ;
+  playing = false ;
+  redirs = 0 ;
+  variant = "" ;
+  ts.reset() ;
+  failed = false ;
+  active = true ;
+  setdatamode ( STOPPED ) ;                                   // Nothing to read from mp3client yet
+  fetchstart() ;                                              // Load the playlist
+}
+
+
+//**************************************************************************************************
+//                                         H L S C : : S T O P                                     *
+//**************************************************************************************************
+// Stop the HLS session.  The current segment on mp3client is stopped by the caller.               *
+//**************************************************************************************************
+void hlsc::stop()
+{
+  if ( !active )                                              // Session running?
+  {
+    return ;                                                  // No
+  }
+  pconn.abort() ;                                             // Stop loading the playlist
+  pclient.stop() ;
+  fetching = false ;
+  seg.close() ;                                               // Stop the next segment
+  seg.url = "" ;
+  segn = 0 ;
+  active = false ;
+  dbgprint ( "HLS stopped" ) ;
+}
+
+
+//**************************************************************************************************
+//                                   H L S C : : F E T C H S T A R T                               *
+//**************************************************************************************************
+// Start loading the playlist.                                                                     *
+//**************************************************************************************************
+void hlsc::fetchstart()
+{
+  String   hostwoext ;                                        // Host without extension and port
+  uint16_t port ;                                             // Port number for host
+  String   request ;                                          // Request to send to host
+
+  request = hostrequest ( url, hostwoext, port ) ;            // Build the request
+  php.reset() ;                                               // Prepare header parser
+  hdrdone = false ;
+  linex = 0 ;
+  left = 0xFFFFFFFF ;                                         // Length of body unknown
+  m3u.load() ;                                                // Parse a new load
+  changed = false ;
+  pconn.start ( hostwoext.c_str(), port, request ) ;          // Start connecting
+  fetching = true ;
+}
+
+
+//**************************************************************************************************
+//                                   H L S C : : F E T C H P O L L                                 *
+//**************************************************************************************************
+// Continue loading the playlist.  Will never block.                                               *
+//**************************************************************************************************
+void hlsc::fetchpoll()
+{
+  uint8_t  b ;                                                // Byte from playlist
+  hdrres_t hres ;                                             // Result of header parser
+
+  if ( pconn.poll ( pclient, hdrdone ) == CS_FAILED )         // Next step of connection
+  {
+    fetching = false ;                                        // Failed, retry later
+    failed = first ;                                          // Nothing to play if first load
+    tnext = millis() + m3u.targetdur * 500 ;
+    return ;
+  }
+  if ( !hdrdone && ( pconn.state != CS_HEADERS ) )            // Request sent?
+  {
+    return ;                                                  // No, wait
+  }
+  while ( ( left > 0 ) && pclient.available() )               // Handle available data
+  {
+    b = pclient.read() ;
+    if ( !hdrdone )                                           // Still in headers?
+    {
+      hres = php.feed ( b ) ;                                 // Yes, feed to header parser
+      if ( hres == HDR_MORE )
+      {
+        continue ;
+      }
+      if ( ( hres == HDR_ERROR ) ||                           // Error reply?
+           ( php.redirected() && ( ++redirs > MAXREDIRECT ) ) ) // or too many redirects?
+      {
+        dbgprint ( "HTTP error %d for HLS playlist", php.status ) ;
+        pclient.stop() ;                                      // Yes, retry later
+        fetching = false ;
+        failed = first ;                                      // Nothing to play if first load
+        tnext = millis() + m3u.targetdur * 500 ;
+        return ;
+      }
+      if ( php.redirected() )                                 // Redirected?
+      {
+        pclient.stop() ;                                      // Yes, load from new URL
+        url = resolveurl ( url, php.location ) ;
+        fetchstart() ;
+        return ;
+      }
+      hdrdone = true ;                                        // Go on with the body
+      left = php.clength ;                                    // Bytes in body, if known
+      redirs = 0 ;
+      pconn.poll ( pclient, true ) ;                          // Connection is complete
+      continue ;
+    }
+    left-- ;                                                  // Count bytes of body
+    if ( ( b == '\r' ) || ( b > 0x7F ) )                      // Ignore CR and unprintable bytes
+    {
+      continue ;
+    }
+    if ( b == '\n' )                                          // End of line?
+    {
+      line[linex] = '\0' ;                                    // Yes, delimit
+      parseline() ;                                           // and handle it
+      linex = 0 ;
+    }
+    else if ( linex < ( HLSLINESIZ - 1 ) )                    // Prevent overflow
+    {
+      line[linex++] = b ;
+    }
+  }
+  if ( hdrdone &&
+       ( ( left == 0 ) || !pclient.connected() ) &&           // End of playlist?
+       ( pclient.available() == 0 ) )
+  {
+    fetchdone() ;                                             // Yes, handle result
+  }
+}
+
+
+//**************************************************************************************************
+//                                    H L S C : : F E T C H D O N E                                *
+//**************************************************************************************************
+// The playlist is loaded.  A master playlist continues with the selected variant.  Otherwise the  *
+// time for the next reload is set.                                                                *
+//**************************************************************************************************
+void hlsc::fetchdone()
+{
+  if ( linex )                                                // Last line without linefeed?
+  {
+    line[linex] = '\0' ;                                      // Yes, handle it
+    parseline() ;
+    linex = 0 ;
+  }
+  pclient.stop() ;                                            // Close connection
+  fetching = false ;
+  if ( variant != "" )                                        // Master playlist?
+  {
+    dbgprint ( "HLS variant %s, bandwidth %d",                // Yes, load the media playlist
+               variant.c_str(), m3u.varbw ) ;
+    url = variant ;
+    variant = "" ;
+    fetchstart() ;
+    return ;
+  }
+  if ( first && !m3u.endlist )                                    // First load of a live stream?
+  {
+    while ( segn > HLSLIVEQ )                                 // Yes, start near the live edge
+    {
+      segx = ( segx + 1 ) % HLSSEGQ ;
+      segn-- ;
+    }
+  }
+  first = false ;
+  dbgprint ( "HLS playlist loaded, %d segments queued, target duration %d sec",
+             segn, m3u.targetdur ) ;
+  tnext = millis() + ( changed ? m3u.targetdur * 1000 :       // Time for next reload
+                                 m3u.targetdur * 500 ) ;
+}
+
+
+//**************************************************************************************************
+//                                    H L S C : : P A R S E L I N E                                *
+//**************************************************************************************************
+// Handle a line of the playlist.  The line is parsed by m3u, see hlsparse.h.                      *
+//**************************************************************************************************
+void hlsc::parseline()
+{
+  switch ( m3u.parse ( line ) )
+  {
+    case M3U8_VARIANT :                                       // Variant with lowest bandwidth?
+      variant = resolveurl ( url, line ) ;                    // Yes, remember
+      break ;
+    case M3U8_SEGMENT :                                       // URI of a segment?
+      if ( !haveseq || ( m3u.uriseq > lastseq ) )             // Yes, new segment?
+      {
+        addseg ( resolveurl ( url, line ) ) ;                 // Yes, add to queue
+      }
+      break ;
+    default :
+      break ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                       H L S C : : A D D S E G                                   *
+//**************************************************************************************************
+// Add a segment to the queue.  On the first load the oldest segment is dropped if the queue is    *
+// full, later loads pick up the remaining segments on the next reload.                            *
+//**************************************************************************************************
+void hlsc::addseg ( const String& surl )
+{
+  if ( segn == HLSSEGQ )                                      // Queue full?
+  {
+    if ( !first )                                             // Yes, first load?
+    {
+      return ;                                                // No, try again next reload
+    }
+    segx = ( segx + 1 ) % HLSSEGQ ;                           // Yes, drop oldest
+    segn-- ;
+  }
+  segurl[( segx + segn ) % HLSSEGQ] = surl ;                  // Add to queue
+  segn++ ;
+  lastseq = m3u.uriseq ;                                      // Remember last queued
+  haveseq = true ;
+  changed = true ;
+}
+
+
+//**************************************************************************************************
+//                                         H L S C : : T A K E                                     *
+//**************************************************************************************************
+// The next segment is ready in the standby slot and the current one has ended.  The connection is *
+// taken over by mp3client.  Only the first segment starts a new song.                             *
+//**************************************************************************************************
+void hlsc::take()
+{
+  dbgprint ( "HLS segment %s, %d bytes buffered",
+             seg.url.c_str(), seg.len ) ;
+  mp3client = seg.client ;                                    // Take over the connection
+  hdrp = seg.hp ;                                             // and the results of the headers
+  tseg = millis() ;                                           // For stall detection
+  ts.newsegment() ;                                           // Packets start at the segment
+  if ( playing )                                              // Continue with next segment?
+  {
+    chunked = hdrp.chunked ;                                  // Yes, only transfer mode may change
+    chunkcount = 0 ;
+  }
+  else
+  {
+    playing = true ;                                          // First segment, start playing
+    totalcount = 0 ;
+    startdata() ;
+  }
+  handledata_ch ( seg.buf, seg.len ) ;                        // Play the side buffer
+  seg.release() ;                                             // Slot is free for next segment
+}
+
+
+//**************************************************************************************************
+//                                         H L S C : : L O O P                                     *
+//**************************************************************************************************
+// Handle the HLS session.  Called from mp3loop().  Will never block.                              *
+//**************************************************************************************************
+void hlsc::loop()
+{
+  if ( !active )                                              // Session running?
+  {
+    return ;                                                  // No
+  }
+  if ( fetching )                                             // Loading the playlist?
+  {
+    fetchpoll() ;                                             // Yes, continue
+  }
+  else if ( !m3u.endlist && ( (int32_t)( millis() - tnext ) >= 0 ) ) // Time to reload?
+  {
+    fetchstart() ;                                            // Yes, start loading
+  }
+  seg.poll() ;                                                // Handle next segment
+  if ( seg.state == SB_FAILED )                               // Could not load it?
+  {
+    dbgprint ( "HLS segment %s failed", seg.url.c_str() ) ;   // Yes, let recovery handle it
+    seg.close() ;
+    seg.url = "" ;
+    failed = true ;
+  }
+  if ( ( seg.state == SB_FREE ) && ( seg.url == "" ) && segn ) // Slot free and segment queued?
+  {
+    seg.url = segurl[segx] ;                                  // Yes, take from queue
+    segurl[segx] = "" ;
+    segx = ( segx + 1 ) % HLSSEGQ ;
+    segn-- ;
+  }
+  if ( ( seg.state == SB_FREE ) && ( seg.url != "" ) )        // Segment to open?
+  {
+    seg.start() ;                                             // Yes, prefetch it
+  }
+  if ( ( seg.state == SB_READY ) &&                           // Next segment ready?
+       ( !playing ||                                          // and nothing playing yet
+         ( ( datamode == DATA ) &&                            // or current segment ended?
+           ( mp3client.available() == 0 ) &&
+           !mp3client.connected() ) ) )
+  {
+    take() ;                                                  // Yes, play it
+  }
+}
+
+hlsc             hls ;                                        // HTTP Live Streaming session
+
+
+//**************************************************************************************************
+// Decoder telemetry.                                                                              *
+//**************************************************************************************************
+// SCI_HDAT0, SCI_HDAT1 and SCI_DECODE_TIME of the VS1053 are polled by spftask every DTPOLL msec. *
+// They tell the decoded format and bitrate.  If data is sent to the decoder but the decode time   *
+// does not advance for DTSTALL msec, the stream cannot be decoded (wrong codec, HTML error page,  *
+// garbage).  This is flagged to the stream recovery, that skips the station.                      *
+//**************************************************************************************************
+#define DTPOLL     500                                        // Poll interval in msec
+#define DTSTALL    2500                                       // Max. time without decode progress
+#define DTMINBYTES 4096                                       // Min. bytes to decoder for a stall
+
+const uint16_t dtkbps[2][16] =                                // MP3 bitrates from HDAT0 bits 15:12
+{
+  { 0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0 },  // MPEG 2 and 2.5
+  { 0, 32, 40, 48, 56, 64, 80,  96, 112, 128, 160, 192, 224, 256, 320, 0 }   // MPEG 1
+} ;
+
+class dectelc
+{
+  private:
+    uint32_t          tpoll = 0 ;                             // Time of last poll
+    uint32_t          tprogress = 0 ;                         // Time of last decode progress
+    uint32_t          oldtotal = 0 ;                          // totalcount at tprogress
+  public:
+    uint16_t          hdat0 = 0 ;                             // Last SCI_HDAT0
+    uint16_t          hdat1 = 0 ;                             // Last SCI_HDAT1
+    uint16_t          dtime = 0 ;                             // Last SCI_DECODE_TIME in seconds
+    bool              dead = false ;                          // Stream does not decode
+    uint32_t          deadcount = 0 ;                         // Number of undecodable streams
+    const char*       format() ;                              // Decoded format
+    uint16_t          kbps() ;                                // Decoded bitrate
+    void              poll() ;                                // Poll, called with SPI claimed
+    String            json() ;                                // Telemetry as JSON
+} ;
+
+
+//**************************************************************************************************
+//                                    D E C T E L C : : F O R M A T                                *
+//**************************************************************************************************
+// Decoded format from SCI_HDAT1.                                                                  *
+//**************************************************************************************************
+const char* dectelc::format()
+{
+  switch ( hdat1 )
+  {
+    case 0x0000 : return "none" ;                             // Nothing decoded (yet)
+    case 0x7665 : return "WAV" ;
+    case 0x4154 :                                             // AAC ADTS
+    case 0x4144 :                                             // AAC ADIF
+    case 0x4D34 : return "AAC" ;                              // AAC in MP4
+    case 0x574D : return "WMA" ;
+    case 0x4F67 : return "Ogg" ;
+    case 0x664C : return "FLAC" ;
+    case 0x4D54 : return "MIDI" ;
+  }
+  if ( ( hdat1 & 0xFFE0 ) == 0xFFE0 )                         // MPEG frame sync?
+  {
+    return ( ( hdat1 & 0x0006 ) == 0x0002 ) ? "MP3" : "MP2" ; // Yes, layer III or other layer
+  }
+  return "unknown" ;
+}
+
+
+//**************************************************************************************************
+//                                      D E C T E L C : : K B P S                                  *
+//**************************************************************************************************
+// Decoded bitrate in kbit/sec.  MP3 has the bitrate index in SCI_HDAT0, the other formats the     *
+// byte rate.                                                                                      *
+//**************************************************************************************************
+uint16_t dectelc::kbps()
+{
+  if ( ( hdat1 & 0xFFE6 ) == 0xFFE2 )                         // MPEG layer III?
+  {
+    return dtkbps[( hdat1 >> 3 ) & 1][hdat0 >> 12] ;          // Yes, lookup index
+  }
+  if ( ( hdat1 & 0xFFE0 ) == 0xFFE0 )                         // Other layers are not handled
+  {
+    return 0 ;
+  }
+  return (uint32_t)hdat0 * 8 / 1000 ;                         // Byte rate to kbit/sec
+}
+
+
+//**************************************************************************************************
+//                                      D E C T E L C : : J S O N                                  *
+//**************************************************************************************************
+// Telemetry as a JSON object.                                                                     *
+//**************************************************************************************************
+String dectelc::json()
+{
+  char tmpstr[120] ;                                          // Formatted result
+
+  sprintf ( tmpstr, "{\"format\":\"%s\",\"kbps\":%u,\"hdat0\":%u,\"hdat1\":%u,"
+            "\"decodetime\":%u,\"undecodable\":%u}",
+            format(), kbps(), hdat0, hdat1, dtime, deadcount ) ;
+  return String ( tmpstr ) ;
+}
+
+dectelc          dectel ;                                     // Telemetry of the decoder
+
+
+//**************************************************************************************************
+// Stream recovery.                                                                                *
+//**************************************************************************************************
+// Watches the stream from mp3loop() and tells the kind of failure apart: no data from the server  *
+// (network stall), connection closed by the server (EOF), a failed connect and a decoder that     *
+// does not take data from a full buffer.  The same URL is requested again after a delay that     *
+// doubles with every successive failure, with random jitter.  The playtask keeps playing the     *
+// buffered audio in the mean time.  After "rcretries" successive failures the station is skipped. *
+// The failure count is cleared after RCSTABLE msec of good playing.                               *
+// A stream that does not decode (see decoder telemetry) is skipped right away.                    *
+//**************************************************************************************************
+#define RCSTALL    5000                                       // No data for this time is a stall
+#define RCDECSTALL 5000                                       // No decoder progress, buffer filled
+#define RCBASE     500                                        // First reconnect delay in msec
+#define RCMAXDELAY 30000                                      // Max. reconnect delay in msec
+#define RCSTABLE   30000                                      // Good playing time to clear failures
+
+enum rcreason_t { RC_NETSTALL, RC_EOF, RC_CONNFAIL,           // Kinds of failures
+                  RC_DECSTALL, RC_NODECODE, RC_NUMREASON } ;
+
+const char* const rcnames[] =                                 // Names for debug output
+{
+  "Network stall", "Server EOF", "Connect failure", "Decoder stall", "Undecodable stream"
+} ;
+
+class recoveryc
+{
+  private:
+    uint8_t           fails = 0 ;                             // Successive failures of station
+    bool              pending = false ;                       // Reconnect scheduled
+    bool              retry = false ;                         // Host requested for a reconnect
+    uint32_t          tretry ;                                // Time of reconnect
+    uint32_t          lastrx ;                                // Time of last data from stream
+    uint32_t          lastplay ;                              // Time of last decoder progress
+    uint32_t          oldtotal ;                              // totalcount at lastplay
+    uint32_t          okstart = 0 ;                           // Start of good playing, 0 if none
+  public:
+    bool              resuming = false ;                      // Reconnect, do not restart the song
+    uint32_t          count[RC_NUMREASON] ;                   // Number of failures per kind
+    uint32_t          reconnects = 0 ;                        // Number of reconnects
+    uint32_t          skips = 0 ;                             // Number of stations skipped
+    void              rxdata()                                // Data received from stream
+                      {
+                        lastrx = millis() ;
+                      }
+    void              reset() ;                               // New station selected
+    void              newhost()                               // Host requested by mp3loop()
+                      {
+                        if ( !retry )                         // Other station?
+                        {
+                          if ( pending )                      // Yes, during backoff?
+                          {
+                            queuefunc ( QSTOPSONG ) ;         // Yes, flush the old song
+                          }
+                          reset() ;                           // Start fresh
+                        }
+                        retry = false ;
+                      }
+    void              fail ( rcreason_t reason ) ;            // Handle a failure
+    void              loop() ;                                // Watch the stream
+} ;
+
+
+//**************************************************************************************************
+//                                    R E C O V E R Y C : : R E S E T                              *
+//**************************************************************************************************
+// A new station is selected by the user.  Forget the failures of the old one.                     *
+//**************************************************************************************************
+void recoveryc::reset()
+{
+  fails = 0 ;
+  pending = false ;
+  retry = false ;
+  resuming = false ;
+  okstart = 0 ;
+}
+
+
+//**************************************************************************************************
+//                                     R E C O V E R Y C : : F A I L                               *
+//**************************************************************************************************
+// Handle a failure of the stream.  Schedule a reconnect to the same URL or skip the station if    *
+// there were too many successive failures.                                                        *
+//**************************************************************************************************
+void recoveryc::fail ( rcreason_t reason )
+{
+  uint32_t wait ;                                             // Delay before reconnect
+
+  count[reason]++ ;                                           // Count for statistics
+  okstart = 0 ;                                               // Not playing well
+  hls.stop() ;                                                // Stop HLS session if any
+  stop_mp3client() ;                                          // Close the connection
+  if ( ( ++fails > ini_block.rcretries ) ||                   // Too many failures?
+       ( reason == RC_NODECODE ) )                            // or no use to retry?
+  {
+    dbgprint ( "%s, skip station after %d retries",           // Yes, give up on this station
+               rcnames[reason], fails - 1 ) ;
+    skips++ ;
+    reset() ;
+    setdatamode ( STOPREQD ) ;                                // Stop player
+    ini_block.newpreset++ ;                                   // Try next channel
+    return ;
+  }
+  wait = RCMAXDELAY ;                                         // Assume max. delay
+  if ( fails < 8 )                                            // Prevent overflow of shift
+  {
+    wait = RCBASE << ( fails - 1 ) ;                          // Exponential backoff
+  }
+  if ( wait > RCMAXDELAY )                                    // Limit delay
+  {
+    wait = RCMAXDELAY ;
+  }
+  wait = wait / 2 + esp_random() % ( wait / 2 + 1 ) ;        // Add jitter
+  dbgprint ( "%s on %s, reconnect %d in %d msec",
+             rcnames[reason], host.c_str(), fails, wait ) ;
+  if ( reason == RC_DECSTALL )                                // Decoder stuck?
+  {
+    queuefunc ( QSTOPSONG ) ;                                 // Yes, flush and restart the song
+  }
+  resuming = ( reason != RC_DECSTALL ) ;                      // Otherwise continue buffered audio
+  setdatamode ( STOPPED ) ;                                   // Nothing to read until reconnect
+  tretry = millis() + wait ;                                  // Time for reconnect
+  pending = true ;
+}
+
+
+//**************************************************************************************************
+//                                     R E C O V E R Y C : : L O O P                               *
+//**************************************************************************************************
+// Watch the stream.  Called from mp3loop().  Local files are not watched.  HLS reports a failed   *
+// segment or playlist, a segment is only watched for stalls while it is connected, as there is no *
+// data between the segments.  The end of a track from a playlist is not a failure, the next entry *
+// is played when the buffer is empty.  Neither is the end of a file with a known length, the      *
+// rest is played and the next preset is selected.                                                 *
+//**************************************************************************************************
+void recoveryc::loop()
+{
+  uint32_t now = millis() ;                                   // Current time
+
+  if ( pending )                                              // Reconnect scheduled?
+  {
+    if ( datamode != STOPPED )                                // Other station started?
+    {
+      reset() ;                                               // Yes, cancel
+    }
+    else if ( (int32_t)( now - tretry ) >= 0 )                // Time for reconnect?
+    {
+      pending = false ;                                       // Yes, request the same URL again
+      reconnects++ ;
+      retry = true ;
+      hostreq = true ;
+    }
+    return ;
+  }
+  if ( localfile || !( datamode & ( DATA | METADATA ) ) )     // Playing a stream?
+  {
+    lastplay = now ;                                          // No, nothing to watch
+    oldtotal = totalcount ;
+    dectel.dead = false ;                                     // Forget stale flag
+    return ;
+  }
+  if ( dectel.dead )                                          // Stream does not decode?
+  {
+    dectel.dead = false ;                                     // Yes, skip the station
+    fail ( RC_NODECODE ) ;
+    return ;
+  }
+  if ( totalcount != oldtotal )                               // Decoder made progress?
+  {
+    oldtotal = totalcount ;                                   // Yes, remember
+    lastplay = now ;
+  }
+  else if ( ( ( now - lastplay ) > RCDECSTALL ) &&            // No progress for some time?
+            ( mp3ring.fill() >= bufms2bytes ( ini_block.prebuf_ms ) ) ) // and enough data?
+  {
+    fail ( RC_DECSTALL ) ;                                    // Yes, decoder stall
+    return ;
+  }
+  if ( hls.active )                                           // HLS session?
+  {
+    if ( hls.failed )                                         // Yes, segment or playlist failed?
+    {
+      fail ( RC_CONNFAIL ) ;                                  // Yes, reconnect to the playlist
+      return ;
+    }
+    if ( mp3client.connected() &&                             // Segment stalled?
+         ( ( now - lastrx ) > RCSTALL ) &&
+         ( ( now - hls.tseg ) > RCSTALL ) )
+    {
+      fail ( RC_NETSTALL ) ;
+      return ;
+    }
+  }
+  else
+  {
+    if ( !mp3client.connected() && ( mp3client.available() == 0 ) ) // Closed by server?
+    {
+      if ( ( playlist_num == 0 ) &&                           // Yes, file with known length?
+           ( hdrp.clength != 0xFFFFFFFF ) && ( metaint == 0 ) )
+      {
+        dbgprint ( "End of file" ) ;                          // Yes, play the rest
+        stopdrain = true ;
+        setdatamode ( STOPREQD ) ;
+        ini_block.newpreset++ ;                               // and go to the next preset
+      }
+      else if ( playlist_num == 0 )                           // Track from a playlist?
+      {
+        fail ( RC_EOF ) ;                                     // No, stream failed
+      }
+      else if ( mp3ring.fill() == 0 )                         // End of track played?
+      {
+        dbgprint ( "End of track" ) ;                         // Yes, go to next entry
+        setdatamode ( STOPREQD ) ;
+        ini_block.newpreset++ ;
+      }
+      return ;
+    }
+    if ( ( now - lastrx ) > RCSTALL )                         // No data for some time?
+    {
+      fail ( RC_NETSTALL ) ;
+      return ;
+    }
+  }
+  if ( okstart == 0 )                                         // Start of good playing?
+  {
+    okstart = now ;                                           // Yes, remember
+  }
+  else if ( fails && ( ( now - okstart ) > RCSTABLE ) )       // Playing well for some time?
+  {
+    dbgprint ( "Stream recovered after %d retries", fails ) ;
+    fails = 0 ;                                               // Yes, clear failures
+  }
+}
+
+recoveryc        recovery ;                                   // Recovery of stream failures
+
+
+//**************************************************************************************************
+// Statistics.                                                                                     *
+//**************************************************************************************************
+// Sampled every 100 msec by spftask: bytes/sec received from the stream, bytes/sec sent to the    *
+// decoder, the fill of the ring buffer in percent and the WiFi signal (once per second).  For     *
+// every value the last sample, min, max and an EWMA (weight 1/8) are kept.  The buffer fill and   *
+// the duration of mp3loop() are also counted in histograms with fixed buckets.  The playtask adds *
+// the time needed to stop a song.  The results are shown by the "stats" command and as JSON by    *
+// "/?statsjson".                                                                                  *
+//**************************************************************************************************
+#define STFILLBKT  10                                         // Buckets for fill, 10 percent each
+#define STLOOPBKT  10                                         // Buckets for mp3loop() duration
+
+const uint32_t stloopbound[STLOOPBKT - 1] =                   // Upper bounds of buckets in usec
+{
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000
+} ;
+
+
+//**************************************************************************************************
+//                                        H I S T C O U N T                                        *
+//**************************************************************************************************
+// Count a time in usec in a histogram with the bucket bounds of stloopbound.                      *
+//**************************************************************************************************
+void histcount ( uint32_t* h, uint32_t us )
+{
+  int i ;                                                     // Index in h
+
+  for ( i = 0 ; i < ( STLOOPBKT - 1 ) ; i++ )                 // Find bucket
+  {
+    if ( us < stloopbound[i] )
+    {
+      break ;
+    }
+  }
+  h[i]++ ;
+}
+
+
+//**************************************************************************************************
+//                                         H I S T J S O N                                         *
+//**************************************************************************************************
+// Format a histogram as a JSON array.                                                             *
+//**************************************************************************************************
+String histjson ( const uint32_t* h, int n )
+{
+  String res = "[" ;                                          // Result
+  int    i ;                                                  // Index in h
+
+  for ( i = 0 ; i < n ; i++ )
+  {
+    if ( i )
+    {
+      res += "," ;
+    }
+    res += String ( h[i] ) ;
+  }
+  return res + "]" ;
+}
+
+class statval
+{
+  public:
+    uint32_t          last ;                                  // Last sample
+    uint32_t          min ;                                   // Minimum
+    uint32_t          max ;                                   // Maximum
+    uint32_t          ew8 ;                                   // EWMA times 8
+    uint32_t          n ;                                     // Number of samples
+                      statval()
+                      {
+                        reset() ;
+                      }
+    void              reset()
+                      {
+                        last = 0 ;
+                        min = 0xFFFFFFFF ;
+                        max = 0 ;
+                        ew8 = 0 ;
+                        n = 0 ;
+                      }
+    void              add ( uint32_t x ) ;                    // Add a sample
+    uint32_t          ewma()                                  // Get EWMA
+                      {
+                        return ew8 / 8 ;
+                      }
+    String            json ( const char* name ) ;             // Format as JSON member
+} ;
+
+
+//**************************************************************************************************
+//                                        S T A T V A L : : A D D                                  *
+//**************************************************************************************************
+// Add a sample.  The first sample initializes the EWMA.                                           *
+//**************************************************************************************************
+void statval::add ( uint32_t x )
+{
+  last = x ;
+  if ( x < min )
+  {
+    min = x ;
+  }
+  if ( x > max )
+  {
+    max = x ;
+  }
+  if ( n++ == 0 )                                             // First sample?
+  {
+    ew8 = x * 8 ;                                             // Yes, start EWMA here
+  }
+  else
+  {
+    ew8 = ew8 - ew8 / 8 + x ;                                 // ewma += ( x - ewma ) / 8
+  }
+}
+
+
+//**************************************************************************************************
+//                                       S T A T V A L : : J S O N                                 *
+//**************************************************************************************************
+// Format as a JSON member like "name":{"last":1,"min":0,"max":2,"ewma":1}.                        *
+//**************************************************************************************************
+String statval::json ( const char* name )
+{
+  char tmpstr[100] ;                                          // Formatted result
+
+  sprintf ( tmpstr, "\"%s\":{\"last\":%d,\"min\":%d,\"max\":%d,\"ewma\":%d}",
+            name, last, n ? min : 0, max, ewma() ) ;
+  return String ( tmpstr ) ;
+}
+
+
+//**************************************************************************************************
+// SPI bus arbiter.                                                                                *
+//**************************************************************************************************
+// All users of the SPI bus claim it by claimSPI() with an ID, that is mapped to a client.  The    *
+// VS1053 client has priority: while it waits, other clients do not start a new claim and bulk     *
+// users holding the bus give it away at spiarb.yield().  The FreeRTOS mutex gives the bus to the  *
+// waiting task with the highest priority and lends that priority to the holder.  The wait and     *
+// hold times per client are counted in histograms with the bucket bounds of stloopbound.          *
+// If the VS1053 has a bus of its own (see "pin_hspi_*"), that bus has a lock of its own too.  The *
+// VS1053 client then only takes that lock and does not need priority.  The control client (volume *
+// and tone, time on the display) uses both buses and takes both locks, the shared bus first.      *
+//**************************************************************************************************
+#define SPISLOWWAIT 250000                                    // Report longer waits, usec
+
+enum spiclient_t { SC_VS1053, SC_FS, SC_DISPLAY, SC_CONTROL,  // Clients of the SPI bus
+                   SC_NUMCLIENT } ;
+
+const char* const scnames[] =                                 // Names for JSON and debug output
+{
+  "vs1053", "fs", "display", "control"
+} ;
+
+class spiarbc
+{
+  private:
+    SemaphoreHandle_t vssem = NULL ;                          // Lock for bus of VS1053, if separate
+    spiclient_t       holder[2] ;                             // Client that holds the bus, per bus
+    const char*       holderid[2] = { "none", "none" } ;      // ID that holds the bus
+    TaskHandle_t      owner[2] = { NULL, NULL } ;             // Task that holds the bus
+    uint32_t          tclaim[2] ;                             // Time the bus was taken in usec
+    std::atomic<int>  priowait ;                              // Number of waiting VS1053 claims
+  public:
+    uint32_t          claims[SC_NUMCLIENT] ;                  // Number of claims per client
+    uint32_t          maxwait[SC_NUMCLIENT] ;                 // Max. wait time per client
+    uint32_t          maxhold[SC_NUMCLIENT] ;                 // Max. hold time per client
+    uint32_t          waithist[SC_NUMCLIENT][STLOOPBKT] ;     // Histograms of wait time
+    uint32_t          holdhist[SC_NUMCLIENT][STLOOPBKT] ;     // Histograms of hold time
+                      spiarbc()
+                      {
+                        priowait = 0 ;
+                        reset() ;
+                      }
+    void              reset() ;                               // Clear statistics
+    void              split()                                 // VS1053 gets a bus of its own
+                      {
+                        vssem = xSemaphoreCreateMutex() ;
+                      }
+    spiclient_t       client ( const char* id ) ;             // Map ID to client
+    void              claim ( const char* id ) ;              // Claim the bus
+    void              release() ;                             // Release the bus
+    void              yield() ;                               // Give bus to VS1053 if it waits
+    String            json() ;                                // Statistics as JSON
+} ;
+
+
+//**************************************************************************************************
+//                                      S P I A R B C : : R E S E T                                *
+//**************************************************************************************************
+// Clear the statistics.                                                                           *
+//**************************************************************************************************
+void spiarbc::reset()
+{
+  memset ( claims, 0, sizeof(claims) ) ;
+  memset ( maxwait, 0, sizeof(maxwait) ) ;
+  memset ( maxhold, 0, sizeof(maxhold) ) ;
+  memset ( waithist, 0, sizeof(waithist) ) ;
+  memset ( holdhist, 0, sizeof(holdhist) ) ;
+}
+
+
+//**************************************************************************************************
+//                                     S P I A R B C : : C L I E N T                               *
+//**************************************************************************************************
+// Map the ID of a claim to a client.                                                              *
+//**************************************************************************************************
+spiclient_t spiarbc::client ( const char* id )
+{
+  if ( ( strcmp ( id, "chunk" ) == 0 ) ||                     // Data to VS1053?
+       ( strcmp ( id, "drain" ) == 0 ) ||                     // or tail at end of song?
+       ( strcmp ( id, "startsong" ) == 0 ) ||                 // or start/stop of a song?
+       ( strcmp ( id, "stopsong" ) == 0 ) ||
+       ( strcmp ( id, "rate" ) == 0 ) )                       // or rate control?
+  {
+    return SC_VS1053 ;
+  }
+  if ( strcmp ( id, "hspectft" ) == 0 )                       // Display refresh?
+  {
+    return SC_DISPLAY ;
+  }
+  if ( ( strncasecmp ( id, "sd", 2 ) == 0 ) ||                // SD card or USB drive?
+       ( strncasecmp ( id, "usb", 3 ) == 0 ) ||
+       ( strcmp ( id, "fsread" ) == 0 ) ||
+       ( strcmp ( id, "opennextf" ) == 0 ) ||
+       ( strcmp ( id, "close" ) == 0 ) )
+  {
+    return SC_FS ;
+  }
+  return SC_CONTROL ;                                         // Volume, tone and the rest
+}
+
+
+//**************************************************************************************************
+//                                      S P I A R B C : : C L A I M                                *
+//**************************************************************************************************
+// Claim the bus.  Waits as long as needed, the bus is never used without the lock.  Other clients *
+// wait while the VS1053 is waiting.                                                               *
+//**************************************************************************************************
+void spiarbc::claim ( const char* id )
+{
+  spiclient_t c = client ( id ) ;                             // Client of this claim
+  int         b = 0 ;                                         // Bus, 1 is separate VS1053 bus
+  uint32_t    t0 = micros() ;                                 // Start of wait
+  uint32_t    wait ;                                          // Wait time in usec
+
+  if ( vssem && ( c == SC_VS1053 ) )                          // VS1053 on its own bus?
+  {
+    b = 1 ;                                                   // Yes, only that lock
+    xSemaphoreTake ( vssem, portMAX_DELAY ) ;
+  }
+  else if ( c == SC_VS1053 )                                  // Priority client?
+  {
+    priowait++ ;                                              // Yes, others have to wait
+    xSemaphoreTake ( SPIsem, portMAX_DELAY ) ;                // Claim SPI bus
+    priowait-- ;
+  }
+  else
+  {
+    while ( true )
+    {
+      while ( priowait > 0 )                                  // VS1053 waiting?
+      {
+        vTaskDelay ( 1 ) ;                                    // Yes, let it go first
+      }
+      xSemaphoreTake ( SPIsem, portMAX_DELAY ) ;              // Claim SPI bus
+      if ( priowait == 0 )                                    // VS1053 came in between?
+      {
+        break ;                                               // No, bus is ours
+      }
+      xSemaphoreGive ( SPIsem ) ;                             // Yes, give it away
+    }
+    if ( vssem && ( c == SC_CONTROL ) )                       // Control needs VS1053 bus too?
+    {
+      xSemaphoreTake ( vssem, portMAX_DELAY ) ;               // Yes, take it as well
+    }
+  }
+  tclaim[b] = micros() ;                                      // Start of hold time
+  wait = tclaim[b] - t0 ;                                     // Time waited for the bus
+  if ( wait > SPISLOWWAIT )                                   // Very long wait?
+  {
+    dbgprint ( "SPI bus taken after %d msec by CPU %d, id %s, was held by %s",
+               wait / 1000, xPortGetCoreID(), id, holderid[b] ) ;
+  }
+  holder[b] = c ;                                             // Remember holder
+  holderid[b] = id ;
+  owner[b] = xTaskGetCurrentTaskHandle() ;
+  claims[c]++ ;                                               // Count for statistics
+  histcount ( waithist[c], wait ) ;
+  if ( wait > maxwait[c] )
+  {
+    maxwait[c] = wait ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                    S P I A R B C : : R E L E A S E                              *
+//**************************************************************************************************
+// Release the bus and count the hold time.  The bus is the one held by the calling task.          *
+//**************************************************************************************************
+void spiarbc::release()
+{
+  int         b = 0 ;                                         // Bus, 1 is separate VS1053 bus
+  uint32_t    hold ;                                          // Time the bus was held
+  spiclient_t c ;                                             // Client that held the bus
+
+  if ( vssem && ( owner[1] == xTaskGetCurrentTaskHandle() ) ) // Holding the VS1053 bus?
+  {
+    b = 1 ;                                                   // Yes
+  }
+  hold = micros() - tclaim[b] ;
+  c = holder[b] ;
+  owner[b] = NULL ;
+  histcount ( holdhist[c], hold ) ;
+  if ( hold > maxhold[c] )
+  {
+    maxhold[c] = hold ;
+  }
+  if ( b == 1 )                                               // VS1053 on its own bus?
+  {
+    xSemaphoreGive ( vssem ) ;                                // Yes, release that bus
+    return ;
+  }
+  if ( vssem && ( c == SC_CONTROL ) )                         // Control held both buses?
+  {
+    xSemaphoreGive ( vssem ) ;                                // Yes, release VS1053 bus as well
+  }
+  xSemaphoreGive ( SPIsem ) ;                                 // Release SPI bus
+}
+
+
+//**************************************************************************************************
+//                                      S P I A R B C : : Y I E L D                                *
+//**************************************************************************************************
+// Called by a bulk user between slices of its work.  If the VS1053 waits, the bus is released and *
+// claimed again.                                                                                  *
+//**************************************************************************************************
+void spiarbc::yield()
+{
+  const char* id = holderid[0] ;                              // ID of the current claim
+
+  if ( priowait > 0 )                                         // VS1053 waiting?
+  {
+    release() ;                                               // Yes, let it go first
+    claim ( id ) ;                                            // and continue
+  }
+}
+
+
+//**************************************************************************************************
+//                                      S P I A R B C : : J S O N                                  *
+//**************************************************************************************************
+// Statistics per client as a JSON object.  Bucket bounds are "loopbounds".                        *
+//**************************************************************************************************
+String spiarbc::json()
+{
+  String res = "{" ;                                          // Result
+  int    c ;                                                  // Client
+
+  for ( c = 0 ; c < SC_NUMCLIENT ; c++ )
+  {
+    if ( c )
+    {
+      res += "," ;
+    }
+    res += String ( "\"" ) + scnames[c] + "\":{\"claims\":" + String ( claims[c] ) +
+           ",\"maxwait\":" + String ( maxwait[c] ) +
+           ",\"maxhold\":" + String ( maxhold[c] ) +
+           ",\"wait\":" + histjson ( waithist[c], STLOOPBKT ) +
+           ",\"hold\":" + histjson ( holdhist[c], STLOOPBKT ) + "}" ;
+  }
+  return res + "}" ;
+}
+
+spiarbc          spiarb ;                                     // Arbiter for the SPI bus
+
+
+//**************************************************************************************************
+// Statistics of the player.                                                                       *
+//**************************************************************************************************
+// The values and histograms of the statistics section above, sampled by spftask.  A reset also    *
+// clears the counters of the SPI bus arbiter, so "stats" and "/?statsjson" cover the same period. *
+//**************************************************************************************************
+class statsc
+{
+  private:
+    uint32_t          tsample = 0 ;                           // Time of last sample
+    uint32_t          oldingest ;                             // ingested at last sample
+    uint32_t          olddecode ;                             // totalcount at last sample
+    uint8_t           rssicnt = 0 ;                           // Count to sample RSSI once per second
+    volatile bool     resetreq = false ;                      // Reset requested
+    void              clear() ;                               // Clear all statistics
+  public:
+    uint32_t          ingested = 0 ;                          // Bytes received, updated by mp3loop()
+    statval           ingest ;                                // Bytes/sec from stream
+    statval           decode ;                                // Bytes/sec to decoder
+    statval           fill ;                                  // Ring buffer fill in percent
+    statval           rssi ;                                  // WiFi signal, -dBm
+    statval           stop ;                                  // Stop latency in usec
+    uint32_t          fillhist[STFILLBKT] ;                   // Histogram of fill
+    uint32_t          loophist[STLOOPBKT] ;                   // Histogram of mp3loop() duration
+    void              reset()                                 // Request to clear all statistics
+                      {
+                        resetreq = true ;                     // Done by sample()
+                      }
+    void              sample() ;                              // Take a sample, called from spftask
+    void              loopdur ( uint32_t us ) ;               // Count duration of mp3loop()
+    String            json() ;                                // All statistics as JSON
+} ;
+
+
+//**************************************************************************************************
+//                                        S T A T S C : : C L E A R                                *
+//**************************************************************************************************
+// Clear all statistics.  Called by sample() in spftask after a reset request, so the statistics   *
+// are not cleared by another task while spftask updates them.                                     *
+//**************************************************************************************************
+void statsc::clear()
+{
+  ingest.reset() ;
+  decode.reset() ;
+  fill.reset() ;
+  rssi.reset() ;
+  stop.reset() ;
+  memset ( fillhist, 0, sizeof(fillhist) ) ;
+  memset ( loophist, 0, sizeof(loophist) ) ;
+  spiarb.reset() ;
+}
+
+
+//**************************************************************************************************
+//                                       S T A T S C : : S A M P L E                               *
+//**************************************************************************************************
+// Take a sample.  Called from spftask about every 100 msec, rates use the real interval.          *
+//**************************************************************************************************
+void statsc::sample()
+{
+  uint32_t now = millis() ;                                   // Time of this sample
+  uint32_t dt = now - tsample ;                               // Interval since last sample
+  uint32_t in = ingested ;                                    // Copy of counters
+  uint32_t dec = totalcount ;
+  uint32_t pct ;                                              // Fill in percent
+
+  if ( resetreq )                                             // Reset requested?
+  {
+    resetreq = false ;                                        // Yes, clear all
+    clear() ;
+  }
+  if ( ( tsample != 0 ) && ( dt > 0 ) )                       // Interval known?
+  {
+    ingest.add ( (uint64_t)( in - oldingest ) * 1000 / dt ) ; // Yes, compute rates
+    decode.add ( (uint64_t)( dec - olddecode ) * 1000 / dt ) ;
+  }
+  tsample = now ;
+  oldingest = in ;
+  olddecode = dec ;
+  pct = mp3ring.fill() * 100 / RINGSIZ ;                      // Fill of ring buffer
+  fill.add ( pct ) ;
+  fillhist[pct * STFILLBKT / 101]++ ;                         // 100 percent is in last bucket
+  if ( ( ++rssicnt >= 10 ) && NetworkFound )                  // Time to sample RSSI?
+  {
+    rssicnt = 0 ;
+    rssi.add ( -WiFi.RSSI() ) ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                      S T A T S C : : L O O P D U R                              *
+//**************************************************************************************************
+// Count the duration of mp3loop() in the histogram.                                               *
+//**************************************************************************************************
+void statsc::loopdur ( uint32_t us )
+{
+  histcount ( loophist, us ) ;
+}
+
+
+//**************************************************************************************************
+//                                         S T A T S C : : J S O N                                 *
+//**************************************************************************************************
+// All statistics as a JSON object.                                                                *
+//**************************************************************************************************
+String statsc::json()
+{
+  String res = "{" ;                                          // Result
+  int    i ;                                                  // Index in stloopbound
+
+  res += String ( "\"uptime\":" ) + String ( millis() / 1000 ) + "," ;
+  res += ingest.json ( "ingest" ) + "," ;
+  res += decode.json ( "decode" ) + "," ;
+  res += fill.json ( "fill" ) + "," ;
+  res += rssi.json ( "rssi" ) + "," ;
+  res += stop.json ( "stopus" ) + "," ;
+  res += String ( "\"decoder\":" ) + dectel.json() + "," ;
+  res += String ( "\"fillhist\":" ) + histjson ( fillhist, STFILLBKT ) + "," ;
+  res += "\"loopbounds\":[" ;                                 // Bucket bounds for loophist
+  for ( i = 0 ; i < ( STLOOPBKT - 1 ) ; i++ )
+  {
+    res += String ( stloopbound[i] ) + ( ( i < ( STLOOPBKT - 2 ) ) ? "," : "]," ) ;
+  }
+  res += String ( "\"loophist\":" ) + histjson ( loophist, STLOOPBKT ) + "," ;
+  res += String ( "\"spi\":" ) + spiarb.json() + "," ;
+  res += String ( "\"rebuffers\":" ) + String ( rebuffercount ) + "," ;
+  res += String ( "\"reconnects\":" ) + String ( recovery.reconnects ) + "," ;
+  res += String ( "\"skips\":" ) + String ( recovery.skips ) + "," ;
+  res += String ( "\"ingestcore\":" ) + String ( ini_block.ingestcore ) + "," ;
+  res += String ( "\"playcore\":" ) + String ( ini_block.playcore ) + "," ;
+  res += String ( "\"freeheap\":" ) + String ( ESP.getFreeHeap() ) ;
+  return res + "}" ;
+}
+
+statsc           stats ;                                      // Throughput and buffer statistics
+
+
+//**************************************************************************************************
+// Instrumentation.                                                                                *
+//**************************************************************************************************
+// Iteration times of mp3loop(), handle_spec() and the data bursts of playtask are counted in      *
+// histograms with the bucket bounds of stloopbound, together with the busy time.  On request the  *
+// CPU load of the tasks, their stack high-water marks and the heap are added.  The CPU load comes *
+// from the FreeRTOS run-time stats if they are enabled in the build, otherwise only the busy time *
+// of the loops is known.  Loads are computed over the interval since the previous request.  Shown *
+// as text by "/?perf", as JSON by "/?perfjson" and published to MQTT every "perfpub" seconds.     *
+//**************************************************************************************************
+#if ( configUSE_TRACE_FACILITY == 1 ) && ( configGENERATE_RUN_TIME_STATS == 1 )
+#define PFRUNTIME                                             // Run-time stats available
+#endif
+#define PFMAXTASK  20                                         // Max. number of tasks in the report
+
+enum pfloop_t { PF_MP3LOOP, PF_HSPEC, PF_PLAY, PF_NUMLOOP } ; // Instrumented loops
+
+const char* const pfnames[] =                                 // Names for the report
+{
+  "mp3loop", "handle_spec", "playtask"
+} ;
+
+class perfc
+{
+  private:
+    uint32_t          busy[PF_NUMLOOP] ;                      // Total busy time in usec
+    uint32_t          prevbusy[PF_NUMLOOP] ;                  // busy[] at last report
+    volatile bool     maxreq[PF_NUMLOOP] ;                    // Restart maxus at next iteration
+    uint32_t          tlast = 0 ;                             // Time of last report in usec
+#ifdef PFRUNTIME
+    UBaseType_t       prevnum[PFMAXTASK] ;                    // Task numbers of last report
+    uint32_t          prevrt[PFMAXTASK] ;                     // Run time counters of last report
+    int               nprev = 0 ;                             // Number of tasks in last report
+    uint32_t          prevtotal = 0 ;                         // Total run time of last report
+#endif
+    int               load ( UBaseType_t num, uint32_t rt,    // CPU load of a task in 0.1 percent
+                             uint32_t dtotal ) ;
+  public:
+    uint32_t          count[PF_NUMLOOP] ;                     // Number of iterations
+    uint32_t          maxus[PF_NUMLOOP] ;                     // Longest iteration since last report
+    uint32_t          hist[PF_NUMLOOP][STLOOPBKT] ;           // Histograms of iteration time
+                      perfc()
+                      {
+                        memset ( busy, 0, sizeof(busy) ) ;
+                        memset ( prevbusy, 0, sizeof(prevbusy) ) ;
+                        memset ( (void*)maxreq, 0, sizeof(maxreq) ) ;
+                        memset ( count, 0, sizeof(count) ) ;
+                        memset ( maxus, 0, sizeof(maxus) ) ;
+                        memset ( hist, 0, sizeof(hist) ) ;
+                      }
+    void              add ( pfloop_t l, uint32_t us ) ;       // Count an iteration
+    String            report ( bool json ) ;                  // Full report as text or JSON
+    String            summary() ;                             // Short report for MQTT
+} ;
+
+
+//**************************************************************************************************
+//                                          P E R F C : : A D D                                    *
+//**************************************************************************************************
+// Count an iteration of a loop.  Every loop is counted by one task only, so only that task writes *
+// the counters.  report() does not clear them, but asks for a new maximum with maxreq[].          *
+//**************************************************************************************************
+void perfc::add ( pfloop_t l, uint32_t us )
+{
+  count[l]++ ;
+  busy[l] += us ;
+  histcount ( hist[l], us ) ;
+  if ( maxreq[l] || ( us > maxus[l] ) )                       // New maximum or first after report?
+  {
+    maxreq[l] = false ;
+    maxus[l] = us ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                          P E R F C : : L O A D                                  *
+//**************************************************************************************************
+// CPU load of a task in 0.1 percent of one core since the last report, -1 if not known.           *
+//**************************************************************************************************
+int perfc::load ( UBaseType_t num, uint32_t rt, uint32_t dtotal )
+{
+#ifdef PFRUNTIME
+  int i ;                                                     // Index in prevnum
+
+  for ( i = 0 ; i < nprev ; i++ )
+  {
+    if ( ( prevnum[i] == num ) && dtotal )                    // Task in last report?
+    {
+      return (uint64_t)( rt - prevrt[i] ) * 1000 / dtotal ;   // Yes, compute load
+    }
+  }
+#endif
+  return -1 ;
+}
+
+
+//**************************************************************************************************
+//                                        P E R F C : : R E P O R T                                *
+//**************************************************************************************************
+// Full report as text or as JSON.  Busy time and the longest iteration are since the last report. *
+//**************************************************************************************************
+String perfc::report ( bool json )
+{
+  String       res ;                                          // Result
+  char         line[120] ;                                    // One formatted line
+  uint32_t     now = micros() ;                               // Time of this report
+  uint32_t     dt = now - tlast ;                             // Interval since last report
+  uint32_t     b ;                                            // Copy of busy[i]
+  int          i ;                                            // Index in tasks and loops
+  int          n ;                                            // Number of tasks
+  int          ld ;                                           // Load in 0.1 percent
+  char         cpu[8] ;                                       // Load as text
+#ifdef PFRUNTIME
+  TaskStatus_t ts[PFMAXTASK] ;                                // State of the tasks
+  uint32_t     total ;                                        // Total run time
+
+  n = uxTaskGetSystemState ( ts, PFMAXTASK, &total ) ;        // Get run-time stats
+#else
+  struct
+  {
+    const char*  pcTaskName ;                                 // Same members as TaskStatus_t
+    TaskHandle_t xHandle ;
+  } ts[] = { { "loop", maintask }, { "Playtask", xplaytask },  // Known tasks
+             { "Spftask", xspftask }, { "Ingesttask", xingesttask } } ;
+
+  n = xingesttask ? 4 : 3 ;                                   // Ingest task is optional
+#endif
+  tlast = now ;
+  snprintf ( line, sizeof(line),
+             json ? "{\"uptime\":%u,\"heap\":{\"free\":%u,\"largest\":%u,\"minfree\":%u},"
+                    "\"tasks\":[" :
+                    "Uptime %u sec, heap free %u, largest block %u, min. free %u\n"
+                    "Task            Stack  CPU%%\n",
+             millis() / 1000, ESP.getFreeHeap(), ESP.getMaxAllocHeap(), ESP.getMinFreeHeap() ) ;
+  res = String ( line ) ;
+  for ( i = 0 ; i < n ; i++ )                                 // Report tasks
+  {
+#ifdef PFRUNTIME
+    ld = load ( ts[i].xTaskNumber, ts[i].ulRunTimeCounter, total - prevtotal ) ;
+#else
+    ld = -1 ;                                                 // Load not known
+#endif
+    if ( ld < 0 )                                             // Load known?
+    {
+      strcpy ( cpu, json ? "null" : "-" ) ;                   // No
+    }
+    else
+    {
+      snprintf ( cpu, sizeof(cpu), "%d.%d", ld / 10, ld % 10 ) ; // Yes, format it
+    }
+    snprintf ( line, sizeof(line),
+               json ? "%s{\"name\":\"%s\",\"stack\":%u,\"cpu\":%s}" :
+                      "%s%-15s %5u %5s\n",
+               ( json && i ) ? "," : "", ts[i].pcTaskName,
+               uxTaskGetStackHighWaterMark ( ts[i].xHandle ), cpu ) ;
+    res += String ( line ) ;
+  }
+#ifdef PFRUNTIME
+  for ( i = 0 ; i < n ; i++ )                                 // Remember counters for next report
+  {
+    prevnum[i] = ts[i].xTaskNumber ;
+    prevrt[i] = ts[i].ulRunTimeCounter ;
+  }
+  nprev = n ;
+  prevtotal = total ;
+#endif
+  res += json ? "],\"loops\":{" : "Loop               Count   Max usec  Busy%\n" ;
+  for ( i = 0 ; i < PF_NUMLOOP ; i++ )                        // Report loops
+  {
+    b = busy[i] ;                                             // Snapshot, busy[] is not cleared
+    ld = dt ? (uint64_t)( b - prevbusy[i] ) * 1000 / dt : 0 ; // Busy time in 0.1 percent
+    prevbusy[i] = b ;
+    snprintf ( line, sizeof(line),
+               json ? "%s\"%s\":{\"count\":%u,\"max\":%u,\"busy\":%d.%d,\"hist\":" :
+                      "%s%-15s %9u %10u %3d.%d\n",
+               ( json && i ) ? "," : "", pfnames[i], count[i], maxus[i], ld / 10, ld % 10 ) ;
+    maxreq[i] = true ;                                        // New maximum for next report
+    res += String ( line ) ;
+    if ( json )
+    {
+      res += histjson ( hist[i], STLOOPBKT ) + "}" ;
+    }
+  }
+  if ( json )
+  {
+    res += "},\"loopbounds\":" + histjson ( stloopbound, STLOOPBKT - 1 ) + "}" ;
+  }
+  return res ;
+}
+
+
+//**************************************************************************************************
+//                                       P E R F C : : S U M M A R Y                               *
+//**************************************************************************************************
+// Short report for MQTT: heap free, largest block and minimum, longest iteration of the loops.    *
+//**************************************************************************************************
+String perfc::summary()
+{
+  char line[100] ;                                            // Formatted result
+
+  snprintf ( line, sizeof(line), "heap %u/%u/%u, max usec %u/%u/%u",
+             ESP.getFreeHeap(), ESP.getMaxAllocHeap(), ESP.getMinFreeHeap(),
+             maxus[PF_MP3LOOP], maxus[PF_HSPEC], maxus[PF_PLAY] ) ;
+  return String ( line ) ;
+}
+
+perfc            perf ;                                       // Instrumentation of tasks and loops
+
+
+//**************************************************************************************************
+// Audio frame statistics.                                                                         *
+//**************************************************************************************************
+// The audio data on its way to the ring buffer is scanned for MPEG audio frames or Ogg pages.     *
+// The parsers feed the statistics below: the real bitrate, the sample rate and a list of recent   *
+// frame (or page) boundaries in the ring buffer together with the play time up to that boundary.  *
+//**************************************************************************************************
+#define FRBOUNDS 64                                           // Number of frame boundaries to keep
+
+struct frbound_struct                                         // A frame boundary in the ring
+{
+  uint32_t        pos ;                                       // Position in mp3ring
+  uint32_t        ms ;                                        // Total play time up to this frame
+} ;
+
+struct framestat_struct                                       // Statistics of frames or pages
+{
+  uint32_t        frames ;                                    // Number of frames/pages counted
+  uint64_t        bytes ;                                     // Total length of these frames
+  uint64_t        us ;                                        // Total play time of these frames
+  uint32_t        samplerate ;                                // Sample rate of last frame
+  frbound_struct  bound[FRBOUNDS] ;                           // Recent frame boundaries
+  uint8_t         boundx ;                                    // Index of next entry in bound[]
+  uint32_t        bounds ;                                    // Number of boundaries written
+} ;
+
+struct mp3frame_struct                                        // State of the MPEG frame parser
+{
+  bool            active ;                                    // Scanning enabled or not
+  uint32_t        hdr ;                                       // Last 4 bytes seen, possible header
+  uint8_t         hdrx ;                                      // Number of bytes in hdr
+  uint32_t        skip ;                                      // Bytes to skip to next frame header
+  uint32_t        pending ;                                   // Header of unconfirmed frame or 0
+  uint32_t        lost ;                                      // Number of times sync was lost
+} ;
+
+struct oggpage_struct                                         // State of the Ogg page parser
+{
+  bool            active ;                                    // Scanning enabled or not
+  uint8_t         hdr[27 + 255] ;                             // Page header plus segment table
+  uint16_t        hdrx ;                                      // Number of bytes in hdr
+  uint32_t        pagepos ;                                   // Ring position of page start
+  uint16_t        segx ;                                      // Index of current segment
+  uint16_t        segrest ;                                   // Bytes left in current segment
+  uint8_t         pktno ;                                     // Packet number in logical stream
+  uint32_t        pktx ;                                      // Byte index in current packet
+  int64_t         granule ;                                   // Granule of last page with one, or -1
+  uint32_t        bytes ;                                     // Bytes since that page
+  uint32_t        samplerate ;                                // From identification header
+  uint32_t        pages ;                                     // Number of pages seen
+  uint32_t        lost ;                                      // Number of times sync was lost
+  // Fields to parse the comment header
+  uint8_t         cstate ;                                    // State of comment parser
+  uint32_t        cval ;                                      // Length or count being read
+  uint32_t        cleft ;                                     // Bytes left in field
+  uint32_t        ccount ;                                    // Number of comments left
+  char            ctext[80] ;                                 // Start of current comment
+  uint8_t         ctextx ;                                    // Number of chars in ctext
+  char            title[80] ;                                 // TITLE from comments
+  char            artist[80] ;                                // ARTIST from comments
+} ;
+
+enum { OC_MAGIC, OC_VENDLEN, OC_VENDOR, OC_COUNT,             // States of Ogg comment parser
+       OC_LEN, OC_TEXT, OC_DONE } ;
+
+framestat_struct frstat ;                                     // Frame statistics
+mp3frame_struct  mp3frm ;                                     // Frame parser for MP3 audio
+oggpage_struct   oggpg ;                                      // Page parser for Ogg audio
+
+
+//**************************************************************************************************
+//                                       F R A M E _ A D D                                         *
+//**************************************************************************************************
+// Add a frame or page to the statistics.                                                          *
+//**************************************************************************************************
+void frame_add ( uint32_t bytes, uint64_t us )
+{
+  frstat.frames++ ;
+  frstat.bytes += bytes ;
+  frstat.us += us ;
+}
+
+
+//**************************************************************************************************
+//                                     F R A M E _ B O U N D                                       *
+//**************************************************************************************************
+// Remember a frame boundary at ring position pos with the play time up to that point.             *
+//**************************************************************************************************
+void frame_bound ( uint32_t pos )
+{
+  frstat.bound[frstat.boundx].pos = pos ;                     // Remember start of this frame
+  frstat.bound[frstat.boundx].ms = frstat.us / 1000 ;         // and the time up to here
+  frstat.boundx = ( frstat.boundx + 1 ) % FRBOUNDS ;
+  frstat.bounds++ ;                                           // Not all of them are counted frames
+}
+
+
+//**************************************************************************************************
+//                                   M P 3 H D R D E C O D E                                       *
+//**************************************************************************************************
+// Decode a 4 byte MPEG audio frame header.  Returns the frame length in bytes or 0 if the header  *
+// is not valid.  Sample rate and samples per frame are returned through the pointers.             *
+// Free format bitrate is not supported.                                                           *
+//**************************************************************************************************
+uint32_t mp3hdrdecode ( uint32_t h, uint32_t* sr, uint32_t* spf )
+{
+  static const uint16_t brtab[2][3][15] =                     // Bitrates in kbps, [MPEG2][layer]
+  {
+    { {   0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },  // MPEG1, layer I
+      {   0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },  // MPEG1, layer II
+      {   0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 } },// MPEG1, layer III
+    { {   0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },  // MPEG2, layer I
+      {   0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 },  // MPEG2, layer II
+      {   0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 } } // MPEG2, layer III
+  } ;
+  static const uint16_t srtab[3] = { 44100, 48000, 32000 } ;  // Sample rates for MPEG1
+  uint32_t ver = ( h >> 19 ) & 3 ;                            // 0 = MPEG2.5, 2 = MPEG2, 3 = MPEG1
+  uint32_t lay = 4 - ( ( h >> 17 ) & 3 ) ;                    // Layer 1..3, 4 is reserved
+  uint32_t bri = ( h >> 12 ) & 0xF ;                          // Bitrate index
+  uint32_t sri = ( h >> 10 ) & 3 ;                            // Sample rate index
+  uint32_t pad = ( h >> 9 ) & 1 ;                             // Padding bit
+  uint32_t br ;                                               // Bitrate in kbps
+
+  if ( ( ( h & 0xFFE00000 ) != 0xFFE00000 ) ||                // Check sync and reserved values
+       ( ver == 1 ) || ( lay == 4 ) ||
+       ( bri == 0 ) || ( bri == 15 ) || ( sri == 3 ) )
+  {
+    return 0 ;                                                // Not a valid header
+  }
+  br = brtab[ver != 3][lay - 1][bri] ;
+  *sr = srtab[sri] >> ( 3 - ver - ( ver == 0 ) ) ;            // Half for MPEG2, quarter for MPEG2.5
+  if ( lay == 1 )                                             // Layer I?
+  {
+    *spf = 384 ;
+    return ( 12000 * br / *sr + pad ) * 4 ;
+  }
+  if ( ( lay == 3 ) && ( ver != 3 ) )                         // Layer III, MPEG2 or MPEG2.5?
+  {
+    *spf = 576 ;
+    return 72000 * br / *sr + pad ;
+  }
+  *spf = 1152 ;                                               // Layer II or MPEG1 layer III
+  return 144000 * br / *sr + pad ;
+}
+
+
+//**************************************************************************************************
+//                                    M P 3 F R A M E _ S C A N                                    *
+//**************************************************************************************************
+// Scan a run of MP3 data that was stored in mp3ring at pos.  A frame is counted if the next       *
+// frame header is found at the expected position.  Frames are skipped as a whole, so only the     *
+// headers are really examined.                                                                    *
+//**************************************************************************************************
+void mp3frame_scan ( const uint8_t* p, uint32_t len, uint32_t pos )
+{
+  uint32_t n ;                                                // Number of bytes to skip
+  uint32_t flen ;                                             // Frame length
+  uint32_t sr, spf ;                                          // Sample rate, samples per frame
+  uint32_t plen ;                                             // Length of pending frame
+
+  if ( !mp3frm.active )                                       // Scanning enabled?
+  {
+    return ;                                                  // No, quick return
+  }
+  while ( len )
+  {
+    if ( mp3frm.skip )                                        // Inside a frame?
+    {
+      n = mp3frm.skip ;                                       // Yes, skip to the end of it
+      if ( n > len )
+      {
+        n = len ;
+      }
+      mp3frm.skip -= n ;
+      p += n ;
+      pos += n ;
+      len -= n ;
+      continue ;
+    }
+    mp3frm.hdr = ( mp3frm.hdr << 8 ) | *p++ ;                 // Shift next byte into header
+    pos++ ;
+    len-- ;
+    if ( mp3frm.hdrx < 4 )                                    // 4 bytes collected?
+    {
+      if ( ++mp3frm.hdrx < 4 )
+      {
+        continue ;                                            // No, get next byte
+      }
+    }
+    flen = mp3hdrdecode ( mp3frm.hdr, &sr, &spf ) ;           // Decode, 0 if not a header
+    if ( flen && mp3frm.pending &&                            // Version, layer and sample rate
+         ( ( mp3frm.hdr ^ mp3frm.pending ) & 0xFFFE0C00 ) )   // must match the previous frame
+    {
+      flen = 0 ;
+    }
+    if ( flen == 0 )                                          // Header found?
+    {
+      if ( mp3frm.pending )                                   // No, were we in sync?
+      {
+        mp3frm.pending = 0 ;                                  // Yes, sync lost
+        mp3frm.lost++ ;
+      }
+      continue ;                                              // Search further, byte by byte
+    }
+    if ( mp3frm.pending )                                     // Previous frame confirmed?
+    {
+      plen = mp3hdrdecode ( mp3frm.pending, &sr, &spf ) ;     // Yes, add to statistics
+      frame_add ( plen, (uint64_t)spf * 1000000 / sr ) ;
+    }
+    mp3hdrdecode ( mp3frm.hdr, &sr, &spf ) ;                  // Values for this frame
+    frstat.samplerate = sr ;
+    frame_bound ( pos - 4 ) ;                                 // Remember start of this frame
+    mp3frm.pending = mp3frm.hdr ;                             // To be confirmed by next header
+    mp3frm.skip = flen - 4 ;                                  // Skip rest of the frame
+    mp3frm.hdrx = 0 ;                                         // Start collecting next header
+  }
+}
+
+
+//**************************************************************************************************
+//                                    O G G C O M M E N T                                          *
+//**************************************************************************************************
+// Handle the next byte of an Ogg header packet.  Packet 0 is the identification header, packet 1  *
+// the comment header.  Both Vorbis and Opus are supported.  The fields of the comment header are  *
+// not stored, only the first part of each comment is kept to find TITLE and ARTIST.               *
+//**************************************************************************************************
+void oggcomment ( uint8_t b )
+{
+  uint8_t* h ;                                                // Points to sample rate
+
+  if ( oggpg.pktno == 0 )                                     // Identification header?
+  {
+    // Vorbis: "\x01vorbis", version (4), channels (1), sample rate (4).  Opus: "OpusHead".
+    if ( oggpg.pktx < 16 )
+    {
+      oggpg.ctext[oggpg.pktx] = b ;                           // Keep the first 16 bytes
+    }
+    if ( oggpg.pktx == 15 )                                   // Enough to decide?
+    {
+      if ( memcmp ( oggpg.ctext, "\x01vorbis", 7 ) == 0 )
+      {
+        h = (uint8_t*)oggpg.ctext + 12 ;                      // Position of sample rate
+        oggpg.samplerate = h[0] | ( h[1] << 8 ) | ( h[2] << 16 ) | ( h[3] << 24 ) ;
+      }
+      else if ( memcmp ( oggpg.ctext, "OpusHead", 8 ) == 0 )
+      {
+        oggpg.samplerate = 48000 ;                            // Granules are always 48 kHz
+      }
+    }
+    return ;
+  }
+  switch ( oggpg.cstate )                                     // Comment header
+  {
+    case OC_MAGIC :                                           // "\x03vorbis" or "OpusTags"
+      if ( ( ( oggpg.pktx == 6 ) && ( oggpg.ctext[0] == 3 ) ) ||
+           ( oggpg.pktx == 7 ) )
+      {
+        oggpg.cstate = OC_VENDLEN ;                           // Next is vendor length
+        oggpg.cleft = 4 ;
+        oggpg.cval = 0 ;
+      }
+      if ( oggpg.pktx == 0 )
+      {
+        oggpg.ctext[0] = b ;                                  // Type byte for Vorbis
+      }
+      break ;
+    case OC_VENDLEN :
+    case OC_COUNT :
+    case OC_LEN :
+      oggpg.cval |= (uint32_t)b << ( 8 * ( 4 - oggpg.cleft ) ) ; // Little endian 32 bits
+      if ( --oggpg.cleft )
+      {
+        break ;                                               // Need more bytes
+      }
+      if ( oggpg.cstate == OC_VENDLEN )                       // Length of vendor string?
+      {
+        oggpg.cstate = OC_VENDOR ;                            // Yes, skip the vendor string
+        oggpg.cleft = oggpg.cval ;
+      }
+      else if ( oggpg.cstate == OC_COUNT )                    // Number of comments?
+      {
+        oggpg.ccount = oggpg.cval ;                           // Yes, remember
+        oggpg.cstate = oggpg.ccount ? OC_LEN : OC_DONE ;      // Lengths follow if any
+        oggpg.cleft = 4 ;
+        oggpg.cval = 0 ;
+        break ;
+      }
+      else                                                    // Length of a comment
+      {
+        oggpg.cstate = OC_TEXT ;
+        oggpg.cleft = oggpg.cval ;
+        oggpg.ctextx = 0 ;
+      }
+      oggpg.cval = 0 ;
+      if ( oggpg.cleft )                                      // Anything to read?
+      {
+        break ;
+      }
+      // Empty string: fall through to handle the end of it
+    case OC_VENDOR :
+    case OC_TEXT :
+      if ( oggpg.cleft )                                      // Still bytes left?
+      {
+        if ( ( oggpg.cstate == OC_TEXT ) &&
+             ( oggpg.ctextx < ( sizeof(oggpg.ctext) - 1 ) ) )
+        {
+          oggpg.ctext[oggpg.ctextx++] = b ;                   // Keep first part of comment
+        }
+        oggpg.cleft-- ;
+      }
+      if ( oggpg.cleft )                                      // End of field?
+      {
+        break ;                                               // No, wait for more
+      }
+      if ( oggpg.cstate == OC_VENDOR )                        // End of vendor string?
+      {
+        oggpg.cstate = OC_COUNT ;                             // Yes, number of comments follows
+        oggpg.cleft = 4 ;
+        break ;
+      }
+      oggpg.ctext[oggpg.ctextx] = '\0' ;                      // End of a comment
+      if ( strncasecmp ( oggpg.ctext, "TITLE=", 6 ) == 0 )
+      {
+        strcpy ( oggpg.title, oggpg.ctext + 6 ) ;
+      }
+      else if ( strncasecmp ( oggpg.ctext, "ARTIST=", 7 ) == 0 )
+      {
+        strcpy ( oggpg.artist, oggpg.ctext + 7 ) ;
+      }
+      oggpg.cstate = OC_DONE ;                                // Assume last comment
+      if ( --oggpg.ccount )                                   // More comments?
+      {
+        oggpg.cstate = OC_LEN ;                               // Yes, next length
+        oggpg.cleft = 4 ;
+      }
+      break ;
+    default :
+      break ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                   O G G P A C K E T E N D                                       *
+//**************************************************************************************************
+// End of a packet in the Ogg stream.  After the comment header the title is shown.               *
+//**************************************************************************************************
+void oggpacketend()
+{
+  char streamtitle[170] ;                                     // Artist and title
+
+  if ( ( oggpg.pktno == 1 ) &&                                // End of comment header?
+       ( oggpg.title[0] || oggpg.artist[0] ) )                // and title or artist found?
+  {
+    if ( oggpg.artist[0] && oggpg.title[0] )                  // Both present?
+    {
+      sprintf ( streamtitle, "%s - %s", oggpg.artist, oggpg.title ) ;
+    }
+    else
+    {
+      sprintf ( streamtitle, "%s%s", oggpg.artist, oggpg.title ) ;
+    }
+    showstreamtitle ( streamtitle, true ) ;                   // Show like ICY StreamTitle
+    mqttpub.trigger ( MQTT_STREAMTITLE ) ;                    // Request publishing to MQTT
+  }
+  if ( oggpg.pktno < 2 )                                      // Count header packets only
+  {
+    oggpg.pktno++ ;
+  }
+  oggpg.pktx = 0 ;                                            // Start of a new packet
+  oggpg.cstate = OC_MAGIC ;
+}
+
+
+//**************************************************************************************************
+//                                   O G G P A G E S T A R T                                       *
+//**************************************************************************************************
+// A complete page header including the segment table is in oggpg.hdr.  Update the statistics     *
+// with the granule position.                                                                      *
+//**************************************************************************************************
+void oggpagestart()
+{
+  uint8_t* h = oggpg.hdr ;                                    // Page header
+  int64_t  granule = 0 ;                                      // Granule position of this page
+  uint32_t body = 0 ;                                         // Length of page body
+  int      i ;                                                // Loop control
+
+  for ( i = 13 ; i >= 6 ; i-- )                               // Granule is 64 bits little endian
+  {
+    granule = ( granule << 8 ) | h[i] ;
+  }
+  for ( i = 0 ; i < h[26] ; i++ )                             // Sum of segment table
+  {
+    body += h[27 + i] ;
+  }
+  oggpg.pages++ ;
+  if ( h[5] & 0x02 )                                          // Begin of (chained) logical stream?
+  {
+    oggpg.pktno = 0 ;                                         // Yes, expect header packets
+    oggpg.pktx = 0 ;
+    oggpg.cstate = OC_MAGIC ;
+    oggpg.granule = -1 ;                                      // Time starts again
+    oggpg.title[0] = '\0' ;                                   // No title yet
+    oggpg.artist[0] = '\0' ;
+  }
+  frame_bound ( oggpg.pagepos ) ;                             // Remember start of this page
+  oggpg.bytes += oggpg.hdrx + body ;                          // Count bytes of this page
+  if ( ( granule != -1 ) && oggpg.samplerate )                // Page with a time stamp?
+  {
+    if ( ( oggpg.granule >= 0 ) && ( granule > oggpg.granule ) ) // Yes, previous one known?
+    {
+      frame_add ( oggpg.bytes,                                // Yes, count bytes and time
+                  ( granule - oggpg.granule ) * 1000000 / oggpg.samplerate ) ;
+    }
+    oggpg.granule = granule ;                                 // Remember for next page
+    oggpg.bytes = 0 ;
+    frstat.samplerate = oggpg.samplerate ;
+  }
+  oggpg.segx = 0 ;                                            // Start with first segment
+  oggpg.segrest = h[26] ? h[27] : 0 ;
+}
+
+
+//**************************************************************************************************
+//                                    O G G P A G E _ S C A N                                      *
+//**************************************************************************************************
+// Scan a run of Ogg data that was stored in mp3ring at pos.  Only page headers and the header     *
+// packets are examined, the audio packets are skipped segment by segment.                         *
+//**************************************************************************************************
+void oggpage_scan ( const uint8_t* p, uint32_t len, uint32_t pos )
+{
+  uint32_t n ;                                                // Number of bytes to skip
+  uint8_t* h = oggpg.hdr ;                                    // Page header
+  uint8_t  b ;                                                // Byte from input
+
+  if ( !oggpg.active )                                        // Scanning enabled?
+  {
+    return ;                                                  // No, quick return
+  }
+  while ( len )
+  {
+    if ( ( oggpg.hdrx < 27 ) ||                               // Collecting page header?
+         ( oggpg.hdrx < ( 27 + h[26] ) ) )                    // or segment table?
+    {
+      b = *p++ ;                                              // Yes, get next byte
+      len-- ;
+      if ( ( oggpg.hdrx < 4 ) && ( b != "OggS"[oggpg.hdrx] ) ) // Capture pattern mismatch?
+      {
+        if ( oggpg.hdrx )                                     // Yes, lost sync?
+        {
+          oggpg.lost++ ;
+        }
+        oggpg.hdrx = ( b == 'O' ) ? 1 : 0 ;                   // Restart search
+        h[0] = b ;
+        oggpg.pagepos = pos++ ;                               // Possible start of page
+        continue ;
+      }
+      if ( oggpg.hdrx == 0 )                                  // Start of page?
+      {
+        oggpg.pagepos = pos ;                                 // Yes, remember position
+      }
+      h[oggpg.hdrx++] = b ;                                   // Store in header
+      pos++ ;
+      if ( ( oggpg.hdrx >= 27 ) &&                            // Complete header?
+           ( oggpg.hdrx == ( 27 + h[26] ) ) )
+      {
+        oggpagestart() ;                                      // Yes, handle it
+        if ( h[26] == 0 )                                     // No segments?
+        {
+          oggpg.hdrx = 0 ;                                    // Yes, next page
+        }
+      }
+      continue ;
+    }
+    n = oggpg.segrest ;                                       // Bytes left in this segment
+    if ( n > len )
+    {
+      n = len ;
+    }
+    if ( oggpg.pktno < 2 )                                    // Header packet?
+    {
+      for ( uint32_t i = 0 ; i < n ; i++ )                    // Yes, examine byte by byte
+      {
+        oggcomment ( p[i] ) ;
+        oggpg.pktx++ ;
+      }
+    }
+    p += n ;                                                  // Skip audio
+    pos += n ;
+    len -= n ;
+    oggpg.segrest -= n ;
+    if ( oggpg.segrest )                                      // End of segment?
+    {
+      continue ;                                              // No, need more data
+    }
+    if ( h[27 + oggpg.segx] < 255 )                           // End of packet?
+    {
+      oggpacketend() ;                                        // Yes, handle it
+    }
+    if ( ++oggpg.segx < h[26] )                               // More segments in page?
+    {
+      oggpg.segrest = h[27 + oggpg.segx] ;                    // Yes, length of next segment
+    }
+    else
+    {
+      oggpg.hdrx = 0 ;                                        // No, next page
+    }
+  }
+}
+
+
+//**************************************************************************************************
+//                                    A U D I O S C A N _ R E S E T                                *
+//**************************************************************************************************
+// Reset the frame parsers for a new stream or file.  The parser depends on the type of audio.    *
+//**************************************************************************************************
+void audioscan_reset ( audio_t at )
+{
+  memset ( &frstat, 0, sizeof(frstat) ) ;                     // Clear all statistics
+  memset ( &mp3frm, 0, sizeof(mp3frm) ) ;
+  memset ( &oggpg, 0, sizeof(oggpg) ) ;
+  oggpg.granule = -1 ;                                        // No time stamp yet
+  mp3frm.active = ( at == AU_MP3 ) ;                          // Enable/disable the parsers
+  oggpg.active = ( at == AU_OGG ) ;
+}
+
+
+//**************************************************************************************************
+//                                          A U D I O S C A N                                      *
+//**************************************************************************************************
+// Scan a run of audio data that was just stored in mp3ring.  Only the producer writes to the      *
+// ring, so the data starts len bytes before the write position.                                   *
+//**************************************************************************************************
+void audioscan ( const uint8_t* p, uint32_t len )
+{
+  uint32_t pos = mp3ring.wrpos() - len ;                      // Ring position of p[0]
+
+  mp3frame_scan ( p, len, pos ) ;                             // Look for MP3 frames
+  oggpage_scan ( p, len, pos ) ;                              // Look for Ogg pages
+}
+
+
+//**************************************************************************************************
+//                                       F R A M E _ E D G E                                       *
+//**************************************************************************************************
+// Find the first frame boundary at or after the read position of the ring.  Returns the entry in  *
+// bound[] or -1 if there is no boundary in the ring.                                              *
+//**************************************************************************************************
+int frame_edge()
+{
+  uint32_t rd = mp3ring.rdpos() ;                             // Read position in ring
+  uint32_t fill = mp3ring.wrpos() - rd ;                      // Bytes in ring
+  uint32_t dist ;                                             // Distance to boundary
+  uint32_t best = 0xFFFFFFFF ;                                // Distance to best boundary
+  int      res = -1 ;                                         // Result, no boundary yet
+  int      i ;                                                // Index in bound[]
+
+  if ( frstat.bounds == 0 )                                   // Any boundaries seen?
+  {
+    return -1 ;                                               // No, no boundaries
+  }
+  for ( i = 0 ; i < FRBOUNDS ; i++ )
+  {
+    if ( ( frstat.bounds < FRBOUNDS ) && ( i >= frstat.boundx ) ) // Entry not used yet?
+    {
+      break ;                                                 // Yes, no more entries
+    }
+    dist = frstat.bound[i].pos - rd ;                         // Distance from read position
+    if ( ( dist <= fill ) && ( dist < best ) )                // In ring and nearer?
+    {
+      best = dist ;                                           // Yes, remember
+      res = i ;
+    }
+  }
+  return res ;
+}
+
+
+//**************************************************************************************************
+//                                      F R A M E _ E D G E S                                      *
+//**************************************************************************************************
+// Copy the frame boundaries between the read position of the ring and pos to edges, oldest first. *
+// Called by the producer when it queues a stop, the playtask uses the copy and never reads frstat *
+// while the parsers or audioscan_reset() may change it.  Returns the number of boundaries copied. *
+//**************************************************************************************************
+int frame_edges ( uint32_t* edges, int max, uint32_t pos )
+{
+  uint32_t rd = mp3ring.rdpos() ;                             // Read position in ring
+  int      n = 0 ;                                            // Number of boundaries copied
+  int      i ;                                                // Index in bound[]
+  int      x ;                                                // Entry in bound[]
+
+  i = 0 ;                                                     // Assume bound[] is full
+  if ( frstat.bounds < FRBOUNDS )                             // Only part of bound[] used?
+  {
+    i = FRBOUNDS - frstat.bounds ;                            // Yes, skip unused entries
+  }
+  for ( ; ( i < FRBOUNDS ) && ( n < max ) ; i++ )
+  {
+    x = ( frstat.boundx + i ) % FRBOUNDS ;                    // Oldest entry first
+    if ( ( frstat.bound[x].pos - rd ) <= ( pos - rd ) )       // Between read position and pos?
+    {
+      edges[n++] = frstat.bound[x].pos ;                      // Yes, copy
+    }
+  }
+  return n ;
+}
+
+
+//**************************************************************************************************
+//                                      S T R E A M K B P S                                        *
+//**************************************************************************************************
+// Give the best known bitrate of the current stream in kbps.  This is the average of the MPEG     *
+// frames or Ogg pages if available.  Otherwise the bitrate from the header or the measured one.   *
+//**************************************************************************************************
+uint32_t streamkbps()
+{
+  if ( ( frstat.frames > 10 ) && frstat.us )                  // Enough frames seen?
+  {
+    return frstat.bytes * 8000 / frstat.us ;                  // Yes, bits per msec is kbps
+  }
+  if ( bitrate )                                              // Bitrate from header known?
+  {
+    return bitrate ;
+  }
+  if ( mbitrate )                                             // Measured bitrate known?
+  {
+    return mbitrate ;
+  }
+  return 128 ;                                                // No, assume 128 kbps
+}
+
+
+//**************************************************************************************************
+//                                       B U F F E R E D M S                                       *
+//**************************************************************************************************
+// Compute the play time of the data in the ring buffer in msec.  Complete frames or pages are     *
+// counted exactly, the rest of the data is estimated with the bitrate.                            *
+//**************************************************************************************************
+uint32_t bufferedms()
+{
+  uint32_t rd = mp3ring.rdpos() ;                             // Read position in ring
+  uint32_t wr = mp3ring.wrpos() ;                             // Write position in ring
+  int      first = frame_edge() ;                             // First frame in ring
+  int      last ;                                             // Last frame in ring
+  uint32_t rest ;                                             // Bytes not in complete frames
+
+  if ( first < 0 )                                            // Frames in ring?
+  {
+    return ( wr - rd ) * 8 / streamkbps() ;                   // No, use bitrate
+  }
+  last = ( frstat.boundx + FRBOUNDS - 1 ) % FRBOUNDS ;        // Most recent frame
+  rest = ( frstat.bound[first].pos - rd ) +                   // Part of frame before first
+         ( wr - frstat.bound[last].pos ) ;                    // and the last (incomplete) frame
+  return ( frstat.bound[last].ms - frstat.bound[first].ms ) +
+         rest * 8 / streamkbps() ;
+}
+
+
+#include "sdifeed.h"                                     // Feed loop for the SDI port
+//
+//**************************************************************************************************
+// VS1053 stuff.  Based on maniacbug library.                                                      *
+//**************************************************************************************************
+// VS1053 class definition.                                                                        *
+//**************************************************************************************************
+class VS1053
+{
+    struct fastpin_struct                          // For direct access to a GPIO pin
+    {
+      volatile uint32_t* set ;                     // Register to set the pin HIGH
+      volatile uint32_t* clr ;                     // Register to set the pin LOW
+      volatile uint32_t* in ;                      // Register to read the pin
+      uint32_t           mask ;                    // Bit for this pin, 0 if not resolved
+    } ;
+  private:
+    int8_t        cs_pin ;                         // Pin where CS line is connected
+    int8_t        dcs_pin ;                        // Pin where DCS line is connected
+    int8_t        dreq_pin ;                       // Pin where DREQ line is connected
+    int8_t        shutdown_pin ;                   // Pin where the shutdown line is connected
+    int8_t        shutdownx_pin ;                  // Pin where the shutdown (inversed) line is connected
+    uint8_t       curvol ;                         // Current volume setting 0..100%
+    SPIClass*     spi ;                            // SPI bus of the VS1053
+    const uint8_t vs1053_chunk_size = 32 ;
+    // SCI Register
+    const uint8_t SCI_MODE          = 0x0 ;
+    const uint8_t SCI_STATUS        = 0x1 ;
+    const uint8_t SCI_BASS          = 0x2 ;
+    const uint8_t SCI_CLOCKF        = 0x3 ;
+    const uint8_t SCI_DECODE_TIME   = 0x4 ;
+    const uint8_t SCI_AUDATA        = 0x5 ;
+    const uint8_t SCI_WRAM          = 0x6 ;
+    const uint8_t SCI_WRAMADDR      = 0x7 ;
+    const uint8_t SCI_HDAT0         = 0x8 ;
+    const uint8_t SCI_HDAT1         = 0x9 ;
+    const uint8_t SCI_AIADDR        = 0xA ;
+    const uint8_t SCI_VOL           = 0xB ;
+    const uint8_t SCI_AICTRL0       = 0xC ;
+    const uint8_t SCI_AICTRL1       = 0xD ;
+    const uint8_t SCI_num_registers = 0xF ;
+    // SCI_MODE bits
+    const uint8_t SM_SDINEW         = 11 ;        // Bitnumber in SCI_MODE always on
+    const uint8_t SM_RESET          = 2 ;         // Bitnumber in SCI_MODE soft reset
+    const uint8_t SM_CANCEL         = 3 ;         // Bitnumber in SCI_MODE cancel song
+    const uint8_t SM_TESTS          = 5 ;         // Bitnumber in SCI_MODE for tests
+    const uint8_t SM_LINE1          = 14 ;        // Bitnumber in SCI_MODE for Line input
+    SPISettings   VS1053_SPI ;                    // SPI settings for this slave
+    fastpin_struct cs_fp   = { NULL, NULL, NULL, 0 } ;  // Direct access to CS pin
+    fastpin_struct dcs_fp  = { NULL, NULL, NULL, 0 } ;  // Direct access to DCS pin
+    fastpin_struct dreq_fp = { NULL, NULL, NULL, 0 } ;  // Direct access to DREQ pin
+    uint8_t       endFillByte ;                   // Byte to send when stopping song
+    bool          okay              = true ;      // VS1053 is working
+  protected:
+    void        fastpin ( fastpin_struct& fp, int8_t pin ) ; // Resolve pin to GPIO registers
+
+    inline void pinwrite ( const fastpin_struct& fp, int8_t pin, bool level ) const
+    {
+      if ( fp.mask )                              // Registers known?
+      {
+        *( level ? fp.set : fp.clr ) = fp.mask ;  // Yes, set or clear pin directly
+      }
+      else
+      {
+        digitalWrite ( pin, level ) ;             // No, use the normal way
+      }
+    }
+
+    inline void await_data_request() const
+    {
+      while ( ( dreq_pin >= 0 ) &&
+              ( !data_request() ) )
+      {
+        NOP() ;                                   // Very short delay
+      }
+    }
+
+    inline void control_mode_on() const
+    {
+      spi->beginTransaction ( VS1053_SPI ) ;      // Prevent other SPI users
+      pinwrite ( cs_fp, cs_pin, LOW ) ;
+    }
+
+    inline void control_mode_off() const
+    {
+      pinwrite ( cs_fp, cs_pin, HIGH ) ;          // End control mode
+      spi->endTransaction() ;                     // Allow other SPI users
+    }
+
+    inline void data_mode_on() const
+    {
+      spi->beginTransaction ( VS1053_SPI ) ;      // Prevent other SPI users
+      //digitalWrite ( cs_pin, HIGH ) ;           // Bring slave in data mode
+      pinwrite ( dcs_fp, dcs_pin, LOW ) ;
+    }
+
+    inline void data_mode_off() const
+    {
+      pinwrite ( dcs_fp, dcs_pin, HIGH ) ;        // End data mode
+      spi->endTransaction() ;                     // Allow other SPI users
+    }
+
+    uint16_t    read_register ( uint8_t _reg ) const ;
+    void        write_register ( uint8_t _reg, uint16_t _value ) const ;
+    inline bool sdi_send_buffer ( uint8_t* data, size_t len ) ;
+    void        sdi_send_fillers ( size_t length ) ;
+    void        wram_write ( uint16_t address, uint16_t data ) ;
+    uint16_t    wram_read ( uint16_t address ) ;
+    void        output_enable ( bool ena ) ;             // Enable amplifier through shutdown pin(s)
+
+  public:
+    // Constructor.  Only sets pin values.  Doesn't touch the chip.  Be sure to call begin()!
+    VS1053 ( int8_t _cs_pin, int8_t _dcs_pin, int8_t _dreq_pin,
+             int8_t _shutdown_pin, int8_t _shutdownx_pin,
+             SPIClass* _spi = &SPI ) ;
+    void     begin() ;                                   // Begin operation.  Sets pins correctly,
+    // and prepares SPI bus.
+    void     startSong() ;                               // Prepare to start playing. Call this each
+    // time a new song starts.
+    inline bool playChunk ( uint8_t* data,               // Play a chunk of data.  Copies the data to
+                            size_t len ) ;               // the chip.  Blocks until complete.
+    // Returns true if more data can be added
+    // to fifo
+    size_t   playBurst ( uint8_t* data, size_t len,      // Play 32 byte blocks as long as DREQ is
+                         uint32_t maxus ) ;              // high.  Returns number of bytes handled
+    bool     stopSong ( bool frameedge = false,          // Finish playing a song. Call this after
+                        bool fast = false ) ;            // the last playChunk call.  Less filling
+    // is needed after a cut at a frame edge.
+    // Fast uses the minimal cancel sequence.
+    // False if the decoder had to be reset.
+    void     setVolume ( uint8_t vol ) ;                 // Set the player volume.Level from 0-100,
+    // higher is louder.
+    void     setTone ( uint8_t* rtone ) ;                // Set the player baas/treble, 4 nibbles for
+    // treble gain/freq and bass gain/freq
+    inline uint8_t  getVolume() const                    // Get the current volume setting.
+    { // higher is louder.
+      return curvol ;
+    }
+    void     printDetails ( const char *header ) ;       // Print config details to serial output
+    void     softReset() ;                               // Do a soft reset
+    void     recover() ;                                 // Soft reset after a failed cancel
+    void     readDecoder ( uint16_t* hdat0,              // Read decoder status: format, bitrate
+                           uint16_t* hdat1,              // and decode time in seconds
+                           uint16_t* dtime ) ;
+    bool     testComm ( const char *header ) ;           // Test communication with module
+    inline bool data_request() const
+    {
+      if ( dreq_fp.mask )                                // Registers known?
+      {
+        return ( ( *dreq_fp.in & dreq_fp.mask ) != 0 ) ; // Yes, read pin directly
+      }
+      return ( digitalRead ( dreq_pin ) == HIGH ) ;
+    }
+    void     AdjustRate ( long ppm2 ) ;                  // Fine tune the datarate
+
+} ;
+
+//**************************************************************************************************
+// VS1053 class implementation.                                                                    *
+//**************************************************************************************************
+
+VS1053::VS1053 ( int8_t _cs_pin, int8_t _dcs_pin, int8_t _dreq_pin,
+                 int8_t _shutdown_pin, int8_t _shutdownx_pin, SPIClass* _spi ) :
+  cs_pin(_cs_pin), dcs_pin(_dcs_pin), dreq_pin(_dreq_pin), shutdown_pin(_shutdown_pin),
+  shutdownx_pin(_shutdownx_pin), spi(_spi)
+{
+}
+
+uint16_t VS1053::read_register ( uint8_t _reg ) const
+{
+  uint16_t result ;
+
+  control_mode_on() ;
+  spi->write ( 3 ) ;                               // Read operation
+  spi->write ( _reg ) ;                            // Register to write (0..0xF)
+  // Note: transfer16 does not seem to work
+  result = ( spi->transfer ( 0xFF ) << 8 ) |       // Read 16 bits data
+           ( spi->transfer ( 0xFF ) ) ;
+  await_data_request() ;                           // Wait for DREQ to be HIGH again
+  control_mode_off() ;
+  return result ;
+}
+
+void VS1053::write_register ( uint8_t _reg, uint16_t _value ) const
+{
+  control_mode_on( );
+  spi->write ( 2 ) ;                               // Write operation
+  spi->write ( _reg ) ;                            // Register to write (0..0xF)
+  spi->write16 ( _value ) ;                        // Send 16 bits data
+  await_data_request() ;
+  control_mode_off() ;
+}
+
+bool VS1053::sdi_send_buffer ( uint8_t* data, size_t len )
+{
+  size_t chunk_length ;                            // Length of chunk 32 byte or shorter
+
+  data_mode_on() ;
+  while ( len )                                    // More to do?
+  {
+    chunk_length = len ;
+    if ( len > vs1053_chunk_size )
+    {
+      chunk_length = vs1053_chunk_size ;
+    }
+    len -= chunk_length ;
+    await_data_request() ;                         // Wait for space available
+    spi->writeBytes ( data, chunk_length ) ;
+    data += chunk_length ;
+  }
+  data_mode_off() ;
+  return data_request() ;                          // True if more data can de stored in fifo
+}
+
+void VS1053::sdi_send_fillers ( size_t len )
+{
+  size_t chunk_length ;                            // Length of chunk 32 byte or shorter
+
+  data_mode_on() ;
+  while ( len )                                    // More to do?
+  {
+    await_data_request() ;                         // Wait for space available
+    chunk_length = len ;
+    if ( len > vs1053_chunk_size )
+    {
+      chunk_length = vs1053_chunk_size ;
+    }
+    len -= chunk_length ;
+    while ( chunk_length-- )
+    {
+      spi->write ( endFillByte ) ;
+    }
+  }
+  data_mode_off();
+}
+
+void VS1053::wram_write ( uint16_t address, uint16_t data )
+{
+  write_register ( SCI_WRAMADDR, address ) ;
+  write_register ( SCI_WRAM, data ) ;
+}
+
+uint16_t VS1053::wram_read ( uint16_t address )
+{
+  write_register ( SCI_WRAMADDR, address ) ;            // Start reading from WRAM
+  return read_register ( SCI_WRAM ) ;                   // Read back result
+}
+
+void VS1053::fastpin ( fastpin_struct& fp, int8_t pin )
+{
+  // Resolve the GPIO registers for a pin once, so that the pin can be handled without the
+  // overhead of digitalWrite() and digitalRead().  Pins that cannot be resolved will use
+  // the normal Arduino functions.
+  if ( ( pin >= 0 ) && ( pin < 32 ) )                   // GPIO0..31?
+  {
+    fp.set  = &GPIO.out_w1ts ;
+    fp.clr  = &GPIO.out_w1tc ;
+    fp.in   = &GPIO.in ;
+    fp.mask = 1UL << pin ;
+  }
+  else if ( ( pin >= 32 ) && ( pin < 40 ) )             // GPIO32..39?
+  {
+    fp.set  = &GPIO.out1_w1ts.val ;
+    fp.clr  = &GPIO.out1_w1tc.val ;
+    fp.in   = &GPIO.in1.val ;
+    fp.mask = 1UL << ( pin - 32 ) ;
+  }
+  else
+  {
+    fp.mask = 0 ;                                       // Not resolved, use digitalWrite()
+  }
+}
+
+bool VS1053::testComm ( const char *header )
+{
+  // Test the communication with the VS1053 module.  The result wille be returned.
+  // If DREQ is low, there is problably no VS1053 connected.  Pull the line HIGH
+  // in order to prevent an endless loop waiting for this signal.  The rest of the
+  // software will still work, but readbacks from VS1053 will fail.
+  int            i ;                                    // Loop control
+  uint16_t       r1, r2, cnt = 0 ;
+  uint16_t       delta = 300 ;                          // 3 for fast SPI
+  const uint16_t vstype[] = { 1001, 1011, 1002, 1003,   // Possible chip versions
+                              1053, 1033, 0000, 1103 } ;
+  
+  dbgprint ( header ) ;                                 // Show a header
+  if ( !digitalRead ( dreq_pin ) )
+  {
+    dbgprint ( "VS1053 not properly installed!" ) ;
+    // Allow testing without the VS1053 module
+    pinMode ( dreq_pin,  INPUT_PULLUP ) ;               // DREQ is now input with pull-up
+    return false ;                                      // Return bad result
+  }
+  // Further TESTING.  Check if SCI bus can write and read without errors.
+  // We will use the volume setting for this.
+  // Will give warnings on serial output if DEBUG is active.
+  // A maximum of 20 errors will be reported.
+  if ( strstr ( header, "Fast" ) )
+  {
+    delta = 3 ;                                         // Fast SPI, more loops
+  }
+  for ( i = 0 ; ( i < 0xFFFF ) && ( cnt < 20 ) ; i += delta )
+  {
+    write_register ( SCI_VOL, i ) ;                     // Write data to SCI_VOL
+    r1 = read_register ( SCI_VOL ) ;                    // Read back for the first time
+    r2 = read_register ( SCI_VOL ) ;                    // Read back a second time
+    if  ( r1 != r2 || i != r1 || i != r2 )              // Check for 2 equal reads
+    {
+      dbgprint ( "VS1053 SPI error. SB:%04X R1:%04X R2:%04X", i, r1, r2 ) ;
+      cnt++ ;
+      delay ( 10 ) ;
+    }
+  }
   okay = ( cnt == 0 ) ;                                 // True if working correctly
   // Further testing: is it the right chip?
   r1 = ( read_register ( SCI_STATUS ) >> 4 ) & 0x7 ;    // Read status to get the version
@@ -927,6 +4624,9 @@ void VS1053::begin()
   pinMode      ( dcs_pin,   OUTPUT ) ;
   digitalWrite ( dcs_pin,   HIGH ) ;                    // Start HIGH for SCI en SDI
   digitalWrite ( cs_pin,    HIGH ) ;
+  fastpin ( cs_fp,   cs_pin ) ;                         // Resolve registers for fast access
+  fastpin ( dcs_fp,  dcs_pin ) ;
+  fastpin ( dreq_fp, dreq_pin ) ;
   if ( shutdown_pin >= 0 )                              // Shutdown in use?
   {
     pinMode ( shutdown_pin,   OUTPUT ) ;
@@ -939,8 +4639,8 @@ void VS1053::begin()
   delay ( 100 ) ;
   // Init SPI in slow mode ( 0.2 MHz )
   VS1053_SPI = SPISettings ( 200000, MSBFIRST, SPI_MODE0 ) ;
-  SPI.setDataMode ( SPI_MODE0 ) ;
-  SPI.setBitOrder ( MSBFIRST ) ;
+  spi->setDataMode ( SPI_MODE0 ) ;
+  spi->setBitOrder ( MSBFIRST ) ;
   //printDetails ( "Right after reset/startup" ) ;
   delay ( 20 ) ;
   //printDetails ( "20 msec after reset" ) ;
@@ -1023,12 +4723,54 @@ bool VS1053::playChunk ( uint8_t* data, size_t len )
   return okay && sdi_send_buffer ( data, len ) ;        // True if more data can be added to fifo
 }
 
-void VS1053::stopSong()
+size_t VS1053::playBurst ( uint8_t* data, size_t len, uint32_t maxus )
+{
+  size_t   sent ;                                       // Number of bytes sent
+
+  if ( !okay )                                          // Chip not working?
+  {
+    return len ;                                        // Yes, just discard the data
+  }
+  data_mode_on() ;                                      // One transaction for the whole burst
+  sent = sdi_burst ( [this] () { return data_request() ; },  // DREQ of this chip
+                     [this] ( const uint8_t* p, size_t n )   // Write a block to SDI
+                     {
+                       spi->writeBytes ( p, n ) ;
+                     },
+                     micros, data, len, vs1053_chunk_size, maxus ) ;
+  data_mode_off() ;
+  return sent ;
+}
+
+bool VS1053::stopSong ( bool frameedge, bool fast )
 {
   uint16_t modereg ;                                    // Read from mode register
   int      i ;                                          // Loop control
+  uint32_t t0 = micros() ;                              // Start of stop
 
-  sdi_send_fillers ( 2052 ) ;
+  if ( fast )
+  {
+    // Minimal cancel sequence of the datasheet: set SM_CANCEL right away and check it after every
+    // 32 fillers, at most 2048 bytes.  Then 2052 fillers to flush the decoder.  No fixed delays.
+    output_enable ( false ) ;                           // Disable amplifier through shutdown pin(s)
+    write_register ( SCI_MODE, _BV ( SM_SDINEW ) | _BV ( SM_CANCEL ) ) ;
+    for ( i = 1 ; i <= 64 ; i++ )
+    {
+      sdi_send_fillers ( 32 ) ;                         // Waits for DREQ
+      modereg = read_register ( SCI_MODE ) ;            // Read mode status
+      if ( ( modereg & _BV ( SM_CANCEL ) ) == 0 )       // SM_CANCEL will be cleared when finished
+      {
+        sdi_send_fillers ( 2052 ) ;
+        dbgprint ( "Song cancelled after %d fillers in %d usec", i * 32, micros() - t0 ) ;
+        return true ;
+      }
+    }
+    printDetails ( "Song cancelled incorrectly!" ) ;
+    recover() ;                                         // Decoder is stuck, reset it
+    return false ;
+  }
+  // If the data ended at a frame boundary, there is no partial frame to flush out of the decoder
+  sdi_send_fillers ( frameedge ? 32 : 2052 ) ;
   output_enable ( false ) ;                             // Disable amplifier through shutdown pin(s)
   delay ( 10 ) ;
   write_register ( SCI_MODE, _BV ( SM_SDINEW ) | _BV ( SM_CANCEL ) ) ;
@@ -1040,11 +4782,13 @@ void VS1053::stopSong()
     {
       sdi_send_fillers ( 2052 ) ;
       dbgprint ( "Song stopped correctly after %d msec", i * 10 ) ;
-      return ;
+      return true ;
     }
     delay ( 10 ) ;
   }
   printDetails ( "Song stopped incorrectly!" ) ;
+  recover() ;                                           // Decoder is stuck, reset it
+  return false ;
 }
 
 void VS1053::softReset()
@@ -1054,6 +4798,34 @@ void VS1053::softReset()
   await_data_request() ;
 }
 
+// SM_CANCEL did not clear, so the decoder did not stop.  A soft reset clears the decoder, but also
+// the clock multiplier, the volume and the tone.  The clock is set again like in begin(), with
+// slow SPI until it is set.  The volume is set to silent, the caller has to set the tone again.
+void VS1053::recover()
+{
+  SPISettings fast = VS1053_SPI ;                       // Fast settings for later
+
+  VS1053_SPI = SPISettings ( 200000, MSBFIRST, SPI_MODE0 ) ;
+  wram_write ( 0xC017, 3 ) ;                            // GPIO DDR = 3, no midi mode after reset
+  wram_write ( 0xC019, 0 ) ;                            // GPIO ODATA = 0
+  softReset() ;
+  write_register ( SCI_AUDATA, 44100 + 1 ) ;            // 44.1kHz + stereo
+  write_register ( SCI_CLOCKF, 6 << 12 ) ;              // Normal clock settings
+  VS1053_SPI = fast ;                                   // Fast SPI again
+  write_register ( SCI_MODE, _BV ( SM_SDINEW ) | _BV ( SM_LINE1 ) ) ;
+  write_register ( SCI_VOL, 0xF8F8 ) ;                  // Silent, like setVolume ( 0 )
+  curvol = 0 ;
+  await_data_request() ;
+  dbgprint ( "VS1053 reset after failed cancel" ) ;
+}
+
+void VS1053::readDecoder ( uint16_t* hdat0, uint16_t* hdat1, uint16_t* dtime )
+{
+  *hdat0 = read_register ( SCI_HDAT0 ) ;                // Bitrate info
+  *hdat1 = read_register ( SCI_HDAT1 ) ;                // Format info
+  *dtime = read_register ( SCI_DECODE_TIME ) ;          // Decode time in seconds
+}
+
 void VS1053::printDetails ( const char *header )
 {
   uint16_t     regbuf[16] ;
@@ -1066,41 +4838,235 @@ void VS1053::printDetails ( const char *header )
   {
     regbuf[i] = read_register ( i ) ;
   }
-  for ( i = 0 ; i <= SCI_num_registers ; i++ )
+  for ( i = 0 ; i <= SCI_num_registers ; i++ )
+  {
+    delay ( 5 ) ;
+    dbgprint ( "%3X - %5X", i, regbuf[i] ) ;
+  }
+}
+
+void  VS1053::output_enable ( bool ena )               // Enable amplifier through shutdown pin(s)
+{
+  if ( shutdown_pin >= 0 )                             // Shutdown in use?
+  {
+    digitalWrite ( shutdown_pin, !ena ) ;              // Shut down or enable audio output
+  }
+  if ( shutdownx_pin >= 0 )                            // Shutdown (inversed logic) in use?
+  {
+    digitalWrite ( shutdownx_pin, ena ) ;              // Shut down or enable audio output
+  }
+}
+
+
+void VS1053::AdjustRate ( long ppm2 )                  // Fine tune the data rate
+{
+  write_register ( SCI_WRAMADDR, 0x1e07 ) ;
+  write_register ( SCI_WRAM,     ppm2 ) ;
+  write_register ( SCI_WRAM,     ppm2 >> 16 ) ;
+  // oldClock4KHz = 0 forces  adjustment calculation when rate checked.
+  write_register ( SCI_WRAMADDR, 0x5b1c ) ;
+  write_register ( SCI_WRAM,     0 ) ;
+  // Write to AUDATA or CLOCKF checks rate and recalculates adjustment.
+  write_register ( SCI_AUDATA,   read_register ( SCI_AUDATA ) ) ;
+}
+
+
+// The object for the MP3 player
+VS1053* vs1053player ;
+
+
+//**************************************************************************************************
+//                                      D E C T E L C : : P O L L                                  *
+//**************************************************************************************************
+// Poll the decoder registers.  Called from spftask with the SPI bus claimed.                      *
+//**************************************************************************************************
+void dectelc::poll()
+{
+  uint32_t now = millis() ;                                   // Current time
+  uint16_t olddtime = dtime ;                                 // Decode time of last poll
+
+  if ( ( now - tpoll ) < DTPOLL )                             // Time to poll?
+  {
+    return ;                                                  // No
+  }
+  tpoll = now ;
+  vs1053player->readDecoder ( &hdat0, &hdat1, &dtime ) ;      // Read registers
+  if ( localfile || !( datamode & ( DATA | METADATA ) ) ||    // Playing a stream?
+       ( dtime != olddtime ) )                                // and no decode progress?
+  {
+    tprogress = now ;                                         // No, nothing to flag
+    oldtotal = totalcount ;
+    return ;
+  }
+  if ( !dead && ( ( now - tprogress ) > DTSTALL ) &&          // No progress for some time
+       ( ( totalcount - oldtotal ) > DTMINBYTES ) )           // while data was sent?
+  {
+    dbgprint ( "Stream does not decode, %d bytes sent, format %s",
+               totalcount - oldtotal, format() ) ;
+    dead = true ;                                             // Yes, flag to recovery
+    deadcount++ ;
+  }
+}
+
+
+//**************************************************************************************************
+// Rate control.                                                                                   *
+//**************************************************************************************************
+// The crystal of the VS1053 drifts against the clock of the broadcaster, so on a long running     *
+// stream the buffered data slowly drains or fills up.  The buffered data (ring buffer plus the    *
+// data waiting in the socket) is sampled every RTSAMPLE msec and averaged over a period of        *
+// RTPERIOD samples.  A long-term average of these is compared with the prebuffer level.  If it is *
+// above this target and not going down, the playback is made RTSTEP ppm faster.  If it is below   *
+// and not going up, it is made slower.  The correction is limited to RTMAXPPM and starts from 0   *
+// for every new stream.  Switched off by "ratectl=0".                                             *
+//**************************************************************************************************
+#define RTSAMPLE   100                                        // Time between samples in msec
+#define RTPERIOD   100                                        // Samples in a period (10 seconds)
+#define RTSETTLE   6                                          // Periods to skip at start of stream
+#define RTSMOOTH   6                                          // Weight for long-term average
+#define RTDEADBAND ( RINGSIZ / 16 )                           // No correction within this distance
+#define RTSTEP     2                                          // Correction step in ppm
+#define RTMAXPPM   300                                        // Max. correction in ppm
+
+class ratectlc
+{
+  private:
+    uint32_t          tsample = 0 ;                           // Time of last sample
+    uint32_t          sum = 0 ;                               // Sum of samples in this period
+    uint16_t          nsum = 0 ;                              // Number of samples in this period
+    uint16_t          periods = 0 ;                           // Periods since start of stream
+    int32_t           lf ;                                    // Long-term average of buffered data
+    bool              dirty = false ;                         // ppm to be sent to VS1053
+    long              manppm2 ;                               // Manual rate in 1/2 ppm units
+    volatile bool     manreq = false ;                        // Manual rate to be sent
+    void              apply() ;                               // Send ppm to VS1053
+  public:
+    int16_t           ppm = 0 ;                               // Current correction, + is faster
+    uint32_t          steps = 0 ;                             // Number of corrections
+    void              reset() ;                               // New stream started
+    void              manual ( long ppm2 ) ;                  // Set a manual rate
+    void              loop ( uint32_t level ) ;               // Sample the buffered data
+} ;
+
+
+//**************************************************************************************************
+//                                     R A T E C T L C : : A P P L Y                               *
+//**************************************************************************************************
+// Send the correction to the VS1053.  AdjustRate() takes the value in 1/2 ppm units.              *
+//**************************************************************************************************
+void ratectlc::apply()
+{
+  dirty = false ;
+  claimSPI ( "rate" ) ;                                       // Claim SPI bus
+  vs1053player->AdjustRate ( ppm * 2 ) ;                      // Set new rate
+  releaseSPI() ;                                              // Release SPI bus
+}
+
+
+//**************************************************************************************************
+//                                     R A T E C T L C : : R E S E T                               *
+//**************************************************************************************************
+// A new stream is started.  The correction starts from 0 after the settle time.                   *
+//**************************************************************************************************
+void ratectlc::reset()
+{
+  sum = 0 ;
+  nsum = 0 ;
+  periods = 0 ;
+  if ( ppm )                                                  // Correction active?
+  {
+    ppm = 0 ;                                                 // Yes, clear it
+    dirty = true ;                                            // on next sample
+  }
+}
+
+
+//**************************************************************************************************
+//                                    R A T E C T L C : : M A N U A L                              *
+//**************************************************************************************************
+// Set a manual rate in 1/2 ppm units.  Called by the "rate" command, that also switches off the   *
+// rate control.  The rate is sent to the VS1053 by loop(), with the SPI bus claimed.              *
+//**************************************************************************************************
+void ratectlc::manual ( long ppm2 )
+{
+  manppm2 = ppm2 ;                                            // Value first
+  manreq = true ;                                             // Then the request
+}
+
+
+//**************************************************************************************************
+//                                      R A T E C T L C : : L O O P                                *
+//**************************************************************************************************
+// Sample the buffered data.  Called from mp3loop() with the number of buffered bytes.             *
+//**************************************************************************************************
+void ratectlc::loop ( uint32_t level )
+{
+  uint32_t now = millis() ;                                   // Current time
+  int32_t  prev ;                                             // Previous long-term average
+  int32_t  err ;                                              // Distance to target
+  int16_t  step = 0 ;                                         // Correction in this period
+
+  if ( manreq )                                               // Manual rate requested?
+  {
+    manreq = false ;                                          // Yes, replaces the correction
+    ppm = 0 ;
+    dirty = false ;
+    claimSPI ( "rate" ) ;                                     // Claim SPI bus
+    vs1053player->AdjustRate ( manppm2 ) ;                    // Set new rate
+    releaseSPI() ;                                            // Release SPI bus
+  }
+  if ( !ini_block.ratectl )                                   // Rate control switched off?
+  {
+    reset() ;                                                 // Yes, back to normal rate
+  }
+  if ( dirty )                                                // Change to send?
+  {
+    apply() ;                                                 // Yes, do it now
+  }
+  if ( !ini_block.ratectl || localfile ||                     // Rate control on a stream?
+       !( datamode & ( DATA | METADATA ) ) ||
+       ( ( now - tsample ) < RTSAMPLE ) )                     // and time for a sample?
+  {
+    return ;                                                  // No
+  }
+  tsample = now ;
+  sum += level ;                                              // Add sample to this period
+  if ( ++nsum < RTPERIOD )                                    // End of period?
+  {
+    return ;                                                  // No
+  }
+  level = sum / nsum ;                                        // Average of this period
+  sum = 0 ;
+  nsum = 0 ;
+  if ( ++periods <= RTSETTLE )                                // Still settling?
+  {
+    lf = level ;                                              // Yes, start average here
+    return ;
+  }
+  prev = lf ;
+  lf += ( (int32_t)level - lf ) / RTSMOOTH ;                  // Update long-term average
+  err = lf - bufms2bytes ( ini_block.prebuf_ms ) ;            // Distance to target
+  if ( ( err > RTDEADBAND ) && ( lf >= prev ) )               // Filling up?
   {
-    delay ( 5 ) ;
-    dbgprint ( "%3X - %5X", i, regbuf[i] ) ;
+    step = RTSTEP ;                                           // Yes, play faster
   }
-}
-
-void  VS1053::output_enable ( bool ena )               // Enable amplifier through shutdown pin(s)
-{
-  if ( shutdown_pin >= 0 )                             // Shutdown in use?
+  else if ( ( err < -RTDEADBAND ) && ( lf <= prev ) )         // Draining?
   {
-    digitalWrite ( shutdown_pin, !ena ) ;              // Shut down or enable audio output
+    step = -RTSTEP ;                                          // Yes, play slower
   }
-  if ( shutdownx_pin >= 0 )                            // Shutdown (inversed logic) in use?
+  if ( ( step == 0 ) ||                                       // Correction needed?
+       ( abs ( ppm + step ) > RTMAXPPM ) )                    // and within limits?
   {
-    digitalWrite ( shutdownx_pin, ena ) ;              // Shut down or enable audio output
+    return ;                                                  // No
   }
+  ppm += step ;                                               // Yes, set new rate
+  steps++ ;
+  dbgprint ( "Rate control: buffered %d, target distance %d, trend %d, rate %d ppm",
+             lf, err, lf - prev, ppm ) ;
+  apply() ;
 }
 
-
-void VS1053::AdjustRate ( long ppm2 )                  // Fine tune the data rate
-{
-  write_register ( SCI_WRAMADDR, 0x1e07 ) ;
-  write_register ( SCI_WRAM,     ppm2 ) ;
-  write_register ( SCI_WRAM,     ppm2 >> 16 ) ;
-  // oldClock4KHz = 0 forces  adjustment calculation when rate checked.
-  write_register ( SCI_WRAMADDR, 0x5b1c ) ;
-  write_register ( SCI_WRAM,     0 ) ;
-  // Write to AUDATA or CLOCKF checks rate and recalculates adjustment.
-  write_register ( SCI_AUDATA,   read_register ( SCI_AUDATA ) ) ;
-}
-
-
-// The object for the MP3 player
-VS1053* vs1053player ;
+ratectlc         ratectl ;                                    // Rate control for clock drift
 
 //**************************************************************************************************
 // End VS1053 stuff.                                                                               *
@@ -1175,147 +5141,554 @@ void nvsopen()
 
 
 //**************************************************************************************************
-//                                      N V S C L E A R                                            *
+//                                      N V S C L E A R                                            *
+//**************************************************************************************************
+// Clear all preferences.                                                                          *
+//**************************************************************************************************
+esp_err_t nvsclear()
+{
+  nvsopen() ;                                         // Be sure to open nvs
+  return nvs_erase_all ( nvshandle ) ;                // Clear all keys
+}
+
+
+//**************************************************************************************************
+//                                      N V S G E T S T R                                          *
+//**************************************************************************************************
+// Read a string from nvs.                                                                         *
+//**************************************************************************************************
+String nvsgetstr ( const char* key )
+{
+  static char   nvs_buf[NVSBUFSIZE] ;       // Buffer for contents
+  size_t        len = NVSBUFSIZE ;          // Max length of the string, later real length
+
+  nvsopen() ;                               // Be sure to open nvs
+  nvs_buf[0] = '\0' ;                       // Return empty string on error
+  nvserr = nvs_get_str ( nvshandle, key, nvs_buf, &len ) ;
+  if ( nvserr )
+  {
+    dbgprint ( "nvs_get_str failed %X for key %s, keylen is %d, len is %d!",
+               nvserr, key, strlen ( key), len ) ;
+    dbgprint ( "Contents: %s", nvs_buf ) ;
+  }
+  return String ( nvs_buf ) ;
+}
+
+
+//**************************************************************************************************
+//                                      N V S S E T S T R                                          *
+//**************************************************************************************************
+// Put a key/value pair in nvs.  Length is limited to allow easy read-back.                        *
+// No writing if no change.                                                                        *
+//**************************************************************************************************
+esp_err_t nvssetstr ( const char* key, String val )
+{
+  String curcont ;                                         // Current contents
+  bool   wflag = true  ;                                   // Assume update or new key
+
+  //dbgprint ( "Setstring for %s: %s", key, val.c_str() ) ;
+  if ( val.length() >= NVSBUFSIZE )                        // Limit length of string to store
+  {
+    dbgprint ( "nvssetstr length failed!" ) ;
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE ;
+  }
+  if ( nvssearch ( key ) )                                 // Already in nvs?
+  {
+    curcont = nvsgetstr ( key ) ;                          // Read current value
+    wflag = ( curcont != val ) ;                           // Value change?
+  }
+  if ( wflag )                                             // Update or new?
+  {
+    //dbgprint ( "nvssetstr update value" ) ;
+    nvserr = nvs_set_str ( nvshandle, key, val.c_str() ) ; // Store key and value
+    if ( nvserr )                                          // Check error
+    {
+      dbgprint ( "nvssetstr failed!" ) ;
+    }
+  }
+  return nvserr ;
+}
+
+
+//**************************************************************************************************
+//                                      N V S C H K E Y                                            *
+//**************************************************************************************************
+// Change a keyname in in nvs.                                                                     *
+//**************************************************************************************************
+void nvschkey ( const char* oldk, const char* newk )
+{
+  String curcont ;                                         // Current contents
+
+  if ( nvssearch ( oldk ) )                                // Old key in nvs?
+  {
+    curcont = nvsgetstr ( oldk ) ;                         // Read current value
+    nvs_erase_key ( nvshandle, oldk ) ;                    // Remove key
+    nvssetstr ( newk, curcont ) ;                          // Insert new
+  }
+}
+
+
+//**************************************************************************************************
+//                                      C L A I M S P I                                            *
+//**************************************************************************************************
+// Claim the SPI bus.  Uses the SPI bus arbiter, the ID tells the client.  Waits until the bus is  *
+// free, it is never used without the claim.                                                       *
+//**************************************************************************************************
+void claimSPI ( const char* p )
+{
+  spiarb.claim ( p ) ;                                       // Claim SPI bus
+}
+
+
+//**************************************************************************************************
+//                                   R E L E A S E S P I                                           *
+//**************************************************************************************************
+// Free the the SPI bus.  Uses the SPI bus arbiter.                                                *
+//**************************************************************************************************
+void releaseSPI()
+{
+  spiarb.release() ;                                     // Release SPI bus
+}
+
+
+//**************************************************************************************************
+//                                      C T L L O C K                                              *
+//**************************************************************************************************
+// Lock the player state (host, hostreq, datamode and the stream) against the ingest task.  Taken  *
+// by mp3loop() and by the control functions in loop().  May be nested by the same task.          *
+//**************************************************************************************************
+void ctllock()
+{
+  if ( ctlsem )                                              // Ingest task in use?
+  {
+    xSemaphoreTakeRecursive ( ctlsem, portMAX_DELAY ) ;      // Yes, take the lock
+  }
+}
+
+
+//**************************************************************************************************
+//                                      C T L U N L O C K                                          *
+//**************************************************************************************************
+// Release the lock on the player state.                                                           *
+//**************************************************************************************************
+void ctlunlock()
+{
+  if ( ctlsem )                                              // Ingest task in use?
+  {
+    xSemaphoreGiveRecursive ( ctlsem ) ;                     // Yes, release the lock
+  }
+}
+
+
+//**************************************************************************************************
+//                                        C T L S T O P                                            *
+//**************************************************************************************************
+// Request to stop playing if not yet stopped.  Only the change of datamode is done with the lock, *
+// so a caller that sends a page or a file afterwards does not block the ingest task.              *
+//**************************************************************************************************
+void ctlstop()
+{
+  ctllock() ;
+  if ( datamode != STOPPED )                                 // Still playing?
+  {
+    setdatamode ( STOPREQD ) ;                               // Yes, request STOP
+  }
+  ctlunlock() ;
+}
+
+
+//**************************************************************************************************
+// Command mailbox.                                                                                *
+//**************************************************************************************************
+// All inputs (serial, NEXTION, MQTT, HTTP, GPIO, touch pins, IR and the rotary encoder) post      *
+// their commands here.  The commands are executed by run() in loop(), so all player state is set  *
+// by a single task under the control lock.  The mailbox is a bounded multi-producer queue without *
+// locks: a producer claims a slot by advancing head with compare-and-swap and publishes it with   *
+// the sequence number of the slot.  Successive relative commands of the same kind are merged, so  *
+// IR repeats and MQTT bursts that arrive in one pass of loop() give one "upvolume=12".  The       *
+// encoder sums a spin in rotationcount itself.  An absolute setting replaces the queued commands  *
+// of the same kind.  HTTP needs the reply and uses exec().                                        *
+//**************************************************************************************************
+#define CQSIZE     16                                         // Slots in mailbox, power of 2
+#define CQCMDLEN   130                                        // Max. length of a command
+#define CQREPLEN   180                                        // Max. length of a reply
+
+enum cqsrc_t { CQ_SERIAL, CQ_NEXTION, CQ_MQTT, CQ_HTTP,       // Sources of commands
+               CQ_GPIO, CQ_TOUCH, CQ_IR, CQ_ENCODER, CQ_NUMSRC } ;
+
+const char* const cqnames[] =                                 // Names for debug output
+{
+  "Serial", "NEXTION", "MQTT", "HTTP", "GPIO", "Touch", "IR", "Encoder"
+} ;
+
+const char* const cqkinds[] =                                 // Commands that can be merged
+{
+  "", "volume", "preset"
+} ;
+
+class cmdqc
+{
+  private:
+    struct cqslot
+    {
+      std::atomic<uint32_t> seq ;                             // Slot sequence number
+      uint8_t           src ;                                 // Source of command
+      char              cmd[CQCMDLEN] ;                       // The command
+      char*             reply ;                               // Buffer for reply, NULL if none
+      std::atomic<bool>* done ;                               // Set if reply is available
+    } ;
+    cqslot            slot[CQSIZE] ;                          // The mailbox
+    std::atomic<uint32_t> head ;                              // Next slot to post, producers
+    uint32_t          tail = 0 ;                              // Next slot to run, executor only
+    bool              put ( uint8_t src, const char* cmd,     // Post a command if room
+                            char* reply, std::atomic<bool>* done ) ;
+    cqslot*           front() ;                               // Oldest command, NULL if empty
+    void              pop() ;                                 // Free the oldest slot
+    int               kind ( const char* cmd, int* val,       // Kind of command for merging
+                             bool* rel ) ;
+    bool              merge ( char* cur, const char* next ) ; // Merge next command into cur
+  public:
+    uint32_t          posted[CQ_NUMSRC] ;                     // Commands posted per source
+    uint32_t          merged = 0 ;                            // Commands merged into another
+    uint32_t          dropped = 0 ;                           // Commands lost, mailbox full
+    cmdqc() ;
+    bool              post ( uint8_t src, const char* cmd ) ; // Post a command, no reply
+    const char*       exec ( uint8_t src, const char* cmd,    // Post a command, wait for reply
+                             char* reply ) ;
+    void              run() ;                                 // Execute all posted commands
+} ;
+
+
+//**************************************************************************************************
+//                                        C M D Q C : : C M D Q C                                  *
+//**************************************************************************************************
+// Constructor.  Slot i is free for the producer that claims position i.                           *
+//**************************************************************************************************
+cmdqc::cmdqc() : head ( 0 )
+{
+  for ( int i = 0 ; i < CQSIZE ; i++ )
+  {
+    slot[i].seq.store ( i, std::memory_order_relaxed ) ;
+  }
+  memset ( posted, 0, sizeof(posted) ) ;
+}
+
+
+//**************************************************************************************************
+//                                          C M D Q C : : P U T                                    *
+//**************************************************************************************************
+// Claim the slot at head and fill it.  Safe for more producers on both cores.  Returns false if   *
+// the mailbox is full.                                                                            *
+//**************************************************************************************************
+bool cmdqc::put ( uint8_t src, const char* cmd, char* reply, std::atomic<bool>* done )
+{
+  uint32_t pos = head.load ( std::memory_order_relaxed ) ;    // Position to claim
+  cqslot*  s ;                                                // Slot at this position
+  int32_t  dif ;                                              // Sequence of slot minus position
+
+  while ( true )
+  {
+    s = &slot[pos & ( CQSIZE - 1 )] ;
+    dif = (int32_t)( s->seq.load ( std::memory_order_acquire ) - pos ) ;
+    if ( dif == 0 )                                           // Slot free for this position?
+    {
+      if ( head.compare_exchange_weak ( pos, pos + 1,         // Yes, try to claim it
+                                        std::memory_order_relaxed ) )
+      {
+        break ;                                               // Slot is ours
+      }                                                       // Otherwise pos is reloaded
+    }
+    else if ( dif < 0 )                                       // Slot still in use?
+    {
+      return false ;                                          // Yes, mailbox full
+    }
+    else
+    {
+      pos = head.load ( std::memory_order_relaxed ) ;         // Claimed by other producer
+    }
+  }
+  s->src = src ;
+  strncpy ( s->cmd, cmd, CQCMDLEN - 1 ) ;                     // Copy the command
+  s->cmd[CQCMDLEN - 1] = '\0' ;
+  s->reply = reply ;
+  s->done = done ;
+  s->seq.store ( pos + 1, std::memory_order_release ) ;       // Publish to executor
+  return true ;
+}
+
+
+//**************************************************************************************************
+//                                        C M D Q C : : F R O N T                                  *
+//**************************************************************************************************
+// Get the oldest posted command.  Executor only.                                                  *
+//**************************************************************************************************
+cmdqc::cqslot* cmdqc::front()
+{
+  cqslot* s = &slot[tail & ( CQSIZE - 1 )] ;                  // Oldest slot
+
+  if ( s->seq.load ( std::memory_order_acquire ) != ( tail + 1 ) ) // Published?
+  {
+    return NULL ;                                             // No, mailbox empty
+  }
+  return s ;
+}
+
+
+//**************************************************************************************************
+//                                          C M D Q C : : P O P                                    *
+//**************************************************************************************************
+// Free the oldest slot for the producer that claims it in the next round.  Executor only.         *
+//**************************************************************************************************
+void cmdqc::pop()
+{
+  slot[tail & ( CQSIZE - 1 )].seq.store ( tail + CQSIZE, std::memory_order_release ) ;
+  tail++ ;
+}
+
+
+//**************************************************************************************************
+//                                         C M D Q C : : K I N D                                   *
+//**************************************************************************************************
+// Find the kind of a command like "upvolume=2".  Returns the index in cqkinds, 0 if it cannot be  *
+// merged.  The value is returned in val, negative for "down".  rel is set for up/down commands.   *
+//**************************************************************************************************
+int cmdqc::kind ( const char* cmd, int* val, bool* rel )
+{
+  char        name[16] ;                                      // Name of command in lower case
+  const char* p = cmd ;                                       // Scans the command
+  char*       end ;                                           // End of value
+  uint16_t    i = 0 ;                                         // Index in name
+  int         sign = 1 ;                                      // -1 for "down"
+
+  while ( *p == ' ' )                                         // Skip leading spaces
+  {
+    p++ ;
+  }
+  while ( *p && ( *p != '=' ) && ( *p != ' ' ) && ( i < ( sizeof(name) - 1 ) ) )
+  {
+    name[i++] = tolower ( *p++ ) ;
+  }
+  name[i] = '\0' ;
+  while ( *p == ' ' )
+  {
+    p++ ;
+  }
+  *val = 0 ;                                                  // No value is zero
+  if ( *p == '=' )                                            // Value present?
+  {
+    *val = abs ( (int)strtol ( p + 1, &end, 10 ) ) ;          // Yes, get it
+    p = end ;
+    while ( *p == ' ' )
+    {
+      p++ ;
+    }
+  }
+  if ( *p )                                                   // Something else, like a comment?
+  {
+    return 0 ;                                                // Yes, do not merge
+  }
+  p = name ;
+  *rel = true ;
+  if ( strncmp ( name, "up", 2 ) == 0 )                       // Relative setting?
+  {
+    p += 2 ;
+  }
+  else if ( strncmp ( name, "down", 4 ) == 0 )
+  {
+    p += 4 ;
+    sign = -1 ;
+  }
+  else
+  {
+    *rel = false ;                                            // No, absolute
+  }
+  *val *= sign ;
+  for ( i = 1 ; i < ( sizeof(cqkinds) / sizeof(cqkinds[0]) ) ; i++ )
+  {
+    if ( strcmp ( p, cqkinds[i] ) == 0 )                      // Kind found?
+    {
+      return i ;
+    }
+  }
+  return 0 ;
+}
+
+
+//**************************************************************************************************
+//                                        C M D Q C : : M E R G E                                  *
 //**************************************************************************************************
-// Clear all preferences.                                                                          *
+// Merge the next command into the current one if they are of the same kind.  Relative commands    *
+// are added, an absolute command replaces the current one.  Returns true if merged.               *
 //**************************************************************************************************
-esp_err_t nvsclear()
+bool cmdqc::merge ( char* cur, const char* next )
 {
-  nvsopen() ;                                         // Be sure to open nvs
-  return nvs_erase_all ( nvshandle ) ;                // Clear all keys
+  int  kc, kn ;                                               // Kinds of commands
+  int  vc, vn ;                                               // Values
+  bool rc, rn ;                                               // Relative or absolute
+
+  kc = kind ( cur, &vc, &rc ) ;
+  kn = kind ( next, &vn, &rn ) ;
+  if ( ( kc == 0 ) || ( kc != kn ) )                          // Same kind?
+  {
+    return false ;                                            // No, execute separately
+  }
+  if ( !rn )                                                  // Absolute setting?
+  {
+    strcpy ( cur, next ) ;                                    // Yes, replaces the current one
+  }
+  else if ( rc )                                              // Both relative?
+  {
+    vc += vn ;                                                // Yes, add them
+    sprintf ( cur, "%s%s=%d", ( vc < 0 ) ? "down" : "up",
+              cqkinds[kc], abs ( vc ) ) ;
+  }
+  else
+  {
+    return false ;                                            // Relative after absolute
+  }
+  return true ;
 }
 
 
 //**************************************************************************************************
-//                                      N V S G E T S T R                                          *
+//                                         C M D Q C : : P O S T                                   *
 //**************************************************************************************************
-// Read a string from nvs.                                                                         *
+// Post a command without reply.  The reply will be shown in the debug output.                     *
 //**************************************************************************************************
-String nvsgetstr ( const char* key )
+bool cmdqc::post ( uint8_t src, const char* cmd )
 {
-  static char   nvs_buf[NVSBUFSIZE] ;       // Buffer for contents
-  size_t        len = NVSBUFSIZE ;          // Max length of the string, later real length
-
-  nvsopen() ;                               // Be sure to open nvs
-  nvs_buf[0] = '\0' ;                       // Return empty string on error
-  nvserr = nvs_get_str ( nvshandle, key, nvs_buf, &len ) ;
-  if ( nvserr )
+  if ( !put ( src, cmd, NULL, NULL ) )                        // Room for command?
   {
-    dbgprint ( "nvs_get_str failed %X for key %s, keylen is %d, len is %d!",
-               nvserr, key, strlen ( key), len ) ;
-    dbgprint ( "Contents: %s", nvs_buf ) ;
+    dropped++ ;                                               // No, count and show
+    dbgprint ( "Command mailbox full, %s command %s dropped", cqnames[src], cmd ) ;
+    return false ;
   }
-  return String ( nvs_buf ) ;
+  posted[src]++ ;
+  return true ;
 }
 
 
 //**************************************************************************************************
-//                                      N V S S E T S T R                                          *
+//                                         C M D Q C : : E X E C                                   *
 //**************************************************************************************************
-// Put a key/value pair in nvs.  Length is limited to allow easy read-back.                        *
-// No writing if no change.                                                                        *
+// Post a command and wait for the reply.  If called from loop(), the mailbox is run right away.   *
+// The reply buffer must hold CQREPLEN characters.                                                 *
 //**************************************************************************************************
-esp_err_t nvssetstr ( const char* key, String val )
+const char* cmdqc::exec ( uint8_t src, const char* cmd, char* reply )
 {
-  String curcont ;                                         // Current contents
-  bool   wflag = true  ;                                   // Assume update or new key
+  std::atomic<bool> done ( false ) ;                          // Set if reply available
+  bool              own ;                                     // We are the executor
 
-  //dbgprint ( "Setstring for %s: %s", key, val.c_str() ) ;
-  if ( val.length() >= NVSBUFSIZE )                        // Limit length of string to store
-  {
-    dbgprint ( "nvssetstr length failed!" ) ;
-    return ESP_ERR_NVS_NOT_ENOUGH_SPACE ;
-  }
-  if ( nvssearch ( key ) )                                 // Already in nvs?
-  {
-    curcont = nvsgetstr ( key ) ;                          // Read current value
-    wflag = ( curcont != val ) ;                           // Value change?
-  }
-  if ( wflag )                                             // Update or new?
+  own = ( xTaskGetCurrentTaskHandle() == maintask ) ;
+  while ( !put ( src, cmd, reply, &done ) )                   // Wait for room
   {
-    //dbgprint ( "nvssetstr update value" ) ;
-    nvserr = nvs_set_str ( nvshandle, key, val.c_str() ) ; // Store key and value
-    if ( nvserr )                                          // Check error
+    if ( own )
     {
-      dbgprint ( "nvssetstr failed!" ) ;
+      run() ;                                                 // Make room ourself
+    }
+    else
+    {
+      vTaskDelay ( 1 ) ;                                      // Wait for loop() to make room
     }
   }
-  return nvserr ;
-}
-
-
-//**************************************************************************************************
-//                                      N V S C H K E Y                                            *
-//**************************************************************************************************
-// Change a keyname in in nvs.                                                                     *
-//**************************************************************************************************
-void nvschkey ( const char* oldk, const char* newk )
-{
-  String curcont ;                                         // Current contents
-
-  if ( nvssearch ( oldk ) )                                // Old key in nvs?
+  posted[src]++ ;
+  while ( !done.load ( std::memory_order_acquire ) )          // Wait for the reply
   {
-    curcont = nvsgetstr ( oldk ) ;                         // Read current value
-    nvs_erase_key ( nvshandle, oldk ) ;                    // Remove key
-    nvssetstr ( newk, curcont ) ;                          // Insert new
+    if ( own )
+    {
+      run() ;                                                 // Execute ourself
+    }
+    else
+    {
+      vTaskDelay ( 1 ) ;
+    }
   }
+  return reply ;
 }
 
 
 //**************************************************************************************************
-//                                      C L A I M S P I                                            *
+//                                          C M D Q C : : R U N                                    *
 //**************************************************************************************************
-// Claim the SPI bus.  Uses FreeRTOS semaphores.                                                   *
-// If the semaphore cannot be claimed within the time-out period, the function continues without   *
-// claiming the semaphore.  This is incorrect but allows debugging.                                *
+// Execute all posted commands in order.  Called from loop() only.  Commands without a reply are   *
+// merged with the next ones if possible.                                                          *
 //**************************************************************************************************
-void claimSPI ( const char* p )
+void cmdqc::run()
 {
-  const              TickType_t ctry = 10 ;                 // Time to wait for semaphore
-  uint32_t           count = 0 ;                            // Wait time in ticks
-  static const char* old_id = "none" ;                      // ID that holds the bus
+  char               buf[CQCMDLEN] ;                          // Command, analyzeCmd changes it
+  cqslot*            s ;                                      // Slot of oldest command
+  uint8_t            src ;                                    // Source of command
+  char*              reply ;                                  // Buffer for reply of caller
+  std::atomic<bool>* done ;                                   // Flag of caller
+  const char*        res ;                                    // Reply of analyzeCmd
 
-  while ( xSemaphoreTake ( SPIsem, ctry ) != pdTRUE  )      // Claim SPI bus
+  while ( ( s = front() ) )                                   // Command in mailbox?
   {
-    if ( count++ > 25 )
+    strcpy ( buf, s->cmd ) ;                                  // Yes, take it out
+    src = s->src ;
+    reply = s->reply ;
+    done = s->done ;
+    pop() ;
+    while ( ( reply == NULL ) && ( s = front() ) &&           // Merge with next commands
+            ( s->reply == NULL ) && merge ( buf, s->cmd ) )
+    {
+      pop() ;
+      merged++ ;
+    }
+    res = analyzeCmd ( buf ) ;                                // Execute the command
+    if ( reply )                                              // Caller waits for reply?
     {
-      dbgprint ( "SPI semaphore not taken within %d ticks by CPU %d, id %s",
-                 count * ctry,
-                 xPortGetCoreID(),
-                 p ) ;
-      dbgprint ( "Semaphore is claimed by %s", old_id ) ;
+      strncpy ( reply, res, CQREPLEN - 1 ) ;                  // Yes, copy it
+      reply[CQREPLEN - 1] = '\0' ;
+      done->store ( true, std::memory_order_release ) ;
     }
-    if ( count >= 100 )
+    else
     {
-      return ;                                               // Continue without semaphore
+      dbgprint ( "%s: %s", cqnames[src], res ) ;              // Result for debugging
     }
   }
-  old_id = p ;                                               // Remember ID holding the semaphore
 }
 
+cmdqc            cmdq ;                                       // Mailbox for commands of all inputs
+
 
 //**************************************************************************************************
-//                                   R E L E A S E S P I                                           *
+//                                      T A S K C O R E                                            *
 //**************************************************************************************************
-// Free the the SPI bus.  Uses FreeRTOS semaphores.                                                *
+// Convert a configured core to the parameter for xTaskCreatePinnedToCore().  Other values than 0  *
+// and 1 let the task run on any core.                                                             *
 //**************************************************************************************************
-void releaseSPI()
+BaseType_t taskcore ( int8_t core )
 {
-  xSemaphoreGive ( SPIsem ) ;                            // Release SPI bus
+  if ( ( core == 0 ) || ( core == 1 ) )                      // Valid core?
+  {
+    return core ;                                            // Yes, pin to it
+  }
+  return tskNO_AFFINITY ;                                    // No, any core
 }
 
 
 //**************************************************************************************************
 //                                      Q U E U E F U N C                                          *
 //**************************************************************************************************
-// Queue a special function for the play task.                                                     *
+// Queue a special function for the play task.  Called by the producer of mp3ring only.  The write *
+// position of the ring is sent along, so a stop flushes the old song but not the next one.  A     *
+// stop also carries a copy of the next frame boundaries, so the playtask can cut at a frame edge. *
 //**************************************************************************************************
 void queuefunc ( int func )
 {
-  qdata_struct     specchunk ;                          // Special function to queue
+  qdata_struct qd ;                                     // Request for playtask
 
-  specchunk.datatyp = func ;                            // Put function in datatyp
-  xQueueSendToFront ( dataqueue, &specchunk, 200 ) ;    // Send to queue (First Out)
+  qd.func = func ;
+  qd.tq = micros() ;                                    // For the stop latency
+  qd.mark = mp3ring.wrpos() ;                           // Data up to here is for the old song
+  qd.nedge = 0 ;
+  if ( func != QSTARTSONG )                             // Stop request?
+  {
+    qd.nedge = frame_edges ( qd.edge, QEDGES, qd.mark ) ; // Yes, copy the frame boundaries
+  }
+  xQueueSend ( ctrlqueue, &qd, 200 ) ;                  // Send to control queue
+  xTaskNotifyGive ( xplaytask ) ;                       // Wake up playtask
 }
 
 
@@ -1548,15 +5921,14 @@ void listNetworks()
 //**************************************************************************************************
 //                                          T I M E R 1 0 S E C                                    *
 //**************************************************************************************************
-// Extra watchdog.  Called every 10 seconds.                                                       *
-// If totalcount has not been changed, there is a problem and playing will stop.                   *
+// Called every 10 seconds.  Measures the bitrate from the bytes sent to the decoder.              *
+// Stalls of the stream are handled by recovery in mp3loop().                                      *
 // Note that calling timely procedures within this routine or in called functions will             *
 // cause a crash!                                                                                  *
 //**************************************************************************************************
 void IRAM_ATTR timer10sec()
 {
   static uint32_t oldtotalcount = 7321 ;          // Needed for change detection
-  static uint8_t  morethanonce = 0 ;              // Counter for succesive fails
   uint32_t        bytesplayed ;                   // Bytes send to MP3 converter
 
   if ( datamode & ( INIT | HEADER | DATA |        // Test op playing
@@ -1566,32 +5938,10 @@ void IRAM_ATTR timer10sec()
   {
     bytesplayed = totalcount - oldtotalcount ;    // Nunber of bytes played in the 10 seconds
     oldtotalcount = totalcount ;                  // Save for comparison in next cycle
-    if ( bytesplayed == 0 )                       // Still playing?
-    {
-      if ( morethanonce > 10 )                    // No! Happened too many times?
-      {
-        ESP.restart() ;                           // Reset the CPU, probably no return
-      }
-      if ( datamode & ( PLAYLISTDATA |            // In playlist mode?
-                        PLAYLISTINIT |
-                        PLAYLISTHEADER ) )
-      {
-        playlist_num = 0 ;                        // Yes, end of playlist
-      }
-      if ( ( morethanonce > 0 ) ||                // Happened more than once?
-           ( playlist_num > 0 ) )                 // Or playlist active?
-      {
-        datamode = STOPREQD ;                     // Stop player
-        ini_block.newpreset++ ;                   // Yes, try next channel
-      }
-      morethanonce++ ;                            // Count the fails
-    }
-    else
+    if ( bytesplayed )                            // Data has been send to MP3 decoder?
     {
-      //                                          // Data has been send to MP3 decoder
       // Bitrate in kbits/s is bytesplayed / 10 / 1000 * 8
       mbitrate = ( bytesplayed + 625 ) / 1250 ;   // Measured bitrate
-      morethanonce = 0 ;                          // Data seen, reset failcounter
     }
   }
 }
@@ -1674,6 +6024,24 @@ void IRAM_ATTR timer100()
 }
 
 
+//**************************************************************************************************
+//                                        I S R _ D R E Q                                          *
+//**************************************************************************************************
+// Interrupt on the rising edge of DREQ.  The VS1053 has room for at least 32 bytes of data now.   *
+// Wakes up the playtask that is waiting for this.                                                 *
+//**************************************************************************************************
+void IRAM_ATTR isr_dreq()
+{
+  BaseType_t hpw = pdFALSE ;                             // Higher priority task woken or not
+
+  vTaskNotifyGiveFromISR ( xplaytask, &hpw ) ;           // Wake up playtask
+  if ( hpw )
+  {
+    portYIELD_FROM_ISR() ;                               // Switch to playtask at once
+  }
+}
+
+
 //**************************************************************************************************
 //                                          I S R _ I R                                            *
 //**************************************************************************************************
@@ -1846,11 +6214,19 @@ String selectnextFSnode ( int16_t delta )
 //**************************************************************************************************
 bool connecttofile()
 {
+  bool res ;                                          // Result of connect
+
   if ( usb_sd == FS_USB )                             // File system depends on this switch
   {
-    return connecttofile_USB() ;                      // Use USB
+    res = connecttofile_USB() ;                       // Use USB
   }
-  return connecttofile_SD() ;                         // Use SD
+  else
+  {
+    res = connecttofile_SD() ;                        // Use SD
+  }
+  audiotype = host.endsWith ( ".ogg" ) ? AU_OGG : AU_MP3 ; // Type of audio from file name
+  audioscan_reset ( audiotype ) ;                     // Scan for frames or pages
+  return res ;
 }
 
 
@@ -1986,39 +6362,93 @@ void setdatamode ( datamode_t newmode )
 //**************************************************************************************************
 void stop_mp3client ()
 {
-
-  while ( mp3client.connected() )
+  mp3conn.abort() ;                                // Cancel connect in progress
+  if ( mp3client.connected() )
   {
     dbgprint ( "Stopping client" ) ;               // Stop connection to host
-    mp3client.flush() ;
-    mp3client.stop() ;
-    delay ( 500 ) ;
   }
-  mp3client.flush() ;                              // Flush stream client
-  mp3client.stop() ;                               // Stop stream client
+  mp3client.stop() ;                               // Stop stream client, closes the socket
 }
 
 
 //**************************************************************************************************
-//                                    C O N N E C T T O H O S T                                    *
+//                                    H O S T R E Q U E S T                                        *
 //**************************************************************************************************
-// Connect to the Internet radio server specified by newpreset.                                    *
+// Split an URL like "skonto.ls.lv:8002/mp3" in host and port and build the GET request for it.    *
 //**************************************************************************************************
-bool connecttohost()
+String hostrequest ( const String& url, String& hostwoext, uint16_t& port )
 {
   int         inx ;                                 // Position of ":" in hostname
-  uint16_t    port = 80 ;                           // Port number for host
   String      extension = "/" ;                     // May be like "/mp3" in "skonto.ls.lv:8002/mp3"
-  String      hostwoext = host ;                    // Host without extension and portnumber
   String      auth  ;                               // For basic authentication
 
+  port = 80 ;                                       // Default port number
+  hostwoext = url ;                                 // Host without extension and portnumber
+  // In the URL there may be an extension, like noisefm.ru:8000/play.m3u&t=.m3u
+  inx = url.indexOf ( "/" ) ;                       // Search for begin of extension
+  if ( inx > 0 )                                    // Is there an extension?
+  {
+    extension = url.substring ( inx ) ;             // Yes, change the default
+    hostwoext = url.substring ( 0, inx ) ;          // Host without extension
+  }
+  // In the host there may be a portnumber
+  inx = hostwoext.indexOf ( ":" ) ;                 // Search for separator
+  if ( inx >= 0 )                                   // Portnumber available?
+  {
+    port = url.substring ( inx + 1 ).toInt() ;      // Get portnumber as integer
+    hostwoext = url.substring ( 0, inx ) ;          // Host without portnumber
+  }
+  dbgprint ( "Connect to %s on port %d, extension %s",
+             hostwoext.c_str(), port, extension.c_str() ) ;
+  if ( nvssearch ( "basicauth" ) )                  // Does "basicauth" exists?
+  {
+    auth = nvsgetstr ( "basicauth" ) ;              // Use basic authentication?
+    if ( auth != "" )                               // Should be user:passwd
+    {
+       auth = base64::encode ( auth.c_str() ) ;     // Encode
+       auth = String ( "Authorization: Basic " ) +
+              auth + String ( "\r\n" ) ;
+    }
+  }
+  return String ( "GET " ) +
+         extension +
+         String ( " HTTP/1.1\r\n" ) +
+         String ( "Host: " ) +
+         hostwoext +
+         String ( "\r\n" ) +
+         String ( "Icy-MetaData:1\r\n" ) +
+         auth +
+         String ( "Connection: close\r\n\r\n" ) ;
+}
+
+
+//**************************************************************************************************
+//                                    C O N N E C T T O H O S T                                    *
+//**************************************************************************************************
+// Connect to the Internet radio server specified by newpreset.                                    *
+// The connection is only started here, it will be completed in mp3loop() by polling mp3conn.      *
+//**************************************************************************************************
+bool connecttohost()
+{
+  uint16_t    port ;                                // Port number for host
+  String      hostwoext ;                           // Host without extension and portnumber
+  String      request ;                             // Request to send to host
+
   stop_mp3client() ;                                // Disconnect if still connected
   dbgprint ( "Connect to new host %s", host.c_str() ) ;
+  connectstart = millis() ;                         // For time to first audio byte
   tftset ( 0, "ESP32-Radio" ) ;                     // Set screen segment text top line
   displaytime ( "" ) ;                              // Clear time on TFT screen
+  if ( host.endsWith ( ".m3u8" ) )                  // Is it a HLS playlist?
+  {
+    hls.start ( host ) ;                            // Yes, segments are handled by hls
+    return true ;
+  }
+  hls.stop() ;                                      // Stop HLS session if any
   setdatamode ( INIT ) ;                            // Start default in metamode
   chunked = false ;                                 // Assume not chunked
-  if ( host.endsWith ( ".m3u" ) )                   // Is it an m3u playlist?
+  if ( host.endsWith ( ".m3u" ) ||                  // Is it an m3u playlist?
+       host.endsWith ( ".pls" ) )                   // or a PLS playlist?
   {
     playlist = host ;                               // Save copy of playlist URL
     setdatamode ( PLAYLISTINIT ) ;                  // Yes, start in PLAYLIST mode
@@ -2028,51 +6458,248 @@ bool connecttohost()
     }
     dbgprint ( "Playlist request, entry %d", playlist_num ) ;
   }
-  // In the URL there may be an extension, like noisefm.ru:8000/play.m3u&t=.m3u
-  inx = host.indexOf ( "/" ) ;                      // Search for begin of extension
-  if ( inx > 0 )                                    // Is there an extension?
+  request = hostrequest ( host, hostwoext, port ) ; // Build the request
+  mp3conn.start ( hostwoext.c_str(), port, request ) ; // Start connecting, failure reported in mp3loop()
+  return ( mp3conn.state != CS_FAILED ) ;
+}
+
+
+//**************************************************************************************************
+//                                      P R E S E T H O S T                                        *
+//**************************************************************************************************
+// Give the URL of a preset for a standby connection.  Empty if the preset does not exist or is   *
+// not a plain stream (playlist, iHeartRadio or local file).                                       *
+//**************************************************************************************************
+String presethost ( int16_t preset )
+{
+  String url ;                                          // Result
+
+  if ( ( preset < 0 ) || ( preset >= MAXPRESETS ) )     // Legal preset?
   {
-    extension = host.substring ( inx ) ;            // Yes, change the default
-    hostwoext = host.substring ( 0, inx ) ;         // Host without extension
+    return String ( "" ) ;                              // No
   }
-  // In the host there may be a portnumber
-  inx = hostwoext.indexOf ( ":" ) ;                 // Search for separator
-  if ( inx >= 0 )                                   // Portnumber available?
+  url = readhostfrompref ( preset ) ;                   // Lookup preset in preferences
+  chomp ( url ) ;                                       // Get rid of part after "#"
+  if ( url.endsWith ( ".m3u" ) ||                       // Not for playlists
+       url.endsWith ( ".pls" ) ||
+       url.endsWith ( ".m3u8" ) ||
+       url.startsWith ( "ihr/" ) ||                     // and iHeartRadio
+       ( url.indexOf ( "localhost/" ) >= 0 ) )          // and local files
   {
-    port = host.substring ( inx + 1 ).toInt() ;     // Get portnumber as integer
-    hostwoext = host.substring ( 0, inx ) ;         // Host without portnumber
+    url = "" ;
   }
-  dbgprint ( "Connect to %s on port %d, extension %s",
-             hostwoext.c_str(), port, extension.c_str() ) ;
-  if ( mp3client.connect ( hostwoext.c_str(), port ) )
+  return url ;
+}
+
+
+//**************************************************************************************************
+//                                     S T A N D B Y _ L O O P                                     *
+//**************************************************************************************************
+// Maintain the standby connections to the presets next to the current one.  Called from          *
+// mp3loop().  New standby connections are only opened while a station is playing and there is    *
+// enough free memory.                                                                             *
+//**************************************************************************************************
+void standby_loop()
+{
+  static int16_t sbpreset = -1 ;                        // Preset for which the slots are set up
+  String         url ;                                  // URL for a slot
+  int16_t        p ;                                    // Preset to search
+  int            i ;                                    // Index in standby[]
+
+  if ( ( ini_block.standby == 0 ) || localfile )        // Standby connections wanted?
   {
-    dbgprint ( "Connected to server" ) ;
-    if ( nvssearch ( "basicauth" ) )                // Does "basicauth" exists?
+    for ( i = 0 ; i < SBSLOTS ; i++ )                   // No, close all
     {
-      auth = nvsgetstr ( "basicauth" ) ;            // Use basic authentication?
-      if ( auth != "" )                             // Should be user:passwd
+      if ( standby[i].state != SB_FREE )
       {
-         auth = base64::encode ( auth.c_str() ) ;   // Encode
-         auth = String ( "Authorization: Basic " ) +
-                auth + String ( "\r\n" ) ;
+        standby[i].close() ;
       }
+      if ( standby[i].buf && ( ini_block.standby == 0 ) ) // Switched off?
+      {
+        free ( standby[i].buf ) ;                       // Yes, release memory
+        standby[i].buf = NULL ;
+      }
+      standby[i].url = "" ;
+    }
+    sbpreset = -1 ;                                     // Set up again if switched on
+    return ;
+  }
+  if ( ( datamode & ( DATA | METADATA ) ) &&            // Playing a station?
+       ( currentpreset >= 0 ) &&
+       ( currentpreset != sbpreset ) )                  // and slots not yet set up for it?
+  {
+    sbpreset = currentpreset ;                          // Yes, set up slots
+    for ( i = 0 ; i < SBSLOTS ; i++ )
+    {
+      url = "" ;                                        // Assume no URL for this slot
+      if ( i == 0 )                                     // Slot for next preset?
+      {
+        p = currentpreset ;                             // Yes, search next existing preset
+        do
+        {
+          if ( ++p >= MAXPRESETS )                      // Next or wrap to 0
+          {
+            p = 0 ;
+          }
+          url = presethost ( p ) ;
+        } while ( ( url == "" ) && ( p != currentpreset ) &&
+                  ( readhostfrompref ( p ) == "" ) ) ;
+      }
+      else if ( i < ini_block.standby )                 // Slot for previous preset in use?
+      {
+        p = currentpreset ;                             // Yes, search previous existing preset
+        do
+        {
+          if ( --p < 0 )                                // Previous or wrap to last
+          {
+            p = MAXPRESETS - 1 ;
+          }
+          url = presethost ( p ) ;
+        } while ( ( url == "" ) && ( p != currentpreset ) &&
+                  ( readhostfrompref ( p ) == "" ) ) ;
+      }
+      if ( url == host )                                // Same as current station?
+      {
+        url = "" ;                                      // Yes, no standby needed
+      }
+      if ( url != standby[i].url )                      // Change for this slot?
+      {
+        standby[i].close() ;                            // Yes, close old connection
+        standby[i].url = url ;
+      }
+    }
+  }
+  for ( i = 0 ; i < SBSLOTS ; i++ )                     // Handle the slots
+  {
+    standby[i].poll() ;
+    if ( ( standby[i].state == SB_FREE ) &&             // Free slot with an URL?
+         ( standby[i].url != "" ) &&
+         ( datamode & ( DATA | METADATA ) ) &&          // and playing?
+         ( ESP.getFreeHeap() > SBMINHEAP ) )            // and enough memory?
+    {
+      standby[i].start() ;                              // Yes, open standby connection
+    }
+  }
+}
+
+
+//**************************************************************************************************
+//                                     S T A N D B Y _ T A K E                                     *
+//**************************************************************************************************
+// Check if there is a ready standby connection for host.  If so, it is taken over by mp3client   *
+// and the side buffer is played.  Returns true if a standby connection was used.                  *
+//**************************************************************************************************
+bool standby_take()
+{
+  int i ;                                               // Index in standby[]
+
+  for ( i = 0 ; i < SBSLOTS ; i++ )
+  {
+    if ( ( standby[i].state == SB_READY ) &&            // Ready connection for this host?
+         ( standby[i].url == host ) )
+    {
+      stop_mp3client() ;                                // Yes, disconnect old station
+      dbgprint ( "Switch to standby connection for %s, %d bytes buffered",
+                 host.c_str(), standby[i].len ) ;
+      connectstart = millis() ;                         // For time to first audio byte
+      tftset ( 0, "ESP32-Radio" ) ;                     // Set screen segment text top line
+      displaytime ( "" ) ;                              // Clear time on TFT screen
+      chunked = false ;                                 // Assume not chunked
+      totalcount = 0 ;                                  // Reset totalcount
+      mp3client = standby[i].client ;                   // Take over the connection
+      hdrp = standby[i].hp ;                            // and the results of the headers
+      startdata() ;                                     // Start playing
+      handledata_ch ( standby[i].buf, standby[i].len ) ; // Play the side buffer
+      standby[i].release() ;                            // Slot will be set up again
+      return true ;
     }
-    mp3client.print ( String ( "GET " ) +
-                      extension +
-                      String ( " HTTP/1.1\r\n" ) +
-                      String ( "Host: " ) +
-                      hostwoext +
-                      String ( "\r\n" ) +
-                      String ( "Icy-MetaData:1\r\n" ) +
-                      auth +
-                      String ( "Connection: close\r\n\r\n" ) ) ;
-    return true ;
   }
-  dbgprint ( "Request %s failed!", host.c_str() ) ;
   return false ;
 }
 
 
+//**************************************************************************************************
+//                                   P L A Y L I S T _ R E A D Y                                   *
+//**************************************************************************************************
+// The complete playlist has been read into the index.  The entry to play is started from the     *
+// index in the next mp3loop().                                                                    *
+//**************************************************************************************************
+void playlist_ready()
+{
+  if ( metalinebfx > 0 )                                // Last line without linefeed?
+  {
+    metalinebf[metalinebfx] = '\0' ;                    // Yes, add it to the index
+    plindex.addline ( metalinebf ) ;
+    metalinebfx = 0 ;
+  }
+  plindex.complete = true ;                             // Index can be used now
+  dbgprint ( "Playlist %s has %d entries",
+             plindex.url.c_str(), plindex.count ) ;
+  if ( !localfile )                                     // Read from the network?
+  {
+    stop_mp3client() ;                                  // Yes, playlist not needed anymore
+  }
+  setdatamode ( STOPPED ) ;                             // Wait for entry to start
+  host = playlist ;                                     // Request entry from playlist
+  hostreq = true ;
+}
+
+
+//**************************************************************************************************
+//                                    P L A Y L I S T _ P L A Y                                    *
+//**************************************************************************************************
+// Start entry playlist_num of the current playlist from the index.  After the last entry the     *
+// next preset is selected.                                                                        *
+//**************************************************************************************************
+void playlist_play()
+{
+  const char* url ;                                     // URL of entry
+  const char* title ;                                   // #EXTINF title of entry
+  const char* p ;                                       // Points to "http://" in url
+
+  if ( playlist_num < 1 )                               // Limit number
+  {
+    playlist_num = 1 ;
+  }
+  url = plindex.entryurl ( playlist_num ) ;             // Lookup entry
+  if ( url == NULL )                                    // Past the end?
+  {
+    playlist_num = 1 ;                                  // Yes, restart playlist
+    dbgprint ( "End of playlist seen" ) ;
+    setdatamode ( STOPPED ) ;
+    ini_block.newpreset++ ;                             // Go to next preset
+    return ;
+  }
+  dbgprint ( "Entry %d of %d in playlist: %s",
+             playlist_num, plindex.count, url ) ;
+  mqttpub.trigger ( MQTT_PLAYLISTPOS ) ;                // Playlistposition to MQTT
+  title = plindex.entrytitle ( playlist_num ) ;         // Title from #EXTINF
+  if ( title )
+  {
+    showstreamtitle ( title, true ) ;                   // Show artist and title if present
+    mqttpub.trigger ( MQTT_STREAMTITLE ) ;              // Request publishing to MQTT
+  }
+  p = strstr ( url, "http://" ) ;                       // Search for "http://"
+  host = String ( p ? p + 7 : url ) ;                   // Remove it and set host
+  if ( localfile )                                      // SD card mode?
+  {
+    if ( strncmp ( url, "localhost", 9 ) )              // Prepend "localhost" if missing
+    {
+      host = String ( "localhost/" ) + url ;
+    }
+    if ( ! connecttofile() )                            // Connect to file
+    {
+      setdatamode ( STOPPED ) ;                         // Error, stop!
+    }
+  }
+  else
+  {
+    connecttohost() ;                                   // Connect to stream host
+  }
+  host = playlist ;                                     // Back to the .m3u host
+}
+
+
 //**************************************************************************************************
 //                                      S S C O N V                                                *
 //**************************************************************************************************
@@ -2285,7 +6912,7 @@ bool do_software_update ( uint32_t clength )
 void update_software ( const char* lstmodkey, const char* updatehost, const char* binfile )
 {
   uint32_t    timeout = millis() ;                              // To detect time-out
-  String      line ;                                            // Input header line
+  hdrres_t    hres = HDR_MORE ;                                 // Result of header parser
   String      lstmod = "" ;                                     // Last modified timestamp in NVS
   String      newlstmod ;                                       // Last modified from host
   
@@ -2306,41 +6933,32 @@ void update_software ( const char* lstmodkey, const char* updatehost, const char
                      "Connection: close\r\n\r\n",
                      binfile,
                      updatehost ) ;
-  while ( otaclient.available() == 0 )                          // Wait until response appears
-  {
-    if ( millis() - timeout > 5000 )
-    {
-      dbgprint ( "Connect to Update host Timeout!" ) ;
-      otaclient.stop() ;
-      return ;
-    }
-  }
-  // Connected, handle response
-  while ( otaclient.available() )
+  hdrp.reset() ;                                                // Prepare header parser
+  while ( hres == HDR_MORE )                                    // Handle headers of response
   {
-    line = otaclient.readStringUntil ( '\n' ) ;                 // Read a line from response
-    line.trim() ;                                               // Remove garbage
-    dbgprint ( line.c_str() ) ;                                 // Debug info
-    if ( !line.length() )                                       // End of headers?
-    {
-      break ;                                                   // Yes, get the OTA started
-    }
-    // Check if the HTTP Response is 200.  Any other response is an error.
-    if ( line.startsWith ( "HTTP/1.1" ) )                       // 
+    if ( otaclient.available() == 0 )                           // Wait until response appears
     {
-      if ( line.indexOf ( " 200 " ) < 0 )
+      if ( millis() - timeout > 5000 )
       {
-        dbgprint ( "Got a non 200 status code from server!" ) ;
+        dbgprint ( "Connect to Update host Timeout!" ) ;
+        otaclient.stop() ;
         return ;
       }
+      continue ;
     }
-    scan_content_length ( line.c_str() ) ;                      // Scan for content_length
-    if ( line.startsWith ( "Last-Modified: " ) )                // Timestamp of binary file
-    {
-      newlstmod = line.substring ( 15 ) ;                       // Isolate timestamp
-    }
+    hres = hdrp.feed ( otaclient.read() ) ;                     // Feed next byte to the parser
+  }
+  // End of headers reached.  Check if the HTTP Response is 200.  Any other response is an error.
+  if ( ( hres == HDR_ERROR ) || ( hdrp.status != 200 ) )
+  {
+    dbgprint ( "Got status code %d from server!", hdrp.status ) ;
+    otaclient.stop() ;
+    return ;
   }
-  // End of headers reached
+  clength = ( hdrp.clength == 0xFFFFFFFF ) ? 0 : hdrp.clength ; // Content length of binary
+  newlstmod = String ( hdrp.lastmod ) ;                         // Timestamp of binary file
+  dbgprint ( "Content-Length is %d, Last-Modified is %s",
+             clength, hdrp.lastmod ) ;
   if ( newlstmod == lstmod )                                    // Need for update?
   {
     dbgprint ( "No new version available" ) ;                   // No, show reason
@@ -2563,6 +7181,9 @@ void readIOprefs()
     { "pin_spi_sck",   &ini_block.spi_sck_pin,      18 },
     { "pin_spi_miso",  &ini_block.spi_miso_pin,     19 },
     { "pin_spi_mosi",  &ini_block.spi_mosi_pin,     23 },
+    { "pin_hspi_sck",  &ini_block.hspi_sck_pin,     -1 }, // Separate bus for VS1053
+    { "pin_hspi_miso", &ini_block.hspi_miso_pin,    -1 },
+    { "pin_hspi_mosi", &ini_block.hspi_mosi_pin,    -1 },
     { NULL,            NULL,                        0  }  // End of list
   } ;
   int         i ;                                         // Loop control
@@ -2590,6 +7211,16 @@ void readIOprefs()
                klist[i].gname,
                ival ) ;
   }
+  ini_block.sd_speed = SDSPEED ;                          // Assume default clock for SD card
+  if ( nvssearch ( "sd_speed" ) )                         // Needed before SD is mounted
+  {
+    val = nvsgetstr ( "sd_speed" ) ;                      // Read value of key
+    if ( val.toInt() > 0 )                                // Legal value?
+    {
+      ini_block.sd_speed = val.toInt() ;                  // Yes, use it
+    }
+  }
+  dbgprint ( "sd_speed set to %d", ini_block.sd_speed ) ;
 }
 
 
@@ -2718,11 +7349,11 @@ bool mqttreconnect()
 //**************************************************************************************************
 // Executed when a subscribed message is received.                                                 *
 // Note that message is not delimited by a '\0'.                                                   *
-// Note that cmd buffer is shared with serial input.                                               *
+// The command is posted to the command mailbox.                                                   *
 //**************************************************************************************************
 void onMqttMessage ( char* topic, byte* payload, unsigned int len )
 {
-  const char*  reply ;                                // Result from analyzeCmd
+  char         cmd[CQCMDLEN] ;                        // Copy of message
 
   if ( strstr ( topic, MQTT_SUBTOPIC ) )              // Check on topic, maybe unnecessary
   {
@@ -2733,8 +7364,7 @@ void onMqttMessage ( char* topic, byte* payload, unsigned int len )
     strncpy ( cmd, (char*)payload, len ) ;            // Make copy of message
     cmd[len] = '\0' ;                                 // Take care of delimeter
     dbgprint ( "MQTT message arrived [%s], lenght = %d, %s", topic, len, cmd ) ;
-    reply = analyzeCmd ( cmd ) ;                      // Analyze command and handle it
-    dbgprint ( reply ) ;                              // Result for debugging
+    cmdq.post ( CQ_MQTT, cmd ) ;                      // Post command for execution
   }
 }
 
@@ -2748,7 +7378,6 @@ void scanserial()
 {
   static String serialcmd ;                      // Command from Serial input
   char          c ;                              // Input character
-  const char*   reply = "" ;                     // Reply string from analyzeCmd
   uint16_t      len ;                            // Length of input string
 
   while ( Serial.available() )                   // Any input seen?
@@ -2760,16 +7389,15 @@ void scanserial()
     {
       if ( len )
       {
-        strncpy ( cmd, serialcmd.c_str(), sizeof(cmd) ) ;
         if ( nxtserial )                         // NEXTION test possible?
         {
           if ( serialcmd.startsWith ( "N:" ) )   // Command meant to test Nextion display?
           {
-            nxtserial->printf ( "%s\xFF\xFF\xFF", cmd + 2 ) ;
+            nxtserial->printf ( "%s\xFF\xFF\xFF", serialcmd.c_str() + 2 ) ;
           }
         }
-        reply = analyzeCmd ( cmd ) ;             // Analyze command and handle it
-        dbgprint ( reply ) ;                     // Result for debugging
+        cmdq.post ( CQ_SERIAL,                   // Post command for execution
+                    serialcmd.c_str() ) ;
         serialcmd = "" ;                         // Prepare for new command
       }
     }
@@ -2777,7 +7405,7 @@ void scanserial()
     {
       serialcmd += c ;                           // Add to the command
     }
-    if ( len >= ( sizeof(cmd) - 2 )  )           // Check for excessive length
+    if ( len >= ( CQCMDLEN - 2 )  )              // Check for excessive length
     {
       serialcmd = "" ;                           // Too long, reset
     }
@@ -2794,7 +7422,6 @@ void scanserial2()
 {
   static String  serialcmd ;                       // Command from Serial input
   char           c ;                               // Input character
-  const char*    reply = "" ;                      // Reply string from analyzeCmd
   uint16_t       len ;                             // Length of input string
   static uint8_t ffcount = 0 ;                     // Counter for 3 tmes "0xFF"
 
@@ -2813,13 +7440,12 @@ void scanserial2()
         ffcount = 0 ;                              // For next command
         if ( len )
         {
-          strncpy ( cmd, serialcmd.c_str(), sizeof(cmd) ) ;
           dbgprint ( "NEXTION command seen %02X %s",
-                     cmd[0], cmd + 1 ) ;
-          if ( cmd[0] == 0x70 )                    // Button pressed?
+                     serialcmd[0], serialcmd.c_str() + 1 ) ;
+          if ( serialcmd[0] == 0x70 )              // Button pressed?
           {
-            reply = analyzeCmd ( cmd + 1 ) ;       // Analyze command and handle it
-            dbgprint ( reply ) ;                   // Result for debugging
+            cmdq.post ( CQ_NEXTION,                // Post command for execution
+                        serialcmd.c_str() + 1 ) ;
           }
           serialcmd = "" ;                         // Prepare for new command
         }
@@ -2828,7 +7454,7 @@ void scanserial2()
       {
         serialcmd += c ;                           // Add to the command
       }
-      if ( len >= ( sizeof(cmd) - 2 )  )           // Check for excessive length
+      if ( len >= ( CQCMDLEN - 2 )  )              // Check for excessive length
       {
         serialcmd = "" ;                           // Too long, reset
       }
@@ -2848,7 +7474,6 @@ void  scandigital()
   int             i ;                                       // Loop control
   int8_t          pinnr ;                                   // Pin number to check
   bool            level ;                                   // Input level
-  const char*     reply ;                                   // Result of analyzeCmd
   int16_t         tlevel ;                                  // Level found by touch pin
   const int16_t   THRESHOLD = 30 ;                          // Threshold or touch pins
 
@@ -2872,8 +7497,8 @@ void  scandigital()
       {
         dbgprint ( "GPIO_%02d is now LOW, execute %s",
                    pinnr, progpin[i].command.c_str() ) ;
-        reply = analyzeCmd ( progpin[i].command.c_str() ) ; // Analyze command and handle it
-        dbgprint ( reply ) ;                                // Result for debugging
+        cmdq.post ( CQ_GPIO,                                // Post command for execution
+                    progpin[i].command.c_str() ) ;
       }
     }
   }
@@ -2905,8 +7530,8 @@ void  scandigital()
         dbgprint ( "TOUCH_%02d is now %d ( < %d ), execute %s",
                    pinnr, tlevel, THRESHOLD,
                    touchpin[i].command.c_str() ) ;
-        reply = analyzeCmd ( touchpin[i].command.c_str() ); // Analyze command and handle it
-        dbgprint ( reply ) ;                                // Result for debugging
+        cmdq.post ( CQ_TOUCH,                               // Post command for execution
+                    touchpin[i].command.c_str() ) ;
       }
     }
   }
@@ -2922,7 +7547,6 @@ void scanIR()
 {
   char        mykey[20] ;                                   // For numerated key
   String      val ;                                         // Contents of preference entry
-  const char* reply ;                                       // Result of analyzeCmd
 
   if ( ir_value )                                           // Any input?
   {
@@ -2932,8 +7556,7 @@ void scanIR()
       val = nvsgetstr ( mykey ) ;                           // Get the contents
       dbgprint ( "IR code %04X received. Will execute %s",
                  ir_value, val.c_str() ) ;
-      reply = analyzeCmd ( val.c_str() ) ;                  // Analyze command and handle it
-      dbgprint ( reply ) ;                                  // Result for debugging
+      cmdq.post ( CQ_IR, val.c_str() ) ;                    // Post command for execution
     }
     else
     {
@@ -3289,6 +7912,18 @@ void setup()
   ini_block.clk_dst = 1 ;                                // DST is +1 hour
   ini_block.bat0 = 0 ;                                   // Battery ADC levels not yet defined
   ini_block.bat100 = 0 ;
+  ini_block.prebuf_ms = 1000 ;                           // Start playing after 1 second of data
+  ini_block.lowbuf_ms = 200 ;                            // Rebuffer if less than 200 msec left
+  ini_block.dnssave = true ;                             // Save DNS cache in NVS
+  ini_block.standby = 1 ;                                // Standby connection to next preset
+  ini_block.rcretries = 5 ;                              // Reconnect 5 times before skipping
+  ini_block.ratectl = true ;                             // Compensate clock drift
+  ini_block.fastzap = true ;                             // Fast station switch
+  ini_block.ingestcore = 1 ;                             // Ingest task on core 1
+  ini_block.ingestprio = 2 ;                             // above loop()
+  ini_block.playcore = 0 ;                               // Playtask on core 0
+  ini_block.playprio = 2 ;
+  ini_block.perfpub = 0 ;                                // No performance reports to MQTT
   readIOprefs() ;                                        // Read pins used for SPI, TFT, VS1053, IR,
   // Rotary encoder
   for ( i = 0 ; (pinnr = progpin[i].gpio) >= 0 ; i++ )   // Check programmable input pins
@@ -3310,11 +7945,25 @@ void setup()
   SPI.begin ( ini_block.spi_sck_pin,                     // Init VSPI bus with default or modified pins
               ini_block.spi_miso_pin,
               ini_block.spi_mosi_pin ) ;
+  if ( ( ini_block.hspi_sck_pin >= 0 ) &&                // Separate bus for VS1053?
+       ( ini_block.hspi_miso_pin >= 0 ) &&
+       ( ini_block.hspi_mosi_pin >= 0 ) )
+  {
+    vsspi = new SPIClass ( HSPI ) ;                      // Yes, use HSPI for it
+    vsspi->begin ( ini_block.hspi_sck_pin,
+                   ini_block.hspi_miso_pin,
+                   ini_block.hspi_mosi_pin ) ;
+    spiarb.split() ;                                     // Lock of its own
+    dbgprint ( "VS1053 on HSPI bus, SCK %d, MISO %d, MOSI %d",
+               ini_block.hspi_sck_pin, ini_block.hspi_miso_pin,
+               ini_block.hspi_mosi_pin ) ;
+  }
   vs1053player = new VS1053 ( ini_block.vs_cs_pin,       // Make instance of player
                               ini_block.vs_dcs_pin,
                               ini_block.vs_dreq_pin,
                               ini_block.vs_shutdown_pin,
-                              ini_block.vs_shutdownx_pin ) ;
+                              ini_block.vs_shutdownx_pin,
+                              vsspi ) ;
   if ( ini_block.ir_pin >= 0 )
   {
     dbgprint ( "Enable pin %d for IR",
@@ -3360,6 +8009,10 @@ void setup()
   WiFi.persistent ( false ) ;                            // Do not save SSID and password
   listNetworks() ;                                       // Find WiFi networks
   readprefs ( false ) ;                                  // Read preferences
+  if ( ini_block.dnssave )                               // DNS cache in NVS?
+  {
+    dnscache.load() ;                                    // Yes, load saved addresses
+  }
   tcpip_adapter_set_hostname ( TCPIP_ADAPTER_IF_STA,
                                NAME ) ;
   vs1053player->begin() ;                                // Initialize VS1053 player
@@ -3442,19 +8095,17 @@ void setup()
                    dsp_getwidth(),
                    dsp_getheight() - 8, BLACK ) ;
   }
-  outchunk.datatyp = QDATA ;                              // This chunk dedicated to QDATA
   adc1_config_width ( ADC_WIDTH_12Bit ) ;
   adc1_config_channel_atten ( ADC1_CHANNEL_0, ADC_ATTEN_0db ) ;
-  dataqueue = xQueueCreate ( QSIZ,                        // Create queue for communication
-                             sizeof ( qdata_struct ) ) ;
+  ctrlqueue = xQueueCreate ( 4, sizeof ( qdata_struct ) ) ; // Queue for start/stop requests
   xTaskCreatePinnedToCore (
-    playtask,                                             // Task to play data in dataqueue.
+    playtask,                                             // Task to play data in mp3ring.
     "Playtask",                                           // name of task.
     1600,                                                 // Stack size of task
     NULL,                                                 // parameter of the task
-    2,                                                    // priority of the task
+    ini_block.playprio,                                   // priority of the task
     &xplaytask,                                           // Task handle to keep track of created task
-    0 ) ;                                                 // Run on CPU 0
+    taskcore ( ini_block.playcore ) ) ;                   // Run on configured CPU
   xTaskCreate (
     spftask,                                              // Task to handle special functions.
     "Spftask",                                            // name of task.
@@ -3462,6 +8113,26 @@ void setup()
     NULL,                                                 // parameter of the task
     1,                                                    // priority of the task
     &xspftask ) ;                                         // Task handle to keep track of created task
+  if ( ini_block.vs_dreq_pin >= 0 )                       // DREQ connected?
+  {
+    attachInterrupt ( ini_block.vs_dreq_pin,              // Yes, wake up playtask on DREQ
+                      isr_dreq, RISING ) ;
+  }
+  if ( ini_block.ingestcore >= 0 )                        // Ingest in its own task?
+  {
+    ctlsem = xSemaphoreCreateRecursiveMutex() ;           // Yes, lock for player state
+    xTaskCreatePinnedToCore (
+      ingesttask,                                         // Task to read stream into mp3ring.
+      "Ingesttask",                                       // name of task.
+      6144,                                               // Stack size of task
+      NULL,                                               // parameter of the task
+      ini_block.ingestprio,                               // priority of the task
+      &xingesttask,                                       // Task handle of the ingest task
+      taskcore ( ini_block.ingestcore ) ) ;               // Run on configured CPU
+  }
+  dbgprint ( "Task layout: ingest core %d prio %d, play core %d prio %d",
+             ini_block.ingestcore, ini_block.ingestprio,
+             ini_block.playcore, ini_block.playprio ) ;
 }
 
 
@@ -3593,6 +8264,7 @@ void writeprefs()
 void handlehttpreply()
 {
   const char*   p ;                                         // Pointer to reply if command
+  char          reply[CQREPLEN] ;                           // Reply to command
   String        sndstr = "" ;                               // String to send
   int           n ;                                         // Number of files on SD card
 
@@ -3621,10 +8293,7 @@ void handlehttpreply()
           sndstr = httpheader ( String ( "text/html" ) ) ;  // Set header
           if ( http_getcmd.startsWith ( "getprefs" ) )      // Is it a "Get preferences"?
           {
-            if ( datamode != STOPPED )                      // Still playing?
-            {
-              setdatamode (  STOPREQD ) ;                   // Stop playing
-            }
+            ctlstop() ;                                     // Stop playing
             sndstr += readprefs ( true ) ;                  // Read and send
           }
           else if ( http_getcmd.startsWith ( "getdefs" ) )  // Is it a "Get default preferences"?
@@ -3638,15 +8307,33 @@ void handlehttpreply()
           }
           else if ( http_getcmd.startsWith ( "mp3list" ) )  // Is is a "Get SD MP3 tracklist"?
           {
-            if ( datamode != STOPPED )                      // Still playing?
-            {
-              setdatamode ( STOPREQD ) ;                    // Stop playing
-            }
+            ctlstop() ;                                     // Stop playing
             cmdclient.print ( sndstr ) ;                    // Yes, send header
             n = listfstracks ( "/", 0, true ) ;             // Handle it
             dbgprint ( "%d tracks on local drive", n ) ;
             return ;                                        // Do not send empty line
           }
+          else if ( ( http_getcmd == "perf" ) ||            // Is it a "Get performance report"?
+                    http_getcmd.startsWith ( "perfjson" ) ) // Other "perf..." go to analyzeCmd
+          {
+            bool json = http_getcmd.startsWith ( "perfjson" ) ; // Yes, as JSON?
+            cmdclient.print ( String ( "HTTP/1.1 200 OK\n"   // Send header, no caching
+                                       "Content-type:" ) +
+                              ( json ? "application/json" : "text/plain" ) +
+                              "\nServer: " NAME "\n"
+                              "Cache-Control: no-cache\n\n" +
+                              perf.report ( json ) + "\n" ) ; // and the report
+            return ;
+          }
+          else if ( http_getcmd.startsWith ( "statsjson" ) ) // Is it a "Get statistics"?
+          {
+            cmdclient.print ( String ( "HTTP/1.1 200 OK\n"   // Yes, send header, no caching
+                                       "Content-type:application/json\n"
+                                       "Server: " NAME "\n"
+                                       "Cache-Control: no-cache\n\n" ) +
+                              stats.json() + "\n" ) ;      // and the statistics
+            return ;
+          }
           else if ( http_getcmd.startsWith ( "settings" ) ) // Is is a "Get settings" (like presets and tone)?
           {
             cmdclient.print ( sndstr ) ;                    // Yes, send header
@@ -3655,7 +8342,8 @@ void handlehttpreply()
           }
           else
           {
-            p = analyzeCmd ( http_getcmd.c_str() ) ;        // Yes, do so
+            p = cmdq.exec ( CQ_HTTP, http_getcmd.c_str(),   // Yes, do so and wait for reply
+                            reply ) ;
             sndstr += String ( p ) ;                        // Content of HTTP response follows the header
           }
           sndstr += String ( "\n" ) ;                       // The HTTP response ends with a blank line
@@ -3776,107 +8464,366 @@ void handlehttp()
 
 
 //**************************************************************************************************
-//                                          X M L P A R S E                                        *
+// iHeartRadio resolver.                                                                           *
 //**************************************************************************************************
-// Parses line with XML data and put result in variable specified by parameter.                    *
+// An "ihr/" preset names a mount.  The stream servers for the mount are found with a request to   *
+// the XML host.  The request is handled by loop() without blocking, the XML reply is parsed byte  *
+// by byte into fixed buffers.  All servers in the reply are kept as candidates, so a failing      *
+// server can be replaced by the next one at once.  Results are cached for IHRTTL seconds.         *
 //**************************************************************************************************
-void xmlparse ( String &line, const char *selstr, String &res )
+#define IHRCACHESIZ 4                                         // Number of cached mounts
+#define IHRCANDS    4                                         // Max. number of servers per mount
+#define IHRTTL      3600                                      // Time to live of an entry in seconds
+#define IHRTIMEOUT  10000                                     // Time-out for the reply in msec
+#define IHRTAGSIZ   24                                        // Max. length of a XML tag name
+#define IHRVALSIZ   48                                        // Max. length of a XML value
+
+struct ihrentry_struct
 {
-  String sel = "</" ;                                  // Will be like "</status-code"
-  int    inx ;                                         // Position of "</..." in line
+  char            mount[32] ;                                 // Mount as in preset, "" if free
+  char            mnt[IHRVALSIZ] ;                            // Mount from reply
+  char            cand[IHRCANDS][24] ;                        // Servers like "1.2.3.4:80"
+  uint8_t         ncand ;                                     // Number of servers
+  uint8_t         cur ;                                       // Server in use
+  uint32_t        expires ;                                   // Time of expiry in millis()
+} ;
 
-  sel += selstr ;                                      // Form searchstring
-  if ( line.endsWith ( sel ) )                         // Is this the line we are looking for?
-  {
-    inx = line.indexOf ( sel ) ;                       // Get position of end tag
-    res = line.substring ( 0, inx ) ;                  // Set result
-  }
+class ihrc
+{
+  private:
+    ihrentry_struct   entry[IHRCACHESIZ] ;                    // The cached mounts
+    int8_t            curx = -1 ;                             // Entry of current station or -1
+    bool              busy = false ;                          // Request in progress
+    bool              hdrdone ;                               // Response headers handled
+    uint32_t          t0 ;                                    // Start time of request
+    netconn           conn ;                                  // Connection to XML host
+    WiFiClient        client ;                                // Client for XML host
+    hdrparser         hp ;                                    // Parser for response headers
+    ihrentry_struct   res ;                                   // Result being built
+    bool              intag ;                                 // Parsing a tag
+    char              tag[IHRTAGSIZ] ;                        // Name of current tag
+    uint8_t           tagx ;                                  // Index in tag
+    bool              tagend ;                                // End of tag name seen
+    char              val[IHRVALSIZ] ;                        // Text before current tag
+    uint8_t           valx ;                                  // Index in val
+    char              ip[16] ;                                // IP of current server
+    bool              portseen ;                              // Port of current server seen
+    int16_t           status ;                                // Status code in reply
+    void              xmlbyte ( char c ) ;                    // Handle next byte of XML reply
+    void              endtag() ;                              // Handle a complete tag
+    void              done() ;                                // Reply complete
+    void              fail() ;                                // Request failed
+    String            url ( int i ) ;                         // Stream URL for entry i
+  public:
+    bool              start ( const String& mount ) ;         // Resolve mount, true if in cache
+    void              abort() ;                               // Cancel request in progress
+    void              loop() ;                                // Handle the request
+    bool              failover() ;                            // Try next server for current station
+} ;
+
+
+//**************************************************************************************************
+//                                           I H R C : : U R L                                     *
+//**************************************************************************************************
+// Give the URL of the current server of entry i.                                                  *
+//**************************************************************************************************
+String ihrc::url ( int i )
+{
+  char tmpstr[80] ;                                           // URL to build
+
+  sprintf ( tmpstr, "%s/%s_SC",                               // Build URL for ESP-Radio to stream
+            entry[i].cand[entry[i].cur],
+            entry[i].mnt ) ;
+  return String ( tmpstr ) ;
 }
 
 
 //**************************************************************************************************
-//                                          X M L G E T H O S T                                    *
+//                                         I H R C : : S T A R T                                   *
 //**************************************************************************************************
-// Parses streams from XML data.                                                                   *
-// Example URL for XML Data Stream:                                                                *
-// http://playerservices.streamtheworld.com/api/livestream?version=1.5&mount=IHR_TRANAAC&lang=en   *
+// Resolve mount.  If it is in the cache, host is set and true is returned.  Otherwise a request   *
+// is started, host will be set and requested by loop() when the reply is complete.               *
 //**************************************************************************************************
-String xmlgethost  ( String mount )
+bool ihrc::start ( const String& mount )
 {
   const char* xmlhost = "playerservices.streamtheworld.com" ;  // XML data source
   const char* xmlget =  "GET /api/livestream"                  // XML get parameters
                         "?version=1.5"                         // API Version of IHeartRadio
                         "&mount=%sAAC"                         // MountPoint with Station Callsign
                         "&lang=en" ;                           // Language
+  char        tmpstr[200] ;                                    // Full GET command
+  int         i ;                                              // Index in entry[]
 
-  String   stationServer = "" ;                     // Radio stream server
-  String   stationPort = "" ;                       // Radio stream port
-  String   stationMount = "" ;                      // Radio stream Callsign
-  uint16_t timeout = 0 ;                            // To detect time-out
-  String   sreply = "" ;                            // Reply from playerservices.streamtheworld.com
-  String   statuscode = "200" ;                     // Assume good reply
-  char     tmpstr[200] ;                            // Full GET command, later stream URL
-  String   urlout ;                                 // Result URL
-
-  stop_mp3client() ; // Stop any current wificlient connections.
+  abort() ;                                                   // Cancel old request
+  for ( i = 0 ; i < IHRCACHESIZ ; i++ )                       // Search in cache
+  {
+    if ( ( strcmp ( entry[i].mount, mount.c_str() ) == 0 ) &&
+         ( (int32_t)( entry[i].expires - millis() ) > 0 ) )
+    {
+      curx = i ;                                              // Found, use it
+      host = url ( i ) ;
+      dbgprint ( "iHeartRadio %s from cache: %s", mount.c_str(), host.c_str() ) ;
+      return true ;
+    }
+  }
   dbgprint ( "Connect to new iHeartRadio host: %s", mount.c_str() ) ;
-  setdatamode ( INIT ) ;                            // Start default in metamode
-  chunked = false ;                                   // Assume not chunked
-  sprintf ( tmpstr, xmlget, mount.c_str() ) ;         // Create a GET commmand for the request
+  memset ( &res, 0, sizeof(res) ) ;                           // Clear result
+  strncpy ( res.mount, mount.c_str(), sizeof(res.mount) - 1 ) ;
+  sprintf ( tmpstr, xmlget, mount.c_str() ) ;                 // Create a GET commmand for the request
   dbgprint ( "%s", tmpstr ) ;
-  if ( mp3client.connect ( xmlhost, 80 ) )            // Connect to XML stream
+  hp.reset() ;                                                // Prepare header parser
+  hdrdone = false ;
+  intag = false ;                                             // Prepare XML parser
+  valx = 0 ;
+  ip[0] = '\0' ;
+  status = 200 ;                                              // Assume good reply
+  conn.start ( xmlhost, 80, String ( tmpstr ) + " HTTP/1.1\r\n"
+               "Host: " + xmlhost + "\r\n"
+               "User-Agent: Mozilla/5.0\r\n"
+               "Connection: close\r\n\r\n" ) ;
+  t0 = millis() ;
+  busy = true ;
+  setdatamode ( STOPPED ) ;                                   // Nothing to play yet
+  return false ;
+}
+
+
+//**************************************************************************************************
+//                                         I H R C : : A B O R T                                   *
+//**************************************************************************************************
+// Cancel a request in progress.                                                                   *
+//**************************************************************************************************
+void ihrc::abort()
+{
+  if ( busy )
+  {
+    conn.abort() ;
+    client.stop() ;
+    busy = false ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                        I H R C : : E N D T A G                                  *
+//**************************************************************************************************
+// A tag is complete.  The text before a closing tag is its value.  The first port of every server *
+// is a candidate.                                                                                 *
+//**************************************************************************************************
+void ihrc::endtag()
+{
+  if ( strcmp ( tag, "server" ) == 0 )                        // Start of a server?
+  {
+    ip[0] = '\0' ;                                            // Yes, no IP and port yet
+    portseen = false ;
+  }
+  if ( tag[0] != '/' )                                        // Closing tag?
+  {
+    return ;                                                  // No, nothing more to do
+  }
+  if ( strcmp ( tag, "/status-code" ) == 0 )
+  {
+    status = atoi ( val ) ;
+  }
+  else if ( strcmp ( tag, "/ip" ) == 0 )
+  {
+    strncpy ( ip, val, sizeof(ip) - 1 ) ;
+    ip[sizeof(ip) - 1] = '\0' ;
+  }
+  else if ( strcmp ( tag, "/port" ) == 0 )
   {
-    dbgprint ( "Connected to %s", xmlhost ) ;
-    mp3client.print ( String ( tmpstr ) + " HTTP/1.1\r\n"
-                      "Host: " + xmlhost + "\r\n"
-                      "User-Agent: Mozilla/5.0\r\n"
-                      "Connection: close\r\n\r\n" ) ;
-    while ( mp3client.available() == 0 )
+    if ( ip[0] && !portseen && ( res.ncand < IHRCANDS ) )     // First port of a new server?
     {
-      delay ( 200 ) ;                                 // Give server some time
-      if ( ++timeout > 25 )                           // No answer in 5 seconds?
-      {
-        dbgprint ( "Client Timeout !" ) ;
-      }
+      snprintf ( res.cand[res.ncand++], sizeof(res.cand[0]),  // Yes, add candidate
+                 "%s:%s", ip, val ) ;
+      portseen = true ;
+    }
+  }
+  else if ( strcmp ( tag, "/mount" ) == 0 )
+  {
+    strcpy ( res.mnt, val ) ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                       I H R C : : X M L B Y T E                                 *
+//**************************************************************************************************
+// Handle the next byte of the XML reply.                                                          *
+//**************************************************************************************************
+void ihrc::xmlbyte ( char c )
+{
+  if ( c == '<' )                                             // Start of a tag?
+  {
+    while ( valx && isspace ( val[valx - 1] ) )               // Yes, remove trailing space
+    {
+      valx-- ;
     }
-    dbgprint ( "XML parser processing..." ) ;
-    while ( mp3client.available() )
+    val[valx] = '\0' ;                                        // Delimit text
+    intag = true ;
+    tagx = 0 ;
+    tagend = false ;
+  }
+  else if ( intag )                                           // In a tag?
+  {
+    if ( c == '>' )                                           // Yes, end of tag?
     {
-      sreply = mp3client.readStringUntil ( '>' ) ;
-      sreply.trim() ;
-      // Search for relevant info in in reply and store in variable
-      xmlparse ( sreply, "status-code", statuscode ) ;
-      xmlparse ( sreply, "ip",          stationServer ) ;
-      xmlparse ( sreply, "port",        stationPort ) ;
-      xmlparse ( sreply, "mount",       stationMount ) ;
-      if ( statuscode != "200" )                      // Good result sofar?
-      {
-        dbgprint ( "Bad xml status-code %s",         // No, show and stop interpreting
-                   statuscode.c_str() ) ;
-        tmpstr[0] = '\0' ;                           // Clear result
-        break ;
-      }
+      tag[tagx] = '\0' ;                                      // Yes, delimit name
+      endtag() ;                                              // and handle it
+      intag = false ;
+      valx = 0 ;                                              // Text starts here
+    }
+    else if ( isspace ( c ) )                                 // End of name?
+    {
+      tagend = true ;                                         // Yes, skip attributes
     }
-    if ( ( stationServer != "" ) &&                   // Check if all station values are stored
-         ( stationPort != "" ) &&
-         ( stationMount != "" ) )
+    else if ( !tagend && ( tagx < ( IHRTAGSIZ - 1 ) ) )       // Add to name
     {
-      sprintf ( tmpstr, "%s:%s/%s_SC",                // Build URL for ESP-Radio to stream.
-                stationServer.c_str(),
-                stationPort.c_str(),
-                stationMount.c_str() ) ;
-      dbgprint ( "Found: %s", tmpstr ) ;
+      tag[tagx++] = c ;
     }
   }
-  else
+  else if ( ( valx < ( IHRVALSIZ - 1 ) ) &&                   // Text, room left?
+            ( valx || !isspace ( c ) ) )                      // Skip leading space
+  {
+    val[valx++] = c ;
+  }
+}
+
+
+//**************************************************************************************************
+//                                          I H R C : : F A I L                                    *
+//**************************************************************************************************
+// The request failed.  It is handed to the stream recovery, that resolves the mount again after a *
+// delay or skips to the next preset after too many failures.                                      *
+//**************************************************************************************************
+void ihrc::fail()
+{
+  abort() ;                                                   // Close connection
+  recovery.fail ( RC_CONNFAIL ) ;                             // Retry or skip station
+}
+
+
+//**************************************************************************************************
+//                                          I H R C : : D O N E                                    *
+//**************************************************************************************************
+// The reply is complete.  Store the result in the cache and request the stream.                   *
+//**************************************************************************************************
+void ihrc::done()
+{
+  int i ;                                                     // Index in entry[]
+  int j = 0 ;                                                 // Entry to replace
+
+  abort() ;                                                   // Close connection
+  if ( ( status != 200 ) || ( res.ncand == 0 ) ||             // Good result?
+       ( res.mnt[0] == '\0' ) )
+  {
+    dbgprint ( "Bad xml reply, status-code %d", status ) ;    // No, show and retry later
+    fail() ;
+    return ;
+  }
+  for ( i = 0 ; i < IHRCACHESIZ ; i++ )                       // Find entry to use
+  {
+    if ( strcmp ( entry[i].mount, res.mount ) == 0 )          // Old entry for this mount?
+    {
+      j = i ;                                                 // Yes, replace it
+      break ;
+    }
+    if ( (int32_t)( entry[i].expires - entry[j].expires ) < 0 ) // Older than best so far?
+    {
+      j = i ;                                                 // Yes, replace the oldest
+    }
+  }
+  res.expires = millis() + IHRTTL * 1000 ;                    // Set expiry time
+  entry[j] = res ;                                            // Store in cache
+  curx = j ;
+  host = url ( j ) ;                                          // Request the stream
+  dbgprint ( "Found: %s, %d servers, %d msec",
+             host.c_str(), res.ncand, millis() - t0 ) ;
+  hostreq = true ;
+}
+
+
+//**************************************************************************************************
+//                                          I H R C : : L O O P                                    *
+//**************************************************************************************************
+// Handle the request.  Called from mp3loop().  Will never block.  A failed connect, a time-out or *
+// a bad reply goes to the stream recovery.                                                        *
+//**************************************************************************************************
+void ihrc::loop()
+{
+  hdrres_t hres ;                                             // Result of header parser
+
+  if ( !busy )                                                // Request in progress?
+  {
+    return ;                                                  // No
+  }
+  if ( ( conn.poll ( client, hdrdone ) == CS_FAILED ) ||      // Next step of connection
+       ( ( millis() - t0 ) > IHRTIMEOUT ) )                   // and check time-out
+  {
+    dbgprint ( "Can't connect to XML host!" ) ;               // Connection failed
+    fail() ;
+    return ;
+  }
+  if ( !hdrdone && ( conn.state != CS_HEADERS ) )             // Request sent?
+  {
+    return ;                                                  // No, wait
+  }
+  while ( client.available() )                                // Handle available data
+  {
+    if ( hdrdone )                                            // Headers handled?
+    {
+      xmlbyte ( client.read() ) ;                             // Yes, XML data
+      continue ;
+    }
+    hres = hp.feed ( client.read() ) ;                        // Feed next byte to the parser
+    if ( hres == HDR_ERROR )                                  // Good reply?
+    {
+      dbgprint ( "Bad reply %d from XML host",                // No, show and retry later
+                 hp.status ) ;
+      fail() ;
+      return ;
+    }
+    if ( hres == HDR_END )                                    // End of headers?
+    {
+      hdrdone = true ;                                        // Yes, XML follows
+      conn.poll ( client, true ) ;                            // Connection is complete
+      dbgprint ( "XML parser processing..." ) ;
+    }
+  }
+  if ( hdrdone && !client.connected() )                       // End of reply?
+  {
+    done() ;                                                  // Yes, handle result
+  }
+}
+
+
+//**************************************************************************************************
+//                                      I H R C : : F A I L O V E R                                *
+//**************************************************************************************************
+// The connection to the current stream server failed.  If there is another candidate for the     *
+// current station, host is set to it and true is returned.  Otherwise the entry is dropped.      *
+//**************************************************************************************************
+bool ihrc::failover()
+{
+  if ( ( curx < 0 ) || ( host != url ( curx ) ) )             // Current station from iHeartRadio?
+  {
+    return false ;                                            // No
+  }
+  if ( ++entry[curx].cur >= entry[curx].ncand )               // Next candidate
   {
-    dbgprint ( "Can't connect to XML host!" ) ;       // Connection failed
-    tmpstr[0] = '\0' ;
+    dbgprint ( "No more servers for %s", entry[curx].mount ) ;
+    entry[curx].mount[0] = '\0' ;                             // All failed, resolve again next time
+    entry[curx].expires = millis() ;
+    curx = -1 ;
+    return false ;
   }
-  mp3client.stop() ;
-  return String ( tmpstr ) ;                          // Return final streaming URL.
+  host = url ( curx ) ;                                       // Try this server
+  dbgprint ( "Failover to %s", host.c_str() ) ;
+  return true ;
 }
 
+ihrc             ihr ;                                        // Resolver for iHeartRadio mounts
+
 
 //**************************************************************************************************
 //                                      H A N D L E S A V E R E Q                                  *
@@ -3900,6 +8847,10 @@ void handleSaveReq()
   nvssetstr ( "tonehf", String ( ini_block.rtone[1] ) ) ; // Save current tonehf
   nvssetstr ( "tonela", String ( ini_block.rtone[2] ) ) ; // Save current tonela
   nvssetstr ( "tonelf", String ( ini_block.rtone[3] ) ) ; // Save current tonelf
+  if ( ini_block.dnssave )                                // DNS cache in NVS?
+  {
+    dnscache.save() ;                                     // Yes, save addresses of presets
+  }
 }
 
 
@@ -3921,6 +8872,26 @@ void handleIpPub()
 }
 
 
+//**************************************************************************************************
+//                                     H A N D L E P E R F P U B                                   *
+//**************************************************************************************************
+// Handle publish of the performance summary to MQTT, every "perfpub" seconds.                     *
+//**************************************************************************************************
+void handlePerfPub()
+{
+  static uint32_t pubtime = 0 ;                            // Time of last publish
+
+  if ( ( ini_block.perfpub == 0 ) || !mqtt_on ||           // Reports wanted?
+       ( ( millis() - pubtime ) < ini_block.perfpub * 1000UL ) ) // and time to publish?
+  {
+    return ;                                               // No
+  }
+  pubtime = millis() ;                                     // Set time of last publish
+  perfsummary = perf.summary() ;                           // Format the report
+  mqttpub.trigger ( MQTT_PERF ) ;                          // Request publish
+}
+
+
 //**************************************************************************************************
 //                                      H A N D L E V O L P U B                                    *
 //**************************************************************************************************
@@ -3976,6 +8947,7 @@ void chk_enc()
   String         tmp ;                                        // Temporary string
   int16_t        inx ;                                        // Position in string
   String         rt = "0" ;                                   // NodeID for random track
+  char           cmdstr[24] ;                                 // Command for the mailbox
 
   if ( enc_menu_mode != VOLUME )                              // In default mode?
   {
@@ -4014,10 +8986,7 @@ void chk_enc()
         enc_nodeID = SD_nodelist.substring ( 0, inx ) ;
       }
       // Stop playing as reading filenames saturates SD I/O.
-      if ( datamode != STOPPED )
-      {
-        setdatamode ( STOPREQD ) ;                            // Request STOP
-      }
+      cmdq.post ( CQ_ENCODER, "stop=1" ) ;                    // Request STOP
     }
   }
   if ( doubleclick )                                          // Handle the doubleclick
@@ -4045,17 +9014,17 @@ void chk_enc()
         {
           tftset ( 3, "Mute" ) ;
         }
-        muteflag = !muteflag ;                                // Mute/unmute
+        cmdq.post ( CQ_ENCODER, "mute" ) ;                    // Mute/unmute
         break ;
       case PRESET :
-        currentpreset = -1 ;                                  // Make sure current is different
-        ini_block.newpreset = enc_preset ;                    // Make a definite choice
+        sprintf ( cmdstr, "preset=%d", enc_preset ) ;         // Make a definite choice
+        cmdq.post ( CQ_ENCODER, cmdstr ) ;
         enc_menu_mode = VOLUME ;                              // Back to default mode
         tftset ( 3, "" ) ;                                    // Clear text
         break ;
       case TRACK :
-        host = enc_filename ;                                 // Selected track as new host
-        hostreq = true ;                                      // Request this host
+        tmp = String ( "mp3track=" ) + enc_nodeID ;           // Selected track as new host
+        cmdq.post ( CQ_ENCODER, tmp.c_str() ) ;
         enc_menu_mode = VOLUME ;                              // Back to default mode
         tftset ( 3, "" ) ;                                    // Clear text
         break ;
@@ -4066,7 +9035,10 @@ void chk_enc()
     dbgprint ( "Long click") ;
     if ( datamode != STOPPED )
     {
-      setdatamode ( STOPREQD ) ;                              // Request STOP, do not touch logclick flag
+      if ( datamode != STOPREQD )                             // Not yet requested?
+      {
+        cmdq.post ( CQ_ENCODER, "stop=1" ) ;                  // Request STOP, keep longclick flag
+      }
     }
     else
     {
@@ -4075,10 +9047,10 @@ void chk_enc()
       if ( get_FS_nodecount() )                               // Tracks on FS?
       {
         dbgprint ( "getFSfilename random choice" ) ;
-        host = getFSfilename ( rt ) ;                         // Get random track
-        hostreq = true ;                                      // Request this host
+        tmp = String ( "mp3track=" ) + rt ;                   // Get random track
+        cmdq.post ( CQ_ENCODER, tmp.c_str() ) ;
       }
-      muteflag = false ;                                      // Be sure muteing is off
+      cmdq.post ( CQ_ENCODER, "upvolume=0" ) ;                // Be sure muteing is off
     }
   }
   if ( rotationcount == 0 )                                   // Any rotation?
@@ -4089,19 +9061,10 @@ void chk_enc()
   switch ( enc_menu_mode )                                    // Which mode (VOLUME, PRESET, TRACK)?
   {
     case VOLUME :
-      if ( ( ini_block.reqvol + rotationcount ) < 0 )         // Limit volume
-      {
-        ini_block.reqvol = 0 ;                                // Limit to normal values
-      }
-      else if ( ( ini_block.reqvol + rotationcount ) > 100 )
-      {
-        ini_block.reqvol = 100 ;                              // Limit to normal values
-      }
-      else
-      {
-        ini_block.reqvol += rotationcount ;
-      }
-      muteflag = false ;                                      // Mute off
+      sprintf ( cmdstr, "%svolume=%d",                        // Volume up/down, also mute off
+                ( rotationcount < 0 ) ? "down" : "up",
+                abs ( rotationcount ) ) ;
+      cmdq.post ( CQ_ENCODER, cmdstr ) ;                      // Spin is summed in rotationcount
       break ;
     case PRESET :
       if ( ( enc_preset + rotationcount ) < 0 )               // Negative not allowed
@@ -4161,8 +9124,36 @@ void mp3loop()
   uint32_t        av = 0 ;                               // Available in stream
   String          nodeID ;                               // Next nodeID of track on SD
   uint32_t        timing ;                               // Startime and duration this function
-  uint32_t        qspace ;                               // Free space in data queue
+  uint32_t        qspace ;                               // Free space in ring buffer
+  uint32_t        cycles ;                               // CPU cycle count at start of parse
+  uint32_t        t0 ;                                   // Start of read section in usec
+  int             n ;                                    // Bytes read in a slice
 
+  if ( mp3conn.state != CS_IDLE )                        // Connection in progress?
+  {
+    if ( mp3conn.poll ( mp3client,                       // Yes, next step
+                        datamode & ( DATA | METADATA |   // Headers handled?
+                                     PLAYLISTDATA |
+                                     STOPREQD | STOPPED ) ) == CS_FAILED )
+    {
+      dbgprint ( "Request %s failed!", host.c_str() ) ;
+      mp3conn.abort() ;                                  // Back to idle
+      if ( ihr.failover() )                              // Other server for this station?
+      {
+        connecttohost() ;                                // Yes, try it at once
+      }
+      else
+      {
+        recovery.fail ( RC_CONNFAIL ) ;                  // No, retry later
+      }
+    }
+  }
+  standby_loop() ;                                       // Maintain standby connections
+  hls.loop() ;                                           // Handle HLS segments and reloads
+  ihr.loop() ;                                           // Handle iHeartRadio request
+  recovery.loop() ;                                      // Watch the stream for failures
+  ratectl.loop ( mp3ring.fill() +                        // Watch fill for clock drift
+                 ( localfile ? 0 : mp3client.available() ) ) ;
   // Try to keep the Queue to playtask filled up by adding as much bytes as possible
   if ( datamode & ( INIT | HEADER | DATA |               // Test op playing
                     METADATA | PLAYLISTINIT |
@@ -4170,9 +9161,9 @@ void mp3loop()
                     PLAYLISTDATA ) )
   {
     timing = millis() ;                                  // Start time this function
+    t0 = micros() ;                                      // Same in usec for statistics
     maxchunk = sizeof(tmpbuff) ;                         // Reduce byte count for this mp3loop()
-    qspace = uxQueueSpacesAvailable( dataqueue ) *       // Compute free space in data queue
-             sizeof(qdata_struct) ;
+    qspace = mp3ring.space() ;                           // Compute free space in ring buffer
     if ( localfile )                                     // Playing file from SD card or USB drive?
     {
       av = mp3filelength ;                               // Bytes left in file
@@ -4187,7 +9178,17 @@ void mp3loop()
       if ( maxchunk )                                    // Anything to read?
       {
         claimSPI ( "fsread" ) ;                          // Claim SPI bus
-        res = read_FS ( tmpbuff, maxchunk ) ;            // Read a block of data
+        while ( res < (int)maxchunk )                    // Read in slices
+        {
+          n = read_FS ( tmpbuff + res,                   // Read a slice of data
+                        min ( maxchunk - res, (uint32_t)FSSLICE ) ) ;
+          if ( n <= 0 )                                  // End of file or error?
+          {
+            break ;                                      // Yes, stop
+          }
+          res += n ;
+          spiarb.yield() ;                               // Let VS1053 go first if it waits
+        }
         releaseSPI() ;                                   // Release SPI bus
         mp3filelength -= res ;                           // Number of bytes left
       }
@@ -4207,22 +9208,28 @@ void mp3loop()
       {
         res = mp3client.read ( tmpbuff, maxchunk ) ;     // Read a number of bytes from the stream
       }
-    }
-    if ( maxchunk == 0 )
-    {
-      if ( datamode == PLAYLISTDATA )                    // End of playlist
+      if ( ( res > 0 ) ||                                // Data from stream?
+           ( qspace < sizeof(tmpbuff) ) )                // Or enough buffered anyway?
       {
-        playlist_num = 1 ;                               // Yes, restart playlist
-        dbgprint ( "End of playlist seen" ) ;
-        setdatamode ( STOPPED ) ;
-        ini_block.newpreset++ ;                          // Go to next preset
+        recovery.rxdata() ;                              // Yes, not stalled
       }
     }
-    for ( int i = 0 ; i < res ; i++ )
+    if ( ( maxchunk == 0 ) &&                            // Nothing to read
+         ( datamode == PLAYLISTDATA ) &&                 // from playlist?
+         ( localfile || !mp3client.connected() ) )       // And end of playlist reached?
+    {
+      playlist_ready() ;                                 // Yes, play from index
+    }
+    if ( res > 0 )                                       // Anything read?
     {
-      handlebyte_ch ( tmpbuff[i] ) ;                     // Handle one byte
+      stats.ingested += res ;                            // Count for statistics
+      cycles = ESP.getCycleCount() ;                     // Yes, measure parser load
+      handledata_ch ( tmpbuff, res ) ;                   // Handle the block of data
+      parsecycles += ESP.getCycleCount() - cycles ;      // Update statistics
+      parsebytes += res ;
     }
     timing = millis() - timing ;                         // Duration this function
+    stats.loopdur ( micros() - t0 ) ;                    // Add to histogram
     if ( timing > max_mp3loop_time )                     // New maximum found?
     {
       max_mp3loop_time = timing ;                        // Yes, set new maximum
@@ -4232,6 +9239,7 @@ void mp3loop()
   if ( datamode == STOPREQD )                            // STOP requested?
   {
     dbgprint ( "STOP requested" ) ;
+    hls.stop() ;                                         // Stop HLS session if any
     if ( localfile )
     {
       claimSPI ( "close" ) ;                             // Claim SPI bus
@@ -4244,8 +9252,8 @@ void mp3loop()
     }
     chunked = false ;                                    // Not longer chunked
     datacount = 0 ;                                      // Reset datacount
-    outqp = outchunk.buf ;                               // and pointer
-    queuefunc ( QSTOPSONG ) ;                            // Queue a request to stop the song
+    queuefunc ( stopdrain ? QENDSONG : QSTOPSONG ) ;     // Queue a request to stop the song
+    stopdrain = false ;
     metaint = 0 ;                                        // No metaint known now
     setdatamode ( STOPPED ) ;                            // Yes, state becomes STOPPED
     return ;
@@ -4265,6 +9273,7 @@ void mp3loop()
         }
         else
         {
+          stopdrain = true ;                             // Play the rest of the file
           nodeID = selectnextFSnode ( +1 ) ;             // Select the next file on SD/USB
           host = getFSfilename ( nodeID ) ;
         }
@@ -4285,6 +9294,7 @@ void mp3loop()
         playlist_num += ini_block.newpreset -
                         currentpreset ;                   // Next entry in playlist
         ini_block.newpreset = currentpreset ;             // Stay at current preset
+        host = playlist ;                                 // Entry will be taken from index
       }
       else
       {
@@ -4311,7 +9321,14 @@ void mp3loop()
     currentpreset = ini_block.newpreset ;                 // Remember current preset
     mqttpub.trigger ( MQTT_PRESET ) ;                     // Request publishing to MQTT
     // Find out if this URL is on localhost (SD).
+    ihr.abort() ;                                         // Cancel iHeartRadio request if any
+    recovery.newhost() ;                                  // Reconnect or other station
     localfile = ( host.indexOf ( "localhost/" ) >= 0 ) ;
+    if ( playlist_num && plindex.valid ( host ) )         // Entry of an indexed playlist?
+    {
+      playlist_play() ;                                   // Yes, no need to read the playlist
+      return ;
+    }
     if ( localfile )                                      // Play file from localhost?
     {
       if ( ! connecttofile() )                            // Yes, open mp3-file
@@ -4323,10 +9340,16 @@ void mp3loop()
     {
       if ( host.startsWith ( "ihr/" ) )                   // iHeartRadio station requested?
       {
-        host = host.substring ( 4 ) ;                     // Yes, remove "ihr/"
-        host = xmlgethost ( host ) ;                      // Parse the xml to get the host
+        stop_mp3client() ;                                // Yes, stop current station
+        if ( !ihr.start ( host.substring ( 4 ) ) )        // Mount in cache?
+        {
+          return ;                                        // No, host will be requested by ihr
+        }
+      }
+      if ( !standby_take() )                              // Warm standby for this host?
+      {
+        connecttohost() ;                                 // No, switch to new host
       }
-      connecttohost() ;                                   // Switch to new host
     }
   }
 }
@@ -4339,9 +9362,17 @@ void mp3loop()
 //**************************************************************************************************
 void loop()
 {
-  mp3loop() ;                                       // Do mp3 related actions
+  uint32_t t0 ;                                     // Start of mp3loop() in usec
+
+  if ( !xingesttask )                               // No separate ingest task?
+  {
+    t0 = micros() ;
+    mp3loop() ;                                     // Do mp3 related actions
+    perf.add ( PF_MP3LOOP, micros() - t0 ) ;
+  }
   if ( updatereq )                                  // Software update requested?
   {
+    ctllock() ;                                     // Stream will be used for update
     if ( displaytype == T_NEXTION )                 // NEXTION in use?
     { 
       update_software ( "lstmodn",                  // Yes, update NEXTION image from remote image
@@ -4350,6 +9381,7 @@ void loop()
     update_software ( "lstmods",                    // Update sketch from remote file
                       UPDATEHOST, BINFILE ) ;
     resetreq = true ;                               // And reset
+    ctlunlock() ;
   }
   if ( resetreq )                                   // Reset requested?
   {
@@ -4361,71 +9393,232 @@ void loop()
   scandigital() ;                                   // Scan digital inputs
   scanIR() ;                                        // See if IR input
   ArduinoOTA.handle() ;                             // Check for OTA
-  mp3loop() ;                                       // Do more mp3 related actions
-  handlehttpreply() ;
+  if ( !xingesttask )                               // No separate ingest task?
+  {
+    t0 = micros() ;
+    mp3loop() ;                                     // Do more mp3 related actions
+    perf.add ( PF_MP3LOOP, micros() - t0 ) ;
+  }
+  handlehttpreply() ;                               // Locks only to change player state
   cmdclient = cmdserver.available() ;               // Check Input from client?
   if ( cmdclient )                                  // Client connected?
   {
     dbgprint ( "Command client available" ) ;
     handlehttp() ;
   }
-  // Handle MQTT.
-  if ( mqtt_on )
+  // Handle MQTT.
+  if ( mqtt_on )
+  {
+    mqttclient.loop() ;                             // Handling of MQTT connection
+  }
+  handleSaveReq() ;                                 // See if time to save settings
+  handleIpPub() ;                                   // See if time to publish IP
+  handleVolPub() ;                                  // See if time to publish volume
+  handlePerfPub() ;                                 // See if time to publish performance
+  chk_enc() ;                                       // Check rotary encoder functions
+  cmdq.run() ;                                      // Execute commands of all inputs
+  check_CH376() ;                                   // Check Flashdrive insert/remove
+}
+
+
+//**************************************************************************************************
+//                                       R E S O L V E U R L                                       *
+//**************************************************************************************************
+// Resolve a location from a redirect or a playlist against the URL it came from.  The result is   *
+// an URL without scheme, like "host:port/path".  Https is tried as http.                          *
+//**************************************************************************************************
+String resolveurl ( const String& base, const char* loc )
+{
+  String res ;                                           // Result
+  int    inx ;                                           // Position of "/" in base
+
+  if ( strncasecmp ( loc, "https://", 8 ) == 0 )         // Secure connection?
+  {
+    dbgprint ( "No https support, try http" ) ;          // Yes, try http
+    res = String ( loc + 8 ) ;
+  }
+  else if ( strncasecmp ( loc, "http://", 7 ) == 0 )     // Absolute URL?
+  {
+    res = String ( loc + 7 ) ;                           // Yes, new URL without "http://"
+  }
+  else if ( strncmp ( loc, "//", 2 ) == 0 )              // Same scheme, other host?
+  {
+    res = String ( loc + 2 ) ;
+  }
+  else if ( *loc == '/' )                                // Absolute path on this host?
+  {
+    res = base ;
+    inx = res.indexOf ( "/" ) ;                          // Yes, find begin of path
+    if ( inx >= 0 )
+    {
+      res = res.substring ( 0, inx ) ;                   // Remove old path
+    }
+    res += loc ;                                         // Add new path
+  }
+  else                                                   // Path relative to current one
+  {
+    res = base ;
+    inx = res.lastIndexOf ( "/" ) ;                      // Find last part of path
+    if ( inx >= 0 )
+    {
+      res = res.substring ( 0, inx ) ;                   // Remove last part
+    }
+    res += "/" ;
+    res += loc ;                                         // Add new part
+  }
+  return res ;
+}
+
+
+//**************************************************************************************************
+//                                         R E D I R E C T                                         *
+//**************************************************************************************************
+// Handle a redirect from the server.  The location may be an absolute URL or relative to the     *
+// current host.  https is not supported, the same URL is tried with http.                         *
+// The number of successive redirects is limited to MAXREDIRECT.                                   *
+//**************************************************************************************************
+void redirect ( const char* loc )
+{
+  if ( ++redirectcount > MAXREDIRECT )                   // Too many redirects?
+  {
+    dbgprint ( "Too many redirects!" ) ;                 // Yes, give up
+    redirectcount = 0 ;
+    setdatamode ( STOPREQD ) ;
+    return ;
+  }
+  host = resolveurl ( host, loc ) ;                      // New URL
+  dbgprint ( "Redirect %d to %s", redirectcount, host.c_str() ) ;
+  setdatamode ( STOPPED ) ;                              // Ignore rest of this response
+  hostreq = true ;                                       // And request the new host
+}
+
+
+//**************************************************************************************************
+//                                         S T A R T D A T A                                       *
+//**************************************************************************************************
+// The response headers of the stream are handled, the results are in hdrp.  Switch to DATA mode   *
+// and start the song.                                                                             *
+//**************************************************************************************************
+void startdata()
+{
+  metaint = hdrp.metaint ;                             // Copy results of header parser
+  bitrate = hdrp.bitrate ;
+  audiotype = hdrp.ctype ;
+  if ( hdrp.chunked )                                  // Station provides chunked transfer?
+  {
+    chunked = true ;                                   // Remember chunked transfer mode
+    chunkcount = 0 ;                                   // Expect chunkcount in DATA
+  }
+  if ( hdrp.icyname[0] )                               // Station name seen?
+  {
+    icyname = String ( hdrp.icyname ) ;                // Yes, get station name
+    tftset ( 2, icyname ) ;                            // Set screen segment bottom part
+    mqttpub.trigger ( MQTT_ICYNAME ) ;                 // Request publishing to MQTT
+  }
+  dbgprint ( "Switch to DATA, bitrate is %d"           // Show bitrate
+             ", metaint is %d, after %d msec",         // metaint and time since connect
+             bitrate, metaint, millis() - connectstart ) ;
+  redirectcount = 0 ;                                  // Final host reached
+  setdatamode ( DATA ) ;                               // Expecting data now
+  datacount = metaint ;                                // Number of bytes before first metadata
+  audioscan_reset ( audiotype ) ;                      // Scan for frames or pages
+  recovery.rxdata() ;                                  // Stream is alive
+  if ( recovery.resuming )                             // Reconnect after a failure?
+  {
+    recovery.resuming = false ;                        // Yes, continue the current song
+    dbgprint ( "Resume stream" ) ;
+  }
+  else
   {
-    mqttclient.loop() ;                             // Handling of MQTT connection
+    ratectl.reset() ;                                  // New stream, normal rate
+    queuefunc ( QSTARTSONG ) ;                         // Queue a request to start song
   }
-  handleSaveReq() ;                                 // See if time to save settings
-  handleIpPub() ;                                   // See if time to publish IP
-  handleVolPub() ;                                  // See if time to publish volume
-  chk_enc() ;                                       // Check rotary encoder functions
-  check_CH376() ;                                   // Check Flashdrive insert/remove
 }
 
 
 //**************************************************************************************************
-//                                    C H K H D R L I N E                                          *
+//                                       Q U E U E D A T A                                         *
 //**************************************************************************************************
-// Check if a line in the header is a reasonable headerline.                                       *
-// Normally it should contain something like "icy-xxxx:abcdef".                                    *
+// Copy a run of audio data to the ring buffer for the playtask.                                   *
+// If the data cannot be placed within 200 ticks, the ring is full, while the sender tries to send *
+// more.  The rest of the data will be discarded in that case.                                     *
 //**************************************************************************************************
-bool chkhdrline ( const char* str )
+void queuedata ( const uint8_t* p, int len )
 {
-  char    b ;                                         // Byte examined
-  int     len = 0 ;                                   // Lengte van de string
+  int n ;                                                // Number of bytes stored
+  int tries = 200 ;                                      // Number of ticks to wait for space
 
-  while ( ( b = *str++ ) )                            // Search to end of string
+  while ( len > 0 )
   {
-    len++ ;                                           // Update string length
-    if ( ! isalpha ( b ) )                            // Alpha (a-z, A-Z)
+    n = mp3ring.write ( p, len ) ;                       // Store as much as possible
+    audioscan ( p, n ) ;                                 // Look for frames or pages in stored part
+    xTaskNotifyGive ( xplaytask ) ;                      // Wake up playtask
+    p += n ;
+    len -= n ;
+    if ( len && ( tries-- == 0 ) )                       // Still data left after time-out?
     {
-      if ( b != '-' )                                 // Minus sign is allowed
-      {
-        if ( b == ':' )                               // Found a colon?
-        {
-          return ( ( len > 5 ) && ( len < 50 ) ) ;    // Yes, okay if length is okay
-        }
-        else
-        {
-          return false ;                              // Not a legal character
-        }
-      }
+      break ;                                            // Yes, discard the rest
+    }
+    if ( len )                                           // Ring full?
+    {
+      vTaskDelay ( 1 ) ;                                 // Yes, wait for playtask
     }
   }
-  return false ;                                      // End of string without colon
 }
 
 
 //**************************************************************************************************
-//                            S C A N _ C O N T E N T _ L E N G T H                                *
+//                                   H A N D L E D A T A _ C H                                     *
 //**************************************************************************************************
-// If the line contains content-length information: set clength (content length counter).          *
+// Handle a block of data from server or local file.                                               *
+// In DATA mode the audio is copied in runs up to the next chunk or metadata boundary.  Headers,   *
+// chunk sizes, metadata and playlists are handled byte by byte by handlebyte_ch().                *
 //**************************************************************************************************
-void scan_content_length ( const char* metalinebf )
+void handledata_ch ( uint8_t* p, int len )
 {
-  if ( strstr ( metalinebf, "Content-Length" ) )        // Line contains content length
+  int run ;                                              // Number of audio bytes in this run
+
+  while ( len > 0 )
   {
-    clength = atoi ( metalinebf + 15 ) ;                // Yes, set clength
-    dbgprint ( "Content-Length is %d", clength ) ;      // Show for debugging purposes
+    if ( ( datamode != DATA ) ||                         // Byte level handling required?
+         ( chunked && ( chunkcount == 0 ) ) )            // Chunk size expected?
+    {
+      handlebyte_ch ( *p++ ) ;                           // Yes, handle one byte
+      len-- ;
+      continue ;
+    }
+    run = len ;                                          // Assume the rest is audio
+    if ( chunked && ( run > chunkcount ) )               // Limit to end of chunk
+    {
+      run = chunkcount ;
+    }
+    if ( metaint && ( run > datacount ) )                // Limit to start of metadata
+    {
+      run = datacount ;
+    }
+    if ( hls.active )                                    // HLS segment?
+    {
+      hls.ts.feed ( p, run ) ;                           // Yes, demultiplex
+    }
+    else
+    {
+      queuedata ( p, run ) ;                             // Send the run to the playtask
+    }
+    p += run ;
+    len -= run ;
+    if ( chunked )
+    {
+      chunkcount -= run ;                                // Update count to next chunksize block
+    }
+    if ( metaint )                                       // No METADATA on Ogg streams or mp3 files
+    {
+      datacount -= run ;
+      if ( datacount == 0 )                              // End of datablock?
+      {
+        setdatamode ( METADATA ) ;
+        metalinebfx = -1 ;                               // Expecting first metabyte (counter)
+      }
+    }
   }
 }
 
@@ -4439,9 +9632,7 @@ void scan_content_length ( const char* metalinebf )
 void handlebyte_ch ( uint8_t b )
 {
   static int       chunksize = 0 ;                      // Chunkcount read from stream
-  static uint16_t  playlistcnt ;                        // Counter to find right entry in playlist
-  static int       LFcount ;                            // Detection of end of header
-  static bool      ctseen = false ;                     // First line of header seen or not
+  hdrres_t         hres ;                               // Result of header parser
 
   if ( chunked &&
        ( datamode & ( DATA |                           // Test op DATA handling
@@ -4473,14 +9664,13 @@ void handlebyte_ch ( uint8_t b )
   }
   if ( datamode == DATA )                              // Handle next byte of MP3/Ogg data
   {
-    *outqp++ = b ;
-    if ( outqp == ( outchunk.buf + sizeof(outchunk.buf) ) ) // Buffer full?
+    if ( hls.active )                                  // HLS segment?
+    {
+      hls.ts.feed ( &b, 1 ) ;                          // Yes, demultiplex
+    }
+    else
     {
-      // Send data to playtask queue.  If the buffer cannot be placed within 200 ticks,
-      // the queue is full, while the sender tries to send more.  The chunk will be dis-
-      // carded it that case.
-      xQueueSend ( dataqueue, &outchunk, 200 ) ;       // Send to queue
-      outqp = outchunk.buf ;                           // Item empty now
+      queuedata ( &b, 1 ) ;                            // Normally handled by handledata_ch()
     }
     if ( metaint )                                     // No METADATA on Ogg streams or mp3 files
     {
@@ -4494,10 +9684,10 @@ void handlebyte_ch ( uint8_t b )
   }
   if ( datamode == INIT )                              // Initialize for header receive
   {
-    ctseen = false ;                                   // Contents type not seen yet
+    hdrp.reset() ;                                     // Prepare header parser
     metaint = 0 ;                                      // No metaint found
-    LFcount = 0 ;                                      // For detection end of header
     bitrate = 0 ;                                      // Bitrate still unknown
+    audiotype = AU_UNKNOWN ;                           // Type of audio still unknown
     dbgprint ( "Switch to HEADER" ) ;
     setdatamode ( HEADER ) ;                           // Handle header
     totalcount = 0 ;                                   // Reset totalcount
@@ -4506,83 +9696,24 @@ void handlebyte_ch ( uint8_t b )
   }
   if ( datamode == HEADER )                            // Handle next byte of MP3 header
   {
-    if ( ( b > 0x7F ) ||                               // Ignore unprintable characters
-         ( b == '\r' ) ||                              // Ignore CR
-         ( b == '\0' ) )                               // Ignore NULL
+    hres = hdrp.feed ( b ) ;                           // Feed to the header parser
+    if ( hres == HDR_ERROR )                           // Error reply from server?
     {
-      // Yes, ignore
+      dbgprint ( "HTTP error %d from server",          // Yes, do not play this
+                 hdrp.status ) ;
+      redirectcount = 0 ;
+      setdatamode ( STOPREQD ) ;
     }
-    else if ( b == '\n' )                              // Linefeed ?
+    else if ( hres == HDR_END )                        // End of header?
     {
-      LFcount++ ;                                      // Count linefeeds
-      metalinebf[metalinebfx] = '\0' ;                 // Take care of delimiter
-      if ( chkhdrline ( metalinebf ) )                 // Reasonable input?
-      {
-        dbgprint ( "Headerline: %s",                   // Show headerline
-                   metalinebf ) ;
-        String metaline = String ( metalinebf ) ;      // Convert to string
-        String lcml = metaline ;                       // Use lower case for compare
-        lcml.toLowerCase() ;
-        if ( lcml.startsWith ( "location: http://" ) ) // Redirection?
-        {
-          host = metaline.substring ( 17 ) ;           // Yes, get new URL
-          hostreq = true ;                             // And request this one
-        }
-        if ( lcml.indexOf ( "content-type" ) >= 0)     // Line with "Content-Type: xxxx/yyy"
-        {
-          ctseen = true ;                              // Yes, remember seeing this
-          String ct = metaline.substring ( 13 ) ;      // Set contentstype. Not used yet
-          ct.trim() ;
-          dbgprint ( "%s seen.", ct.c_str() ) ;
-        }
-        if ( lcml.startsWith ( "icy-br:" ) )
-        {
-          bitrate = metaline.substring(7).toInt() ;    // Found bitrate tag, read the bitrate
-          if ( bitrate == 0 )                          // For Ogg br is like "Quality 2"
-          {
-            bitrate = 87 ;                             // Dummy bitrate
-          }
-        }
-        else if ( lcml.startsWith ("icy-metaint:" ) )
-        {
-          metaint = metaline.substring(12).toInt() ;   // Found metaint tag, read the value
-        }
-        else if ( lcml.startsWith ( "icy-name:" ) )
-        {
-          icyname = metaline.substring(9) ;            // Get station name
-          icyname.trim() ;                             // Remove leading and trailing spaces
-          tftset ( 2, icyname ) ;                      // Set screen segment bottom part
-          mqttpub.trigger ( MQTT_ICYNAME ) ;           // Request publishing to MQTT
-        }
-        else if ( lcml.startsWith ( "transfer-encoding:" ) )
-        {
-          // Station provides chunked transfer
-          if ( lcml.endsWith ( "chunked" ) )
-          {
-            chunked = true ;                           // Remember chunked transfer mode
-            chunkcount = 0 ;                           // Expect chunkcount in DATA
-          }
-        }
-      }
-      metalinebfx = 0 ;                                // Reset this line
-      if ( ( LFcount == 2 ) && ctseen )                // Content type seen and a double LF?
+      if ( hdrp.redirected() )                         // Redirection?
       {
-        dbgprint ( "Switch to DATA, bitrate is %d"     // Show bitrate
-                   ", metaint is %d",                  // and metaint
-                   bitrate, metaint ) ;
-        setdatamode ( DATA ) ;                         // Expecting data now
-        datacount = metaint ;                          // Number of bytes before first metadata
-        queuefunc ( QSTARTSONG ) ;                     // Queue a request to start song
+        redirect ( hdrp.location ) ;                   // Yes, request new URL
       }
-    }
-    else
-    {
-      metalinebf[metalinebfx++] = (char)b ;            // Normal character, put new char in metaline
-      if ( metalinebfx >= METASIZ )                    // Prevent overflow
+      else if ( hdrp.ctseen )                          // Content type seen?
       {
-        metalinebfx-- ;
+        startdata() ;                                  // Yes, start playing
       }
-      LFcount = 0 ;                                    // Reset double CRLF detection
     }
     return ;
   }
@@ -4634,7 +9765,6 @@ void handlebyte_ch ( uint8_t b )
     // We are going to use metadata to read the lines from the .m3u file
     // Sometimes this will only contain a single line
     metalinebfx = 0 ;                                  // Prepare for new line
-    LFcount = 0 ;                                      // For detection end of header
     if ( localfile )                                   // SD-card mode?
     {
       setdatamode ( PLAYLISTDATA ) ;                   // Yes, no header here
@@ -4643,46 +9773,35 @@ void handlebyte_ch ( uint8_t b )
     {
       setdatamode ( PLAYLISTHEADER ) ;                 // Handle playlist header
     }
-    playlistcnt = 1 ;                                  // Reset for compare
+    plindex.reset ( playlist ) ;                       // Start a new index
     totalcount = 0 ;                                   // Reset totalcount
     clength = 0xFFFFFFFF ;                             // Content-length unknown
+    hdrp.reset() ;                                     // Prepare header parser
     dbgprint ( "Read from playlist" ) ;
   }
   if ( datamode == PLAYLISTHEADER )                    // Read header
   {
-    if ( ( b > 0x7F ) ||                               // Ignore unprintable characters
-         ( b == '\r' ) ||                              // Ignore CR
-         ( b == '\0' ) )                               // Ignore NULL
+    hres = hdrp.feed ( b ) ;                           // Feed to the header parser
+    if ( hres == HDR_ERROR )                           // Error reply from server?
     {
-      return ;                                         // Quick return
+      dbgprint ( "HTTP error %d for playlist",         // Yes, stop
+                 hdrp.status ) ;
+      redirectcount = 0 ;
+      setdatamode ( STOPREQD ) ;
     }
-    else if ( b == '\n' )                              // Linefeed ?
+    else if ( hres == HDR_END )                        // End of header?
     {
-      LFcount++ ;                                      // Count linefeeds
-      metalinebf[metalinebfx] = '\0' ;                 // Take care of delimeter
-      dbgprint ( "Playlistheader: %s",                 // Show playlistheader
-                 metalinebf ) ;
-      scan_content_length ( metalinebf ) ;             // Check if it is a content-length line
-      metalinebfx = 0 ;                                // Ready for next line
-      if ( LFcount == 2 )
-      {
-        dbgprint ( "Switch to PLAYLISTDATA, "          // For debug
-                   "search for entry %d",
-                   playlist_num ) ;
-        setdatamode ( PLAYLISTDATA ) ;                 // Expecting data now
-        mqttpub.trigger ( MQTT_PLAYLISTPOS ) ;         // Playlistposition to MQTT
-        return ;
-      }
-    }
-    else
-    {
-      metalinebf[metalinebfx++] = (char)b ;            // Normal character, put new char in metaline
-      if ( metalinebfx >= METASIZ )                    // Prevent overflow
+      if ( hdrp.redirected() )                         // Redirection?
       {
-        metalinebfx-- ;
+        redirect ( hdrp.location ) ;                   // Yes, request new URL
+        return ;
       }
-      LFcount = 0 ;                                    // Reset double CRLF detection
+      clength = hdrp.clength ;                         // Content length of playlist
+      dbgprint ( "Switch to PLAYLISTDATA" ) ;          // For debug
+      redirectcount = 0 ;                              // Final host reached
+      setdatamode ( PLAYLISTDATA ) ;                   // Expecting data now
     }
+    return ;
   }
   if ( datamode == PLAYLISTDATA )                      // Read next byte of .m3u file data
   {
@@ -4693,7 +9812,7 @@ void handlebyte_ch ( uint8_t b )
     {
       // Yes, ignore
     }
-    if ( b != '\n' )                                   // Linefeed?
+    else if ( b != '\n' )                              // Linefeed?
     { // No, normal character in playlistdata,
       metalinebf[metalinebfx++] = (char)b ;            // add it to metaline
       if ( metalinebfx >= METASIZ )                    // Prevent overflow
@@ -4704,67 +9823,15 @@ void handlebyte_ch ( uint8_t b )
     if ( ( b == '\n' ) ||                              // linefeed ?
          ( clength == 0 ) )                            // Or end of playlist data contents
     {
-      int inx ;                                        // Pointer in metaline
       metalinebf[metalinebfx] = '\0' ;                 // Take care of delimeter
       dbgprint ( "Playlistdata: %s",                   // Show playlistheader
                  metalinebf ) ;
-      if ( strlen ( metalinebf ) < 5 )                 // Skip short lines
-      {
-        metalinebfx = 0 ;                              // Flush line
-        metalinebf[0] = '\0' ;
-        return ;
-      }
-      String metaline = String ( metalinebf ) ;        // Convert to string
-      if ( metaline.indexOf ( "#EXTINF:" ) >= 0 )      // Info?
-      {
-        if ( playlist_num == playlistcnt )             // Info for this entry?
-        {
-          inx = metaline.indexOf ( "," ) ;             // Comma in this line?
-          if ( inx > 0 )
-          {
-            // Show artist and title if present in metadata
-            showstreamtitle ( metaline.substring ( inx + 1 ).c_str(), true ) ;
-            mqttpub.trigger ( MQTT_STREAMTITLE ) ;     // Request publishing to MQTT
-          }
-        }
-      }
-      if ( metaline.startsWith ( "#" ) )               // Commentline?
-      {
-        metalinebfx = 0 ;                              // Yes, ignore
-        return ;                                       // Ignore commentlines
-      }
-      // Now we have an URL for a .mp3 file or stream.  Is it the rigth one?
-      dbgprint ( "Entry %d in playlist found: %s", playlistcnt, metalinebf ) ;
-      if ( playlist_num == playlistcnt  )
+      plindex.addline ( metalinebf ) ;                 // Add to the index
+      metalinebfx = 0 ;                                // Prepare for next line
+      if ( clength == 0 )                              // End of playlist?
       {
-        inx = metaline.indexOf ( "http://" ) ;         // Search for "http://"
-        if ( inx >= 0 )                                // Does URL contain "http://"?
-        {
-          host = metaline.substring ( inx + 7 ) ;      // Yes, remove it and set host
-        }
-        else
-        {
-          host = metaline ;                            // Yes, set new host
-        }
-        if ( localfile )                               // SD card mode?
-        {
-          if ( ! metaline.startsWith ( "localhost" ) ) // Prepend "localhost" if missing
-          {
-            host = String ( "localhost/" ) + metaline ;
-          }
-          if ( ! connecttofile() )                     // Yes, connect to file
-          {
-            setdatamode ( STOPPED ) ;                  // Error, stop!
-          }
-        }
-        else
-        {
-          connecttohost() ;                           // Connect to stream host
-        }
+        playlist_ready() ;                             // Yes, play from index
       }
-      metalinebfx = 0 ;                                // Prepare for next line
-      host = playlist ;                                // Back to the .m3u host
-      playlistcnt++ ;                                  // Next entry in playlist
     }
   }
 }
@@ -4910,12 +9977,14 @@ void chomp ( String &str )
 //**************************************************************************************************
 // Handling of the various commands from remote webclient, Serial or MQTT.                         *
 // Version for handling string with: <parameter>=<value>                                           *
+// Called by the command mailbox, the inputs post their commands to cmdq.                          *
 //**************************************************************************************************
 const char* analyzeCmd ( const char* str )
 {
   char*        value ;                           // Points to value after equalsign in command
   const char*  res ;                             // Result of analyzeCmd
 
+  ctllock() ;                                    // Command may change player state
   value = strstr ( str, "=" ) ;                  // See if command contains a "="
   if ( value )
   {
@@ -4927,6 +9996,7 @@ const char* analyzeCmd ( const char* str )
   {
     res = analyzeCmd ( str, "0" ) ;              // No value, assume zero
   }
+  ctlunlock() ;
   return res ;
 }
 
@@ -4951,6 +10021,7 @@ const char* analyzeCmd ( const char* str )
 //   station    = <URL>.mp3                 // Play standalone .mp3 file (not saved)               *
 //   station    = <URL>.m3u                 // Select playlist (will not be saved)                 *
 //   stop                                   // Stop playing                                        *
+//   stop       = 1                         // Stop playing, do not resume if already stopped      *
 //   resume                                 // Resume playing                                      *
 //   mute                                   // Mute/unmute the music (toggle)                      *
 //   wifi_00    = mySSID/mypassword         // Set WiFi SSID and password *)                       *
@@ -4971,6 +10042,18 @@ const char* analyzeCmd ( const char* str )
 //   bat0       = 2318                      // ADC value for an empty battery                      *
 //   bat100     = 2916                      // ADC value for a fully charged battery               *
 //   fs         = USB or SD                 // Select local filesystem for MP# player mode.        *
+//   prebuffer  = 1000                      // Msec of data buffered before playing starts         *
+//   lowbuffer  = 200                       // Pause and rebuffer if less msec of data left        *
+//   dnssave    = 0 or 1                    // Save DNS cache for current and adjacent presets     *
+//   standby    = 0, 1 or 2                 // Standby connections: off, next or next and previous *
+//   rcretries  = 5                         // Reconnects before a station is skipped              *
+//   ratectl    = 0 or 1                    // Automatic rate control for clock drift              *
+//   fastzap    = 0 or 1                    // Fast cancel of the song on a station switch         *
+//   stats      = reset                     // Show or clear throughput statistics                 *
+//   task_ingest = 1,2                      // Core (-1 is in loop()) and priority of ingest *)    *
+//   task_play  = 0,2                       // Core and priority of playtask *)                    *
+//   sd_speed   = 4000000                   // SPI clock for the SD card in Hz *)                  *
+//   perfpub    = 60                        // Seconds between performance reports to MQTT, 0=off  *
 //  Commands marked with "*)" are sensible during initialization only                              *
 //**************************************************************************************************
 const char* analyzeCmd ( const char* par, const char* val )
@@ -5025,7 +10108,7 @@ const char* analyzeCmd ( const char* par, const char* val )
   if ( argument.indexOf ( "volume" ) >= 0 )           // Volume setting?
   {
     // Volume may be of the form "upvolume", "downvolume" or "volume" for relative or absolute setting
-    oldvol = vs1053player->getVolume() ;              // Get current volume
+    oldvol = ini_block.reqvol ;                       // Last requested volume, also if muted
     if ( relative )                                   // + relative setting?
     {
       ini_block.reqvol = oldvol + ivalue ;            // Up/down by 0.5 or more dB
@@ -5102,7 +10185,14 @@ const char* analyzeCmd ( const char* par, const char* val )
   }
   else if ( argument == "stop" )                      // (un)Stop requested?
   {
-    if ( datamode & ( HEADER | DATA | METADATA | PLAYLISTINIT |
+    if ( ivalue == 1 )                                // "stop=1", stop only, never unstop
+    {
+      if ( datamode != STOPPED )
+      {
+        setdatamode ( STOPREQD ) ;                    // Request STOP
+      }
+    }
+    else if ( datamode & ( HEADER | DATA | METADATA | PLAYLISTINIT |
                       PLAYLISTHEADER | PLAYLISTDATA ) )
 
     {
@@ -5168,18 +10258,71 @@ const char* analyzeCmd ( const char* par, const char* val )
     {
       av = mp3client.available() ;                    // Available in stream
     }
-    sprintf ( reply, "Free memory is %d, chunks in queue %d, stream %d, bitrate %d kbps",
+    sprintf ( reply, "Free memory is %d, bytes in buffer %d, stream %d, bitrate %d kbps",
               ESP.getFreeHeap(),
-              uxQueueMessagesWaiting ( dataqueue ),
+              mp3ring.fill(),
               av,
               mbitrate ) ;
     dbgprint ( "Stack maintask is %d", uxTaskGetStackHighWaterMark ( maintask ) ) ;
     dbgprint ( "Stack playtask is %d", uxTaskGetStackHighWaterMark ( xplaytask ) ) ;
     dbgprint ( "Stack spftask  is %d", uxTaskGetStackHighWaterMark ( xspftask ) ) ;
+    if ( xingesttask )
+    {
+      dbgprint ( "Stack ingest   is %d", uxTaskGetStackHighWaterMark ( xingesttask ) ) ;
+    }
     dbgprint ( "ADC reading is %d", adcval ) ;
     dbgprint ( "scaniocount is %d", scaniocount ) ;
     dbgprint ( "Max. mp3_loop duration is %d", max_mp3loop_time ) ;
+    dbgprint ( "Number of rebuffers is %d", rebuffercount ) ;
+    if ( frstat.frames )                              // MP3 frames or Ogg pages seen?
+    {
+      dbgprint ( "%s %d, sync lost %d, %d Hz, %d kbps, buffered %d msec",
+                 oggpg.active ? "Ogg pages" : "MP3 frames",
+                 frstat.frames, mp3frm.lost + oggpg.lost, frstat.samplerate,
+                 streamkbps(), bufferedms() ) ;
+    }
+    if ( parsebytes >= 1024 )                         // Enough data for parser statistics?
+    {
+      dbgprint ( "Stream parser uses %d cycles per kB",
+                 (uint32_t)( parsecycles / ( parsebytes / 1024 ) ) ) ;
+    }
+    if ( spiholdcount && sditime )                    // Statistics for SDI bursts available?
+    {
+      dbgprint ( "SDI throughput is %d kB/sec, %d bytes per burst",
+                 (uint32_t)( (uint64_t)sdibytes * 1000000 / 1024 / sditime ),
+                 sdibytes / spiholdcount ) ;
+      dbgprint ( "SPI bus hold time for bursts is %d usec average, %d usec max",
+                 sditime / spiholdcount, spiholdmax ) ;
+    }
+    dbgprint ( "DNS cache hits %d, misses %d, saved %d msec",
+               dnscache.hits, dnscache.misses, dnscache.savedms() ) ;
+    dbgprint ( "Command mailbox: %d serial, %d MQTT, %d HTTP, %d encoder, "
+               "%d merged, %d dropped",
+               cmdq.posted[CQ_SERIAL], cmdq.posted[CQ_MQTT], cmdq.posted[CQ_HTTP],
+               cmdq.posted[CQ_ENCODER], cmdq.merged, cmdq.dropped ) ;
+    dbgprint ( "Recovery: %d network stalls, %d EOFs, %d connect failures, "
+               "%d decoder stalls, %d reconnects, %d skips",
+               recovery.count[RC_NETSTALL], recovery.count[RC_EOF],
+               recovery.count[RC_CONNFAIL], recovery.count[RC_DECSTALL],
+               recovery.reconnects, recovery.skips ) ;
+    dbgprint ( "Decoder: format %s, %d kbps, decode time %d sec, %d undecodable streams",
+               dectel.format(), dectel.kbps(), dectel.dtime, dectel.deadcount ) ;
+    for ( int c = 0 ; c < SC_NUMCLIENT ; c++ )        // Show SPI bus usage per client
+    {
+      dbgprint ( "SPI bus %s: %d claims, max wait %d usec, max hold %d usec", scnames[c],
+                 spiarb.claims[c], spiarb.maxwait[c], spiarb.maxhold[c] ) ;
+    }
+    dbgprint ( "Stop latency %d usec last, %d usec max, fast switch is %s",
+               stats.stop.last, stats.stop.max, ini_block.fastzap ? "on" : "off" ) ;
+    dbgprint ( "Rate control is %s, correction %d ppm after %d steps",
+               ini_block.ratectl ? "on" : "off", ratectl.ppm, ratectl.steps ) ;
     max_mp3loop_time = 0 ;                            // Start new check
+    parsecycles = 0 ;                                 // Start new parser measurement
+    parsebytes = 0 ;
+    sdibytes = 0 ;                                    // Start new SDI measurement
+    sditime = 0 ;
+    spiholdcount = 0 ;
+    spiholdmax = 0 ;
   }
   // Commands for bass/treble control
   else if ( argument.startsWith ( "tone" ) )          // Tone command
@@ -5204,9 +10347,118 @@ const char* analyzeCmd ( const char* par, const char* val )
     sprintf ( reply, "Parameter for bass/treble %s set to %d",
               argument.c_str(), ivalue ) ;
   }
+  else if ( ( argument == "prebuffer" ) ||           // High watermark for prebuffer?
+            ( argument == "lowbuffer" ) )             // or low watermark?
+  {
+    if ( ivalue < 0 )                                 // Fields are 16 bits, keep in range
+    {
+      ivalue = 0 ;
+    }
+    if ( ivalue > 65535 )
+    {
+      ivalue = 65535 ;
+    }
+    if ( argument == "prebuffer" )
+    {
+      ini_block.prebuf_ms = ivalue ;                  // Set high watermark
+      if ( ini_block.lowbuf_ms >= ini_block.prebuf_ms ) // Low watermark must be below it
+      {
+        ini_block.lowbuf_ms = ini_block.prebuf_ms / 2 ;
+      }
+      sprintf ( reply, "Prebuffer set to %d msec (%d bytes), low buffer %d msec",
+                ini_block.prebuf_ms, bufms2bytes ( ini_block.prebuf_ms ),
+                ini_block.lowbuf_ms ) ;
+    }
+    else
+    {
+      if ( ivalue >= ini_block.prebuf_ms )            // Must be below prebuffer
+      {
+        ivalue = ini_block.prebuf_ms / 2 ;            // Limit it
+      }
+      ini_block.lowbuf_ms = ivalue ;                  // Set low watermark
+      sprintf ( reply, "Low buffer set to %d msec (%d bytes)",
+                ini_block.lowbuf_ms, bufms2bytes ( ini_block.lowbuf_ms ) ) ;
+    }
+  }
+  else if ( argument == "dnssave" )                   // Save DNS cache in NVS?
+  {
+    ini_block.dnssave = ( ivalue != 0 ) ;             // Yes, set flag accordingly
+  }
+  else if ( argument == "standby" )                   // Number of standby connections?
+  {
+    if ( ivalue > SBSLOTS )                           // Limit to number of slots
+    {
+      ivalue = SBSLOTS ;
+    }
+    ini_block.standby = ivalue ;                      // Set it, standby_loop() will handle
+    sprintf ( reply, "Standby connections set to %d", ivalue ) ;
+  }
+  else if ( argument == "stats" )                     // Statistics?
+  {
+    if ( value == "reset" )                           // Yes, reset requested?
+    {
+      stats.reset() ;                                 // Yes, start again at next sample
+    }
+    sprintf ( reply, "Ingest %d B/s, decode %d B/s, fill %d%% (min %d, max %d), RSSI -%d dBm",
+              stats.ingest.ewma(), stats.decode.ewma(), stats.fill.ewma(),
+              stats.fill.n ? stats.fill.min : 0, stats.fill.max, stats.rssi.ewma() ) ;
+    tmpstr = stats.json() ;                           // Too long for one debug line
+    dbgprint ( "Statistics, also as /?statsjson:" ) ;
+    for ( int i = 0 ; i < (int)tmpstr.length() ; i += 100 ) // Show in pieces
+    {
+      dbgprint ( "%s", tmpstr.substring ( i, i + 100 ).c_str() ) ;
+    }
+  }
+  else if ( argument == "rcretries" )                 // Reconnects before skipping a station?
+  {
+    ini_block.rcretries = ivalue ;                    // Yes, set it
+    sprintf ( reply, "Station is skipped after %d reconnects", ivalue ) ;
+  }
+  else if ( argument.startsWith ( "task_" ) )         // Task layout?
+  {
+    int8_t*  pcore = &ini_block.playcore ;            // Assume playtask
+    uint8_t* pprio = &ini_block.playprio ;
+    int      inx = value.indexOf ( "," ) ;            // Position of priority
+
+    if ( argument == "task_ingest" )                  // Ingest task?
+    {
+      pcore = &ini_block.ingestcore ;                 // Yes, point to its settings
+      pprio = &ini_block.ingestprio ;
+    }
+    *pcore = value.toInt() ;                          // Core, may be negative
+    if ( inx > 0 )                                    // Priority specified?
+    {
+      *pprio = value.substring ( inx + 1 ).toInt() ;  // Yes, set it
+    }
+    strcpy ( reply, "Task layout changed. Save and restart to have effect" ) ;
+  }
+  else if ( argument == "sd_speed" )                  // SPI clock for SD card?
+  {
+    if ( ivalue > 0 )                                 // Yes, legal value?
+    {
+      ini_block.sd_speed = ivalue ;                   // Yes, set it
+    }
+    strcpy ( reply, "SD card speed changed. Save and restart to have effect" ) ;
+  }
+  else if ( argument == "perfpub" )                   // Performance reports to MQTT?
+  {
+    ini_block.perfpub = ivalue ;                      // Yes, set interval
+    sprintf ( reply, "Performance report to MQTT every %d seconds", ivalue ) ;
+  }
+  else if ( argument == "fastzap" )                   // Fast cancel on station switch?
+  {
+    ini_block.fastzap = ( ivalue != 0 ) ;             // Yes, set it
+    sprintf ( reply, "Fast station switch is %s", ini_block.fastzap ? "on" : "off" ) ;
+  }
+  else if ( argument == "ratectl" )                   // Automatic rate control?
+  {
+    ini_block.ratectl = ( ivalue != 0 ) ;             // Yes, set it
+    sprintf ( reply, "Rate control is %s", ini_block.ratectl ? "on" : "off" ) ;
+  }
   else if ( argument == "rate" )                      // Rate command?
   {
-    vs1053player->AdjustRate ( ivalue ) ;             // Yes, adjust
+    ini_block.ratectl = false ;                       // Yes, manual rate, no rate control
+    ratectl.manual ( ivalue ) ;                       // Adjust in mp3loop()
   }
   else if ( argument.startsWith ( "mqtt" ) )          // Parameter fo MQTT?
   {
@@ -5416,53 +10668,261 @@ bool handle_tft_txt()
 }
 
 
+//**************************************************************************************************
+//                                     B U F M S 2 B Y T E S                                       *
+//**************************************************************************************************
+// Convert a buffer time in msec to a number of bytes, using the best known bitrate.               *
+// The result is limited to 3/4 of the ring buffer.                                                *
+//**************************************************************************************************
+uint32_t bufms2bytes ( uint32_t ms )
+{
+  uint32_t n ;                                                      // Number of bytes
+
+  n = streamkbps() * ms / 8 ;                                       // kbps * msec is bits
+  if ( n > ( RINGSIZ * 3 / 4 ) )                                    // Limit to size of ring
+  {
+    n = RINGSIZ * 3 / 4 ;
+  }
+  return n ;
+}
+
+
+//**************************************************************************************************
+//                                     L O W B U F B Y T E S                                       *
+//**************************************************************************************************
+// Low watermark in bytes.  bufms2bytes() limits both watermarks to the size of the ring, so the   *
+// low watermark is kept at half of the prebuffer at most.  Otherwise playing would start and      *
+// rebuffer at once.                                                                               *
+//**************************************************************************************************
+uint32_t lowbufbytes()
+{
+  uint32_t low = bufms2bytes ( ini_block.lowbuf_ms ) ;              // Low watermark
+  uint32_t pre = bufms2bytes ( ini_block.prebuf_ms ) ;              // High watermark
+
+  if ( low > ( pre / 2 ) )                                          // Too close to prebuffer?
+  {
+    low = pre / 2 ;                                                 // Yes, limit
+  }
+  return low ;
+}
+
+
+//**************************************************************************************************
+//                                        W A I T D R E Q                                          *
+//**************************************************************************************************
+// Wait until the VS1053 FIFO has room for more data.  The playtask sleeps until it is woken up by *
+// the DREQ interrupt.  The time-out is a safety net only.                                         *
+//**************************************************************************************************
+void waitdreq()
+{
+  while ( !vs1053player->data_request() )                           // If FIFO is full..
+  {
+    ulTaskNotifyTake ( pdTRUE, 10 / portTICK_PERIOD_MS ) ;          // Yes, wait for interrupt
+  }
+}
+
+
+//**************************************************************************************************
+//                                     I N G E S T T A S K                                         *
+//**************************************************************************************************
+// Read the stream or file into the ring buffer by calling mp3loop().  Runs in its own task, so a  *
+// slow step in loop() cannot starve the network read.  If nothing was read, the task sleeps until *
+// the socket is readable, the playtask made space in the ring buffer or INGESTWAIT msec passed.   *
+// Core and priority are set by "task_ingest".                                                     *
+//**************************************************************************************************
+void ingesttask ( void * parameter )
+{
+  uint32_t       oldin ;                                            // stats.ingested before mp3loop
+  uint32_t       t0 ;                                               // Start of mp3loop() in usec
+  int            fd ;                                               // Socket of the stream
+  fd_set         rfds ;                                             // Socket set for select()
+  struct timeval tv ;                                               // Timeout for select()
+
+  while ( true )
+  {
+    oldin = stats.ingested ;
+    ctllock() ;                                                     // Player state is ours now
+    t0 = micros() ;
+    mp3loop() ;                                                     // Read and handle data
+    perf.add ( PF_MP3LOOP, micros() - t0 ) ;
+    ctlunlock() ;
+    if ( stats.ingested != oldin )                                  // Anything read?
+    {
+      taskYIELD() ;                                                 // Yes, try again soon
+      continue ;
+    }
+    fd = mp3client.fd() ;                                           // Socket of the stream
+    if ( !localfile && ( fd >= 0 ) &&                               // Reading a stream
+         ( mp3ring.space() >= sizeof(tmpbuff) ) )                   // with space in ring buffer?
+    {
+      FD_ZERO ( &rfds ) ;                                           // Yes, wait for data
+      FD_SET ( fd, &rfds ) ;
+      tv.tv_sec = 0 ;
+      tv.tv_usec = INGESTWAIT * 1000 ;
+      select ( fd + 1, &rfds, NULL, NULL, &tv ) ;
+    }
+    else
+    {
+      ulTaskNotifyTake ( pdTRUE, INGESTWAIT / portTICK_PERIOD_MS ) ; // Wait for space or timeout
+    }
+  }
+  //vTaskDelete ( NULL ) ;                                          // Will never arrive here
+}
+
+
 //**************************************************************************************************
 //                                     P L A Y T A S K                                             *
 //**************************************************************************************************
-// Play stream data from input queue.                                                              *
+// Play stream data from the ring buffer.  Start and stop requests come from the control queue.    *
+// After a start, playing begins when the ring holds "prebuffer" msec of data.  For streams, a     *
+// buffer below "lowbuffer" msec will pause playing until it is filled up again.                   *
 // Handle all I/O to VS1053B during normal playing.                                                *
 // Handles display of text, time and volume on TFT as well.                                        *
 //**************************************************************************************************
 void playtask ( void * parameter )
 {
+  qdata_struct qd ;                                                 // Request from control queue
+  uint8_t* p ;                                                      // Pointer to data in ring
+  uint32_t n ;                                                      // Number of bytes at p
+  uint32_t m ;                                                      // Part of n
+  int      edge ;                                                   // Frame boundary for stop
+  uint32_t t0 ;                                                     // Timing of SPI burst
+  uint32_t tb ;                                                     // Start of burst incl. claim
+  bool     buffering = false ;                                      // Filling up prebuffer
+
   while ( true )
   {
-    if ( xQueueReceive ( dataqueue, &inchunk, 5 ) )
+    if ( xQueueReceive ( ctrlqueue, &qd, 0 ) )                      // Start/stop request?
     {
-      while ( !vs1053player->data_request() )                       // If FIFO is full..
-      {
-        vTaskDelay ( 1 ) ;                                          // Yes, take a break
-      }
-      switch ( inchunk.datatyp )                                    // What kind of chunk?
+      waitdreq() ;                                                  // Wait for space in FIFO
+      switch ( qd.func )                                            // What kind of request?
       {
-        case QDATA:
-          claimSPI ( "chunk" ) ;                                    // Claim SPI bus
-          vs1053player->playChunk ( inchunk.buf,                    // DATA, send to player
-                                    sizeof(inchunk.buf) ) ;
-          releaseSPI() ;                                            // Release SPI bus
-          totalcount += sizeof(inchunk.buf) ;                       // Count the bytes
-          break ;
         case QSTARTSONG:
+          buffering = !localfile ;                                  // Prebuffer for streams
           playingstat = 1 ;                                         // Status for MQTT
           mqttpub.trigger ( MQTT_PLAYING ) ;                        // Request publishing to MQTT
           claimSPI ( "startsong" ) ;                                // Claim SPI bus
           vs1053player->startSong() ;                               // START, start player
           releaseSPI() ;                                            // Release SPI bus
           break ;
+        case QENDSONG:                                              // End of file or stream?
+          buffering = false ;                                       // Yes, play what is left
+          while ( ( (int32_t)( qd.mark - mp3ring.rdpos() ) > 0 ) && // Data of this song left
+                  ( uxQueueMessagesWaiting ( ctrlqueue ) == 0 ) )   // and no new request?
+          {
+            n = mp3ring.peek ( &p ) ;                               // Get part of the data
+            if ( n > ( qd.mark - mp3ring.rdpos() ) )                // Limit to this song
+            {
+              n = qd.mark - mp3ring.rdpos() ;
+            }
+            waitdreq() ;                                            // Wait for space in FIFO
+            claimSPI ( "drain" ) ;                                  // Claim SPI bus
+            n = vs1053player->playBurst ( p, n, SPIHOLDMAX ) ;      // Send to player
+            releaseSPI() ;                                          // Release SPI bus
+            mp3ring.consume ( n ) ;
+            totalcount += n ;
+          }
+          qd.tq = micros() ;                                        // Stop latency starts here
+          // Fall through to stop the song
         case QSTOPSONG:
+          t0 = qd.tq ;                                              // Start of stop latency
           playingstat = 0 ;                                         // Status for MQTT
           mqttpub.trigger ( MQTT_PLAYING ) ;                        // Request publishing to MQTT
+          edge = -1 ;                                               // No frame boundary yet
+          for ( m = 0 ; m < qd.nedge ; m++ )                        // Search the copy, oldest first
+          {
+            if ( ( qd.edge[m] - mp3ring.rdpos() ) <=                // Not yet played?
+                 ( qd.mark - mp3ring.rdpos() ) )
+            {
+              edge = m ;                                            // Yes, next frame starts here
+              break ;
+            }
+          }
           claimSPI ( "stopsong" ) ;                                 // Claim SPI bus
           vs1053player->setVolume ( 0 ) ;                           // Mute
-          vs1053player->stopSong() ;                                // STOP, stop player
+          if ( edge >= 0 )                                          // Frame boundary found?
+          {
+            n = qd.edge[edge] - mp3ring.rdpos() ;                   // Yes, finish current frame
+            while ( n )
+            {
+              m = mp3ring.peek ( &p ) ;                             // Get part of the data
+              if ( m > n )
+              {
+                m = n ;
+              }
+              vs1053player->playChunk ( p, m ) ;                    // Send to player
+              mp3ring.consume ( m ) ;
+              n -= m ;
+            }
+          }
+          if ( !vs1053player->stopSong ( edge >= 0,                 // STOP, stop player
+                                         ini_block.fastzap ) )
+          {
+            reqtone = true ;                                        // Reset, set tone again
+          }
           releaseSPI() ;                                            // Release SPI bus
-          while ( xQueueReceive ( dataqueue, &inchunk, 0 ) ) ;      // Flush rest of queue
-          vTaskDelay ( 500 / portTICK_PERIOD_MS ) ;                 // Pause for a short time
+          mp3ring.reset_to ( qd.mark ) ;                            // Flush rest of the old song
+          stats.stop.add ( micros() - t0 ) ;                        // Count stop latency
+          if ( !ini_block.fastzap )                                 // Normal stop?
+          {
+            vTaskDelay ( 500 / portTICK_PERIOD_MS ) ;               // Yes, pause for a short time
+          }
+          else                                                      // Pause until next request,
+          {                                                         // other wake-ups do not count
+            xQueuePeek ( ctrlqueue, &qd, 500 / portTICK_PERIOD_MS ) ;
+          }
           break ;
         default:
           break ;
       }
     }
+    else if ( buffering &&                                          // Prebuffer not yet filled?
+              !( datamode & ( STOPREQD | STOPPED ) ) &&             // and more data to come?
+              ( mp3ring.fill() < bufms2bytes ( ini_block.prebuf_ms ) ) )
+    {
+      ulTaskNotifyTake ( pdTRUE, 5 ) ;                              // Yes, wait for more data
+    }
+    else if ( ( n = mp3ring.peek ( &p ) ) )                         // Data in ring buffer?
+    {
+      if ( buffering )                                              // End of prebuffering?
+      {
+        buffering = false ;                                         // Yes, start playing
+        dbgprint ( "Prebuffer filled with %d bytes", mp3ring.fill() ) ;
+      }
+      waitdreq() ;                                                  // Wait for space in FIFO
+      tb = micros() ;                                               // Start of iteration
+      claimSPI ( "chunk" ) ;                                        // Claim SPI bus
+      t0 = micros() ;                                               // Start of the burst
+      n = vs1053player->playBurst ( p, n, SPIHOLDMAX ) ;            // DATA, send to player
+      releaseSPI() ;                                                // Release SPI bus
+      t0 = micros() - t0 ;                                          // Time the bus was held
+      mp3ring.consume ( n ) ;                                       // Free space in ring
+      perf.add ( PF_PLAY, micros() - tb ) ;                         // Count iteration
+      if ( xingesttask )                                            // Ingest task in use?
+      {
+        xTaskNotifyGive ( xingesttask ) ;                           // Yes, there is space now
+      }
+      totalcount += n ;                                             // Count the bytes
+      sdibytes += n ;                                               // Update statistics
+      sditime += t0 ;
+      spiholdcount++ ;
+      if ( t0 > spiholdmax )                                        // New maximum?
+      {
+        spiholdmax = t0 ;
+      }
+      if ( ( !localfile ) &&                                        // Running out of stream data?
+           ( datamode & ( DATA | METADATA ) ) &&
+           ( mp3ring.fill() < lowbufbytes() ) )
+      {
+        buffering = true ;                                          // Yes, pause and rebuffer
+        rebuffercount++ ;                                           // Count rebuffer events
+        dbgprint ( "Rebuffering" ) ;
+      }
+    }
+    else
+    {
+      ulTaskNotifyTake ( pdTRUE, 5 ) ;                              // Nothing to do, wait for data
+    }
     //esp_task_wdt_reset() ;                                        // Protect against idle cpu
   }
   //vTaskDelete ( NULL ) ;                                          // Will never arrive here
@@ -5484,6 +10944,10 @@ void handle_spec()
   if ( tft )                                                  // Need to update TFT?
   {
     handle_tft_txt() ;                                        // Yes, TFT refresh necessary
+    if ( dsp_usesSPI() )                                      // Bus claimed?
+    {
+      spiarb.yield() ;                                        // Yes, VS1053 first if it waits
+    }
     dsp_update() ;                                            // Be sure to paint physical screen
   }
   if ( dsp_usesSPI() )                                        // Does display uses SPI?
@@ -5494,6 +10958,11 @@ void handle_spec()
   {
     gettime() ;                                               // Yes, get the current time
   }
+  if ( NetworkFound )                                         // Network available?
+  {
+    dnscache.refresh() ;                                      // Yes, refresh DNS cache if needed
+  }
+  stats.sample() ;                                            // Sample statistics
   claimSPI ( "hspec" ) ;                                      // Claim SPI bus
   if ( muteflag )                                             // Mute or not?
   {
@@ -5508,6 +10977,7 @@ void handle_spec()
     reqtone = false ;
     vs1053player->setTone ( ini_block.rtone ) ;               // Set SCI_BASS to requested value
   }
+  dectel.poll() ;                                             // Poll decoder telemetry
   if ( time_req )                                             // Time to refresh timetxt?
   {
     time_req = false ;                                        // Yes, clear request
@@ -5542,9 +11012,13 @@ void handle_spec()
 //**************************************************************************************************
 void spftask ( void * parameter )
 {
+  uint32_t t0 ;                                                     // Start of handle_spec in usec
+
   while ( true )
   {
+    t0 = micros() ;
     handle_spec() ;                                                 // Maybe some special funcs?
+    perf.add ( PF_HSPEC, micros() - t0 ) ;
     vTaskDelay ( 100 / portTICK_PERIOD_MS ) ;                       // Pause for a short time
     adcval = ( 15 * adcval +                                        // Read ADC and do some filtering
                adc1_get_raw ( ADC1_CHANNEL_0 ) ) / 16 ;
@@ -443,7 +443,7 @@ void setup_SDCARD()
   if ( ini_block.sd_cs_pin >= 0 )                        // SD configured?
   {
     if ( !SD.begin ( ini_block.sd_cs_pin, SPI,           // Yes,
-                     SDSPEED ) )                         // try to init SD card driver
+                     ini_block.sd_speed ) )              // try to init SD card driver
     {
       p = dbgprint ( "SD Card Mount Failed!" ) ;         // No success, check formatting (FAT)
       tftlog ( p ) ;                                     // Show error on TFT as well
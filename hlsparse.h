@@ -0,0 +1,126 @@
+// hlsparse.h
+// Parser for the lines of a HLS (.m3u8) playlist.  Only the tags needed for playing audio are
+// handled.  There is no networking and no String in here, so the parser can be tested on a host
+// with canned playlists, see test/test_hlsparse.cpp.
+//
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum m3u8_t { M3U8_NONE, M3U8_SEGMENT, M3U8_VARIANT } ;      // Result of m3u8parser::parse()
+
+//**************************************************************************************************
+//                                        M 3 U 8 _ A T T R                                        *
+//**************************************************************************************************
+// Get the numeric value of attribute name (like "BANDWIDTH=") from an attribute list.  The name   *
+// must be at the start of the list or follow a comma, so "AVERAGE-BANDWIDTH=" is not mistaken for *
+// "BANDWIDTH=".  Returns 0 if the attribute is missing.                                           *
+//**************************************************************************************************
+inline uint32_t m3u8_attr ( const char* attrs, const char* name )
+{
+  size_t      len = strlen ( name ) ;                         // Length of name
+  const char* p = attrs ;                                     // Points into attrs
+  bool        quoted = false ;                                // Inside a quoted string
+
+  while ( *p )
+  {
+    if ( !quoted && ( strncmp ( p, name, len ) == 0 ) )       // Name found?
+    {
+      return strtoul ( p + len, NULL, 10 ) ;                  // Yes, return value
+    }
+    while ( *p && ( quoted || ( *p != ',' ) ) )               // Skip to next attribute
+    {
+      if ( *p == '"' )
+      {
+        quoted = !quoted ;                                    // Commas in quotes do not count
+      }
+      p++ ;
+    }
+    if ( *p )
+    {
+      p++ ;                                                   // Skip the comma
+    }
+  }
+  return 0 ;
+}
+
+
+class m3u8parser
+{
+  public:
+    uint16_t          targetdur ;                             // Target duration in seconds
+    bool              endlist ;                               // No more segments will be added
+    uint32_t          seq ;                                   // Sequence number of next URI
+    uint32_t          uriseq ;                                // Sequence number of last segment
+    bool              streaminf ;                             // Next URI is a variant
+    uint32_t          curbw ;                                 // Bandwidth of that variant
+    bool              havevar ;                               // A variant is selected
+    uint32_t          varbw ;                                 // Bandwidth of selected variant
+    void              start()                                 // New session
+                      {
+                        targetdur = 10 ;                      // Until known
+                        endlist = false ;
+                        load() ;
+                      }
+    void              load()                                  // New load of the playlist
+                      {
+                        seq = 0 ;                             // Until EXT-X-MEDIA-SEQUENCE
+                        uriseq = 0 ;
+                        streaminf = false ;
+                        havevar = false ;
+                      }
+    m3u8_t            parse ( const char* line ) ;            // Handle a line of the playlist
+} ;
+
+
+//**************************************************************************************************
+//                                   M 3 U 8 P A R S E R : : P A R S E                             *
+//**************************************************************************************************
+// Handle a line of the playlist, without CR or LF.  Returns M3U8_SEGMENT for the URI of a media   *
+// segment, its sequence number is in uriseq.  Returns M3U8_VARIANT for the URI of a variant in a  *
+// master playlist if it has the lowest bandwidth so far.  Other lines give M3U8_NONE.             *
+//**************************************************************************************************
+inline m3u8_t m3u8parser::parse ( const char* line )
+{
+  if ( strncmp ( line, "#EXT-X-TARGETDURATION:", 22 ) == 0 )
+  {
+    targetdur = atoi ( line + 22 ) ;                          // Max. duration of a segment
+    if ( targetdur == 0 )
+    {
+      targetdur = 1 ;                                         // Prevent busy reloads
+    }
+  }
+  else if ( strncmp ( line, "#EXT-X-MEDIA-SEQUENCE:", 22 ) == 0 )
+  {
+    seq = strtoul ( line + 22, NULL, 10 ) ;                   // Sequence number of first segment
+  }
+  else if ( strncmp ( line, "#EXT-X-ENDLIST", 14 ) == 0 )
+  {
+    endlist = true ;                                          // No more segments will be added
+  }
+  else if ( strncmp ( line, "#EXT-X-STREAM-INF:", 18 ) == 0 ) // Variant in master playlist?
+  {
+    curbw = m3u8_attr ( line + 18, "BANDWIDTH=" ) ;           // Yes, get bandwidth
+    streaminf = true ;                                        // URI will follow
+  }
+  else if ( ( line[0] == '#' ) || ( line[0] == '\0' ) )       // Other tag or empty line?
+  {
+    // Ignore
+  }
+  else if ( streaminf )                                       // URI of a variant?
+  {
+    streaminf = false ;
+    if ( !havevar || ( curbw < varbw ) )                      // Lowest bandwidth so far?
+    {
+      havevar = true ;                                        // Yes, select it
+      varbw = curbw ;
+      return M3U8_VARIANT ;
+    }
+  }
+  else
+  {
+    uriseq = seq++ ;                                          // URI of a media segment
+    return M3U8_SEGMENT ;
+  }
+  return M3U8_NONE ;
+}
@@ -0,0 +1,42 @@
+// sdifeed.h
+// Feed loop for the SDI (data) port of the VS1053.  There is no hardware access in here, the
+// DREQ line, the SPI write and the clock are passed in.  So the same code can run on a host with
+// a model of the VS1053 FIFO, see test/test_sdifeed.cpp.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+//**************************************************************************************************
+//                                        S D I _ B U R S T                                        *
+//**************************************************************************************************
+// Send blocks of max. blksiz bytes as long as DREQ tells that the FIFO has room for one block,    *
+// but not longer than maxus usec.  A DREQ that is high guarantees room for 32 bytes, so blksiz    *
+// must not be larger.  dreq() gives the level of DREQ, write ( p, n ) sends n bytes and usec()    *
+// gives the time in usec.  Returns the number of bytes sent.                                      *
+//**************************************************************************************************
+template <class DREQ, class WRITE, class USEC>
+size_t sdi_burst ( DREQ dreq, WRITE write, USEC usec,
+                   const uint8_t* data, size_t len, size_t blksiz, uint32_t maxus )
+{
+  size_t   n ;                                                // Length of block, blksiz or shorter
+  size_t   sent = 0 ;                                         // Number of bytes sent
+  uint32_t t0 = usec() ;                                      // Start of burst
+
+  while ( len && dreq() )                                     // Room for a block?
+  {
+    n = len ;
+    if ( n > blksiz )
+    {
+      n = blksiz ;
+    }
+    write ( data, n ) ;
+    data += n ;
+    len -= n ;
+    sent += n ;
+    if ( (uint32_t)( usec() - t0 ) >= maxus )                 // Time to give others a chance?
+    {
+      break ;
+    }
+  }
+  return sent ;
+}
@@ -0,0 +1,185 @@
+// test_hlsparse.cpp
+// Host test of the HLS playlist parser in hlsparse.h with canned media and master playlists.
+// The playlists are fed line by line, like hlsc::fetchpoll() does after removing CR and LF.
+//
+#include <string.h>
+#include <string>
+#include <vector>
+#include "../hlsparse.h"
+#include "testutil.h"
+
+struct result                                                 // Outcome of feeding a playlist
+{
+  std::vector<std::string> segs ;                             // URIs of the segments, in order
+  std::vector<uint32_t>    seqs ;                             // Their sequence numbers
+  std::string              variant ;                          // Last selected variant
+} ;
+
+
+// Feed a playlist to the parser, one line at a time.  CR is removed like in hlsc::fetchpoll().
+static result feed ( m3u8parser& m3u, const char* text )
+{
+  result      r ;
+  std::string line ;
+  const char* p ;
+
+  m3u.load() ;
+  for ( p = text ; ; p++ )
+  {
+    if ( ( *p == '\n' ) || ( *p == '\0' ) )
+    {
+      switch ( m3u.parse ( line.c_str() ) )
+      {
+        case M3U8_SEGMENT :
+          r.segs.push_back ( line ) ;
+          r.seqs.push_back ( m3u.uriseq ) ;
+          break ;
+        case M3U8_VARIANT :
+          r.variant = line ;
+          break ;
+        default :
+          break ;
+      }
+      line.clear() ;
+      if ( *p == '\0' )
+      {
+        break ;
+      }
+    }
+    else if ( *p != '\r' )
+    {
+      line += *p ;
+    }
+  }
+  return r ;
+}
+
+
+static const char* vodlist =                                  // Media playlist, video on demand
+  "#EXTM3U\n"
+  "#EXT-X-VERSION:3\n"
+  "#EXT-X-TARGETDURATION:6\n"
+  "#EXT-X-MEDIA-SEQUENCE:0\n"
+  "#EXTINF:6.0,\n"
+  "seg0.ts\n"
+  "#EXTINF:6.0,\n"
+  "seg1.ts\n"
+  "\n"
+  "#EXTINF:3.5,\n"
+  "http://cdn.example.com/audio/seg2.ts\n"
+  "#EXT-X-ENDLIST\n" ;
+
+static const char* livelist =                                 // Media playlist, live, CRLF
+  "#EXTM3U\r\n"
+  "#EXT-X-TARGETDURATION:10\r\n"
+  "#EXT-X-MEDIA-SEQUENCE:4711\r\n"
+  "#EXTINF:10.0,Title\r\n"
+  "chunk_4711.aac\r\n"
+  "#EXTINF:10.0,Title\r\n"
+  "chunk_4712.aac\r\n"
+  "#EXTINF:10.0,Title\r\n"
+  "chunk_4713.aac" ;                                          // Last line without linefeed
+
+static const char* masterlist =                               // Master playlist
+  "#EXTM3U\n"
+  "#EXT-X-STREAM-INF:BANDWIDTH=128000,CODECS=\"mp4a.40.2\"\n"
+  "hi/index.m3u8\n"
+  "#EXT-X-STREAM-INF:AVERAGE-BANDWIDTH=30000,BANDWIDTH=64000,CODECS=\"mp4a.40.5\"\n"
+  "mid/index.m3u8\n"
+  "#EXT-X-STREAM-INF:CODECS=\"mp4a.40.2,BANDWIDTH=1\",BANDWIDTH=96000\n"
+  "alt/index.m3u8\n"
+  "#EXT-X-STREAM-INF:BANDWIDTH=256000\n"
+  "top/index.m3u8\n" ;
+
+
+static void test_vod()                                        // Segments, duration and ENDLIST
+{
+  m3u8parser m3u ;
+  result     r ;
+
+  m3u.start() ;
+  r = feed ( m3u, vodlist ) ;
+  CHECK ( r.segs.size() == 3 ) ;
+  CHECK ( r.segs.size() == 3 && r.segs[0] == "seg0.ts" ) ;
+  CHECK ( r.segs.size() == 3 && r.segs[2] == "http://cdn.example.com/audio/seg2.ts" ) ;
+  CHECK ( r.seqs.size() == 3 && r.seqs[0] == 0 && r.seqs[2] == 2 ) ;
+  CHECK ( m3u.targetdur == 6 ) ;
+  CHECK ( m3u.endlist ) ;
+  CHECK ( r.variant == "" ) ;
+}
+
+
+static void test_live()                                       // Sequence numbers, no ENDLIST
+{
+  m3u8parser m3u ;
+  result     r ;
+
+  m3u.start() ;
+  r = feed ( m3u, livelist ) ;
+  CHECK ( r.segs.size() == 3 ) ;
+  CHECK ( r.segs.size() == 3 && r.segs[2] == "chunk_4713.aac" ) ;
+  CHECK ( r.seqs.size() == 3 && r.seqs[0] == 4711 && r.seqs[2] == 4713 ) ;
+  CHECK ( m3u.targetdur == 10 ) ;
+  CHECK ( !m3u.endlist ) ;
+}
+
+
+static void test_reload()                                     // A reload restarts the numbering
+{
+  m3u8parser m3u ;
+  result     r ;
+
+  m3u.start() ;
+  feed ( m3u, livelist ) ;
+  r = feed ( m3u, "#EXT-X-MEDIA-SEQUENCE:4712\nchunk_4712.aac\nchunk_4713.aac\nchunk_4714.aac\n" ) ;
+  CHECK ( r.seqs.size() == 3 && r.seqs[0] == 4712 && r.seqs[2] == 4714 ) ;
+  CHECK ( m3u.targetdur == 10 ) ;                             // Kept from the first load
+  r = feed ( m3u, "chunk_a.aac\n" ) ;                         // No MEDIA-SEQUENCE, starts at 0
+  CHECK ( r.seqs.size() == 1 && r.seqs[0] == 0 ) ;
+}
+
+
+static void test_master()                                     // Lowest bandwidth is selected
+{
+  m3u8parser m3u ;
+  result     r ;
+
+  m3u.start() ;
+  r = feed ( m3u, masterlist ) ;
+  CHECK ( r.segs.size() == 0 ) ;                              // Variants are not segments
+  CHECK ( r.variant == "mid/index.m3u8" ) ;                   // Not fooled by AVERAGE-BANDWIDTH
+  CHECK ( m3u.varbw == 64000 ) ;
+}
+
+
+static void test_attr()                                       // Attribute lists
+{
+  CHECK ( m3u8_attr ( "BANDWIDTH=128000", "BANDWIDTH=" ) == 128000 ) ;
+  CHECK ( m3u8_attr ( "AVERAGE-BANDWIDTH=1,BANDWIDTH=2", "BANDWIDTH=" ) == 2 ) ;
+  CHECK ( m3u8_attr ( "CODECS=\"a,BANDWIDTH=3\",BANDWIDTH=4", "BANDWIDTH=" ) == 4 ) ;
+  CHECK ( m3u8_attr ( "CODECS=\"mp4a.40.2\"", "BANDWIDTH=" ) == 0 ) ;
+  CHECK ( m3u8_attr ( "", "BANDWIDTH=" ) == 0 ) ;
+}
+
+
+static void test_zero_duration()                              // Target duration 0 would reload
+{                                                             // without a pause
+  m3u8parser m3u ;
+
+  m3u.start() ;
+  CHECK ( m3u.targetdur == 10 ) ;                             // Default until known
+  feed ( m3u, "#EXT-X-TARGETDURATION:0\n" ) ;
+  CHECK ( m3u.targetdur == 1 ) ;
+}
+
+
+int main()
+{
+  RUN ( test_vod ) ;
+  RUN ( test_live ) ;
+  RUN ( test_reload ) ;
+  RUN ( test_master ) ;
+  RUN ( test_attr ) ;
+  RUN ( test_zero_duration ) ;
+  return testfails ;
+}
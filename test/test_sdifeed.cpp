@@ -0,0 +1,165 @@
+// test_sdifeed.cpp
+// Host test of the SDI feed loop in sdifeed.h against a model of the VS1053 FIFO.  The model has
+// a FIFO of VSFIFO bytes that is drained by the decoder at a fixed bitrate.  DREQ is high if
+// there is room for 32 bytes.  Writing takes time according to the SPI clock.
+//
+#include <string.h>
+#include <vector>
+#include "../sdifeed.h"
+#include "testutil.h"
+
+#define VSFIFO     2048                                       // Size of the FIFO in the model
+#define BLKSIZ     32                                         // Block size for sdi_burst
+
+struct vsmodel                                                // Model of the VS1053 FIFO
+{
+  size_t               fill ;                                 // Bytes in FIFO
+  double               now ;                                  // Time in usec
+  double               drained ;                              // Part of a byte drained
+  double               bpus ;                                 // Decoder speed in bytes/usec
+  double               spius ;                                // SPI time per byte in usec
+  bool                 overflow ;                             // Write did not fit in FIFO
+  size_t               maxblk ;                               // Largest block written
+  std::vector<uint8_t> out ;                                  // All data written, in order
+
+  vsmodel ( uint32_t kbps, uint32_t spikhz )
+  {
+    fill = 0 ;
+    now = 0 ;
+    drained = 0 ;
+    bpus = kbps / 8000.0 ;
+    spius = 8000.0 / spikhz ;
+    overflow = false ;
+    maxblk = 0 ;
+  }
+  void advance ( double us )                                  // Let time pass, decoder drains
+  {
+    size_t n ;
+
+    now += us ;
+    drained += us * bpus ;
+    n = (size_t)drained ;
+    drained -= n ;
+    fill = ( n > fill ) ? 0 : fill - n ;
+  }
+  bool dreq() const
+  {
+    return ( VSFIFO - fill ) >= 32 ;
+  }
+  void write ( const uint8_t* p, size_t n )
+  {
+    if ( fill + n > VSFIFO )
+    {
+      overflow = true ;
+    }
+    if ( n > maxblk )
+    {
+      maxblk = n ;
+    }
+    out.insert ( out.end(), p, p + n ) ;
+    fill += n ;
+    advance ( n * spius ) ;
+  }
+  size_t burst ( const uint8_t* p, size_t len, uint32_t maxus )
+  {
+    return sdi_burst ( [this] () { return dreq() ; },
+                       [this] ( const uint8_t* q, size_t n ) { write ( q, n ) ; },
+                       [this] () { return (uint32_t)now ; },
+                       p, len, BLKSIZ, maxus ) ;
+  }
+} ;
+
+
+// Feed a long stream like playtask does: wait for DREQ, then a burst.  All data must arrive in
+// order, in blocks of max. 32 bytes, without overflowing the FIFO.
+static void test_stream_in_order()
+{
+  vsmodel  vs ( 320, 4000 ) ;                                 // 320 kbps, 4 MHz SPI
+  uint8_t  data[50000] ;
+  size_t   sent = 0 ;
+  int      bursts = 0 ;
+
+  for ( size_t i = 0 ; i < sizeof(data) ; i++ )
+  {
+    data[i] = (uint8_t)( i * 7 + ( i >> 8 ) ) ;
+  }
+  while ( sent < sizeof(data) )
+  {
+    while ( !vs.dreq() )                                      // waitdreq()
+    {
+      vs.advance ( 100 ) ;
+    }
+    sent += vs.burst ( data + sent, sizeof(data) - sent, 2000 ) ;
+    bursts++ ;
+  }
+  CHECK ( !vs.overflow ) ;
+  CHECK ( vs.maxblk == BLKSIZ ) ;
+  CHECK ( vs.out.size() == sizeof(data) ) ;
+  CHECK ( memcmp ( vs.out.data(), data, sizeof(data) ) == 0 ) ;
+  CHECK ( bursts > 1 ) ;
+}
+
+
+// Nothing is sent while DREQ is low.
+static void test_dreq_low()
+{
+  vsmodel  vs ( 128, 4000 ) ;
+  uint8_t  data[64] = { 0 } ;
+
+  vs.fill = VSFIFO - 31 ;                                     // No room for a block
+  CHECK ( vs.burst ( data, sizeof(data), 2000 ) == 0 ) ;
+  CHECK ( vs.out.empty() ) ;
+}
+
+
+// A burst stops when the FIFO is full.
+static void test_fifo_full()
+{
+  vsmodel  vs ( 128, 8000 ) ;
+  uint8_t  data[8192] = { 0 } ;
+  size_t   n ;
+
+  n = vs.burst ( data, sizeof(data), 100000 ) ;
+  CHECK ( !vs.overflow ) ;
+  CHECK ( n >= ( VSFIFO - 32 ) ) ;
+  CHECK ( n < sizeof(data) ) ;
+  CHECK ( !vs.dreq() ) ;
+}
+
+
+// A burst gives up the bus after maxus, even if DREQ stays high.
+static void test_maxus()
+{
+  vsmodel  vs ( 10000, 250 ) ;                                // Fast decoder, slow SPI
+  uint8_t  data[4096] = { 0 } ;
+  size_t   n ;
+
+  n = vs.burst ( data, sizeof(data), 5000 ) ;
+  CHECK ( n < sizeof(data) ) ;
+  CHECK ( vs.now >= 5000 ) ;
+  CHECK ( vs.now < ( 5000 + BLKSIZ * vs.spius + 1 ) ) ;       // At most one block too late
+}
+
+
+// The tail of the data is sent as a short block.
+static void test_short_tail()
+{
+  vsmodel  vs ( 128, 4000 ) ;
+  uint8_t  data[45] ;
+
+  memset ( data, 0x55, sizeof(data) ) ;
+  CHECK ( vs.burst ( data, sizeof(data), 2000 ) == sizeof(data) ) ;
+  CHECK ( vs.out.size() == sizeof(data) ) ;
+  CHECK ( vs.maxblk == BLKSIZ ) ;
+}
+
+
+int main()
+{
+  RUN ( test_stream_in_order ) ;
+  RUN ( test_dreq_low ) ;
+  RUN ( test_fifo_full ) ;
+  RUN ( test_maxus ) ;
+  RUN ( test_short_tail ) ;
+  return testfails ;
+}
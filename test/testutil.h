@@ -0,0 +1,25 @@
+// testutil.h
+// Minimal checks for the host tests.  A failed check is reported and counted, main() returns the
+// number of failures.
+//
+#include <stdio.h>
+
+static int testfails = 0 ;                                    // Number of failed checks
+
+#define CHECK(c)                                                                \
+  do                                                                            \
+  {                                                                             \
+    if ( !( c ) )                                                               \
+    {                                                                           \
+      printf ( "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c ) ;          \
+      testfails++ ;                                                             \
+    }                                                                           \
+  } while ( 0 )
+
+#define RUN(t)                                                                  \
+  do                                                                            \
+  {                                                                             \
+    int f = testfails ;                                                         \
+    t() ;                                                                       \
+    printf ( "%-32s %s\n", #t, ( f == testfails ) ? "ok" : "FAILED" ) ;         \
+  } while ( 0 )